@@ -0,0 +1,43 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+
+/* Decoration hit map, as carried by the update_hit_map request */
+
+#ifndef DECO_HIT_MAP_H
+#define DECO_HIT_MAP_H
+
+#include <stdint.h>
+
+/**
+ * The array of the request is a sequence of these, in surface coordinates.
+ * The first region containing the pointer wins, points outside all of
+ * them go through the decoration.
+ */
+typedef struct
+{
+  int32_t  x, y, width, height;
+  /* one of DECO_HIT_* */
+  uint32_t type;
+  /* resize: the edges, as WLR_EDGE_* bits; button: the button function */
+  uint32_t detail;
+} DecoHitRegion;
+
+enum
+{
+  /* the compositor starts a move */
+  DECO_HIT_MOVE   = 0,
+  /* the compositor starts a resize */
+  DECO_HIT_RESIZE = 1,
+  /* the pointer is forwarded to the decoration client */
+  DECO_HIT_BUTTON = 2,
+};
+
+/* the same values as enum wlr_edges */
+enum
+{
+  DECO_EDGE_TOP    = 1,
+  DECO_EDGE_BOTTOM = 2,
+  DECO_EDGE_LEFT   = 4,
+  DECO_EDGE_RIGHT  = 8,
+};
+
+#endif
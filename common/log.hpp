@@ -0,0 +1,89 @@
+#ifndef DECO_LOG_HPP
+#define DECO_LOG_HPP
+
+/*
+ * Leveled logging, shared by the plugin and the decorator.
+ *
+ * Messages above DECO_LOG_MAX_LEVEL are compiled out, arguments included:
+ * builds with NDEBUG keep up to info, the others keep everything. The
+ * rest are filtered at runtime by the WF_DECORATOR_LOG environment
+ * variable, one of error, warn, info, debug and trace, or a number from
+ * 0 to 4; the default is info.
+ *
+ * DLOGE() to DLOGT() take printf style arguments and write to stdout or,
+ * for errors and warnings, to stderr. DSLOGE() to DSLOGT() take stream
+ * style arguments, the way wayfire's LOG does; they are only there when
+ * DECO_LOG_STREAM(level, ...) is defined before including this header,
+ * as the plugin does to go through the wayfire log.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define DECO_LOG_ERROR 0
+#define DECO_LOG_WARN  1
+#define DECO_LOG_INFO  2
+#define DECO_LOG_DEBUG 3
+#define DECO_LOG_TRACE 4
+
+#ifndef DECO_LOG_MAX_LEVEL
+#  ifdef NDEBUG
+#    define DECO_LOG_MAX_LEVEL DECO_LOG_INFO
+#  else
+#    define DECO_LOG_MAX_LEVEL DECO_LOG_TRACE
+#  endif
+#endif
+
+static inline int deco_log_parse_level (const char *value)
+{
+    static const char *names[] = {"error", "warn", "info", "debug", "trace"};
+    if (value == NULL || *value == '\0')
+        return DECO_LOG_INFO;
+    if (value[0] >= '0' && value[0] <= '9')
+    {
+        int level = atoi (value);
+        return level > DECO_LOG_TRACE ? DECO_LOG_TRACE : level;
+    }
+    for (int i = 0; i <= DECO_LOG_TRACE; i++)
+    {
+        if (strcmp (value, names[i]) == 0)
+            return i;
+    }
+    return DECO_LOG_INFO;
+}
+
+// read once, the environment doesn't change under us
+static inline int deco_log_level ()
+{
+    static const int level = deco_log_parse_level (getenv ("WF_DECORATOR_LOG"));
+    return level;
+}
+
+#define DECO_LOG_ENABLED(level) \
+    ((level) <= DECO_LOG_MAX_LEVEL && (level) <= deco_log_level ())
+
+#define DECO_LOG_WRITE(level, ...) \
+    fprintf ((level) <= DECO_LOG_WARN ? stderr : stdout, __VA_ARGS__)
+
+#define DECO_LOG(level, ...) \
+    do { if (DECO_LOG_ENABLED (level)) DECO_LOG_WRITE (level, __VA_ARGS__); } while (0)
+
+#define DLOGE(...) DECO_LOG (DECO_LOG_ERROR, __VA_ARGS__)
+#define DLOGW(...) DECO_LOG (DECO_LOG_WARN, __VA_ARGS__)
+#define DLOGI(...) DECO_LOG (DECO_LOG_INFO, __VA_ARGS__)
+#define DLOGD(...) DECO_LOG (DECO_LOG_DEBUG, __VA_ARGS__)
+#define DLOGT(...) DECO_LOG (DECO_LOG_TRACE, __VA_ARGS__)
+
+#ifdef DECO_LOG_STREAM
+#define DECO_SLOG(level, ...) \
+    do { if (DECO_LOG_ENABLED (level)) DECO_LOG_STREAM (level, __VA_ARGS__); } while (0)
+
+#define DSLOGE(...) DECO_SLOG (DECO_LOG_ERROR, __VA_ARGS__)
+#define DSLOGW(...) DECO_SLOG (DECO_LOG_WARN, __VA_ARGS__)
+#define DSLOGI(...) DECO_SLOG (DECO_LOG_INFO, __VA_ARGS__)
+#define DSLOGD(...) DECO_SLOG (DECO_LOG_DEBUG, __VA_ARGS__)
+#define DSLOGT(...) DECO_SLOG (DECO_LOG_TRACE, __VA_ARGS__)
+#endif
+
+#endif /* end of include guard: DECO_LOG_HPP */
@@ -0,0 +1,125 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+
+/* Trace event timeline, shared by the plugin and the decorator */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include "trace.h"
+
+int deco_trace_enabled = 0;
+
+static FILE *trace_file = NULL;
+static int trace_pid;
+
+static int
+current_tid (void)
+{
+  return (int) syscall (SYS_gettid);
+}
+
+uint64_t
+deco_trace_now (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void
+deco_trace_init (const char *process_name)
+{
+  const char *dir;
+  char path[4096];
+
+  dir = getenv ("WF_DECORATOR_TRACE");
+  if (dir == NULL || *dir == '\0' || trace_file != NULL)
+    return;
+
+  trace_pid = (int) getpid ();
+  snprintf (path, sizeof (path), "%s/%s-%d.json", dir, process_name, trace_pid);
+  trace_file = fopen (path, "w");
+  if (trace_file == NULL)
+    {
+      fprintf (stderr, "cannot write the trace to %s\n", path);
+      return;
+    }
+
+  /* one event per line, each flushed as its line ends: what was traced
+   * is on disk even if the process is killed before deco_trace_close ()
+   */
+  setvbuf (trace_file, NULL, _IOLBF, 0);
+
+  /* every later event is written with a leading comma */
+  fprintf (trace_file,
+           "[\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,"
+           "\"args\":{\"name\":\"%s\"}}\n",
+           trace_pid, current_tid (), process_name);
+  deco_trace_enabled = 1;
+}
+
+void
+deco_trace_close (void)
+{
+  if (trace_file == NULL)
+    return;
+
+  deco_trace_enabled = 0;
+  fprintf (trace_file, "]\n");
+  fclose (trace_file);
+  trace_file = NULL;
+}
+
+/* ts and dur are in microseconds, the nanoseconds go in the decimals;
+ * one fprintf per event, stdio keeps them whole across threads
+ */
+void
+deco_trace_span (const char *category,
+                 const char *name,
+                 uint64_t    start,
+                 uint64_t    end)
+{
+  if (trace_file == NULL)
+    return;
+
+  fprintf (trace_file,
+           ",{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,"
+           "\"ts\":%.3f,\"dur\":%.3f}\n",
+           name, category, trace_pid, current_tid (),
+           start / 1000.0, (end - start) / 1000.0);
+}
+
+void
+deco_trace_instant (const char *category,
+                    const char *name,
+                    int64_t     id)
+{
+  if (trace_file == NULL)
+    return;
+
+  fprintf (trace_file,
+           ",{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"pid\":%d,\"tid\":%d,"
+           "\"ts\":%.3f,\"args\":{\"id\":%lld}}\n",
+           name, category, trace_pid, current_tid (),
+           deco_trace_now () / 1000.0, (long long) id);
+}
+
+void
+deco_trace_counter (const char *category,
+                    const char *name,
+                    int64_t     id,
+                    int64_t     value)
+{
+  if (trace_file == NULL)
+    return;
+
+  fprintf (trace_file,
+           ",{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"C\",\"id\":\"%lld\",\"pid\":%d,\"tid\":%d,"
+           "\"ts\":%.3f,\"args\":{\"value\":%lld}}\n",
+           name, category, (long long) id, trace_pid, current_tid (),
+           deco_trace_now () / 1000.0, (long long) value);
+}
@@ -0,0 +1,90 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+
+/* Trace event timeline, shared by the plugin and the decorator */
+
+#ifndef DECO_TRACE_H
+#define DECO_TRACE_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * When WF_DECORATOR_TRACE names a directory, each process writes there
+ * <process_name>-<pid>.json in the Chrome trace event format, which
+ * Perfetto and chrome://tracing open. Timestamps come from
+ * CLOCK_MONOTONIC, so the files of the plugin and of the decorator
+ * line up when merged into one timeline, e.g. with jq -s add.
+ *
+ * Names and categories are written as they are, they must be literals
+ * not needing JSON escapes.
+ */
+void     deco_trace_init    (const char *process_name);
+void     deco_trace_close   (void);
+
+/* Nanoseconds on the monotonic clock */
+uint64_t deco_trace_now     (void);
+
+/* A complete span, start and end from deco_trace_now () */
+void     deco_trace_span    (const char *category,
+                             const char *name,
+                             uint64_t    start,
+                             uint64_t    end);
+
+/* A point in time, with an id telling which object it is about */
+void     deco_trace_instant (const char *category,
+                             const char *name,
+                             int64_t     id);
+
+/* A sampled value, one counter per name and id */
+void     deco_trace_counter (const char *category,
+                             const char *name,
+                             int64_t     id,
+                             int64_t     value);
+
+extern int deco_trace_enabled;
+
+#define DECO_TRACE_BEGIN(var) \
+  uint64_t var = deco_trace_enabled ? deco_trace_now () : 0
+
+#define DECO_TRACE_END(var, category, name) \
+  do { if (deco_trace_enabled) deco_trace_span (category, name, var, deco_trace_now ()); } while (0)
+
+#define DECO_TRACE_INSTANT(category, name, id) \
+  do { if (deco_trace_enabled) deco_trace_instant (category, name, id); } while (0)
+
+#define DECO_TRACE_COUNTER(category, name, id, value) \
+  do { if (deco_trace_enabled) deco_trace_counter (category, name, id, value); } while (0)
+
+#ifdef __cplusplus
+}
+
+// a span covering the rest of the enclosing block
+class deco_trace_scope_t
+{
+    const char *category;
+    const char *name;
+    uint64_t start;
+
+public:
+
+    deco_trace_scope_t (const char *category, const char *name) :
+        category (category), name (name), start (deco_trace_enabled ? deco_trace_now () : 0)
+    {}
+
+    ~deco_trace_scope_t ()
+    {
+        if (deco_trace_enabled && start)
+            deco_trace_span (category, name, start, deco_trace_now ());
+    }
+};
+
+#define DECO_TRACE_CONCAT_(a, b) a##b
+#define DECO_TRACE_CONCAT(a, b) DECO_TRACE_CONCAT_(a, b)
+#define DECO_TRACE_SCOPE(category, name) \
+    deco_trace_scope_t DECO_TRACE_CONCAT(deco_trace_scope_, __LINE__) (category, name)
+#endif
+
+#endif
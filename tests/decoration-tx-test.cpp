@@ -0,0 +1,302 @@
+// Drives decoration_tx_t through a fake host, the way extern_decoration_object_t does, with a
+// simulated decorated client and decorator answering after given delays, and checks when the
+// transaction gets ready. The clock is simulated, so the times reported are those the protocol
+// takes, not the machine; with --bench the state machine itself is timed.
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <map>
+#include <vector>
+
+#include "decoration-tx.hpp"
+
+#define BENCH_TRANSACTIONS 1000000
+
+static int failures;
+
+static const char *state_names[] = {"STABLE", "START", "TENTATIVE", "WAITING_FINAL"};
+
+#define CHECK(scenario, cond) \
+    do { if (!(cond)) { std::fprintf(stderr, "FAIL %s: %s\n", scenario, #cond); failures++; } } while (0)
+
+// the decoration of one view: the transaction, and the two clients answering it
+class fake_host_t : public decoration_tx_host_t
+{
+    // pending events, by simulated time in ms
+    std::multimap<int, std::function<void()>> events;
+
+  public:
+    decoration_tx_t tx{*this};
+    int now = 0;
+
+    // how long the decorator takes to commit a frame of a configured size
+    int decorator_delay = 0;
+    // a frame of this size comes first, as a decorator still drawing the previous one
+    deco_size_t wrong_size;
+    // each frame is committed twice
+    bool double_commit = false;
+    // the decorator doesn't draw at all
+    bool silent = false;
+    // the decoration surface goes away at this time, if not negative
+    int destroy_at = -1;
+
+    std::vector<deco_size_t> requests;
+    std::vector<deco_tx_state_t> states;
+    int ready_count = 0;
+    int ready_at = -1;
+    bool destroyed = false;
+
+    void at(int delay, std::function<void()> event)
+    {
+        events.emplace(now + delay, std::move(event));
+    }
+
+    void request_size(deco_size_t size) override
+    {
+        requests.push_back(size);
+        if (silent)
+            return;
+        if (wrong_size.width)
+        {
+            deco_size_t wrong = wrong_size;
+            at(decorator_delay / 2, [=] () { commit_frame(wrong); });
+            wrong_size = {};
+        }
+        at(decorator_delay, [=] () { commit_frame(size); });
+    }
+
+    void commit_frame(deco_size_t size)
+    {
+        if (destroyed)
+            return;
+        tx.surface_committed(size);
+        if (double_commit)
+            tx.surface_committed(size);
+    }
+
+    void ready() override
+    {
+        if (ready_count++ == 0)
+            ready_at = now;
+    }
+
+    void state_changed(deco_tx_state_t state) override
+    {
+        states.push_back(state);
+    }
+
+    // the decorated client takes final, client_delay after the transaction commits
+    void transaction(deco_size_t pending, deco_size_t current, deco_size_t final, int client_delay)
+    {
+        tx.commit(pending, current);
+        at(client_delay, [=] () { tx.set_final_size(final); });
+        if (destroy_at >= 0)
+        {
+            at(destroy_at, [=] ()
+            {
+                destroyed = true;
+                tx.destroyed();
+            });
+        }
+    }
+
+    void run()
+    {
+        while (!events.empty())
+        {
+            auto next = events.begin();
+            now = next->first;
+            auto event = std::move(next->second);
+            events.erase(next);
+            event();
+        }
+    }
+};
+
+static const deco_size_t small = {300, 200};
+static const deco_size_t large = {640, 480};
+static const deco_size_t odd = {643, 481};
+
+static void report(const char *scenario, const fake_host_t& host)
+{
+    std::printf("%-40s ready after %3d ms, %zu size requests, ends %s\n", scenario, host.ready_at,
+        host.requests.size(), state_names[(int)host.tx.get_state()]);
+}
+
+static void check_ready(const char *scenario, fake_host_t& host, int expected_at)
+{
+    host.run();
+    report(scenario, host);
+    CHECK(scenario, host.ready_count == 1);
+    CHECK(scenario, host.ready_at == expected_at);
+    CHECK(scenario, host.tx.get_state() == deco_tx_state_t::STABLE);
+}
+
+static void check_same_size()
+{
+    fake_host_t host;
+    host.decorator_delay = 10;
+    host.transaction(large, large, large, 10);
+    check_ready("same size", host, 0);
+    CHECK("same size", host.requests.empty());
+}
+
+static void check_decorator_first()
+{
+    fake_host_t host;
+    host.decorator_delay = 5;
+    host.transaction(large, small, large, 20);
+    check_ready("decorator before the client", host, 20);
+    CHECK("decorator before the client", host.requests.size() == 1);
+    CHECK("decorator before the client", host.states.size() >= 2 &&
+        host.states[1] == deco_tx_state_t::TENTATIVE);
+}
+
+static void check_client_first()
+{
+    fake_host_t host;
+    host.decorator_delay = 20;
+    host.transaction(large, small, large, 5);
+    check_ready("client before the decorator", host, 20);
+    CHECK("client before the decorator", host.requests.size() == 1);
+    CHECK("client before the decorator", host.states.size() >= 2 &&
+        host.states[1] == deco_tx_state_t::WAITING_FINAL);
+}
+
+// the decorated client doesn't take the size asked, the decoration is configured again
+static void check_client_other_size()
+{
+    fake_host_t host;
+    host.decorator_delay = 10;
+    host.transaction(large, small, odd, 5);
+    check_ready("client takes another size, early", host, 15);
+    CHECK("client takes another size, early", host.requests.size() == 2 && host.requests[1] == odd);
+
+    fake_host_t late;
+    late.decorator_delay = 5;
+    late.transaction(large, small, odd, 20);
+    check_ready("client takes another size, late", late, 25);
+    CHECK("client takes another size, late", late.requests.size() == 2 && late.requests[1] == odd);
+}
+
+// frames of another size, or drawn before the decorator knew what for, don't count
+static void check_wrong_frames()
+{
+    fake_host_t host;
+    host.decorator_delay = 10;
+    host.wrong_size = small;
+    host.transaction(large, small, large, 5);
+    check_ready("decorator commits a wrong size", host, 10);
+
+    fake_host_t stale;
+    stale.decorator_delay = 1000;
+    stale.transaction(large, small, large, 5);
+    stale.at(10, [&] () { CHECK("stale frame first", !stale.tx.surface_committed(large, false)); });
+    check_ready("stale frame first", stale, 1000);
+}
+
+static void check_double_commits()
+{
+    fake_host_t host;
+    host.decorator_delay = 5;
+    host.double_commit = true;
+    host.transaction(large, small, large, 20);
+    check_ready("decorator commits twice, tentative", host, 20);
+
+    fake_host_t waiting;
+    waiting.decorator_delay = 20;
+    waiting.double_commit = true;
+    waiting.transaction(large, small, large, 5);
+    check_ready("decorator commits twice, waiting", waiting, 20);
+
+    // a second transaction before the first is done: the frame of the first size doesn't count
+    fake_host_t twice;
+    twice.decorator_delay = 10;
+    twice.tx.commit(large, small);
+    twice.at(3, [&] () { twice.transaction(odd, small, odd, 5); });
+    check_ready("transaction commits twice", twice, 13);
+    CHECK("transaction commits twice", twice.requests.size() == 2);
+}
+
+static void check_destroyed()
+{
+    fake_host_t host;
+    host.decorator_delay = 1000;
+    host.destroy_at = 10;
+    host.transaction(large, small, large, 5);
+    check_ready("destroyed while waiting", host, 10);
+
+    fake_host_t stable;
+    stable.transaction(large, large, large, 5);
+    stable.run();
+    stable.tx.destroyed();
+    CHECK("destroyed when stable", stable.ready_count == 1);
+
+    // without a frame nor a destroy the transaction waits, the plugin relies on destroyed ()
+    fake_host_t never;
+    never.silent = true;
+    never.transaction(large, small, large, 5);
+    never.run();
+    CHECK("decorator never answers", never.ready_count == 0);
+    CHECK("decorator never answers", never.tx.get_state() == deco_tx_state_t::WAITING_FINAL);
+}
+
+// the cost of the state machine, for a transaction of each kind
+static void bench()
+{
+    struct counting_host_t : public decoration_tx_host_t
+    {
+        long requests = 0, ready_count = 0;
+        void request_size(deco_size_t) override { requests++; }
+        void ready() override { ready_count++; }
+    } host;
+    decoration_tx_t tx{host};
+
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < BENCH_TRANSACTIONS; i++)
+    {
+        deco_size_t pending = {300 + (i & 255), 200 + (i & 127)};
+        deco_size_t final = (i & 3) ? pending : deco_size_t{pending.width + 1, pending.height};
+        tx.commit(pending, {0, 0});
+        if (i & 1)
+        {
+            tx.surface_committed(pending);
+            tx.set_final_size(final);
+        } else
+        {
+            tx.set_final_size(final);
+            tx.surface_committed(pending);
+        }
+        tx.surface_committed(final);
+    }
+    auto elapsed = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start);
+    std::printf("%d transactions, %.1f ns each, %ld ready\n", BENCH_TRANSACTIONS,
+        elapsed.count() / BENCH_TRANSACTIONS, host.ready_count);
+}
+
+int main(int argc, char **argv)
+{
+    if (argc > 1 && std::strcmp(argv[1], "--bench") == 0)
+    {
+        bench();
+        return 0;
+    }
+
+    check_same_size();
+    check_decorator_first();
+    check_client_first();
+    check_client_other_size();
+    check_wrong_frames();
+    check_double_commits();
+    check_destroyed();
+
+    if (failures)
+    {
+        std::fprintf(stderr, "%d failures\n", failures);
+        return 1;
+    }
+
+    return 0;
+}
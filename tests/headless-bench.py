@@ -0,0 +1,206 @@
+#!/usr/bin/env python3
+
+# Runs wayfire on the wlroots headless backend with the pixman renderer, the
+# plugin and the decorator built here, maps N views with stress-client for
+# each N given, and reports from the trace of the plugin:
+#
+#  - how long until all the views are decorated, from the first request to
+#    the decorator to the last decoration surface adopted;
+#  - the round trip of the resize of a decoration, from the transaction
+#    commit to the frame of the final size;
+#  - the cost of a focus change in the plugin;
+#  - the resident memory of the decorator processes.
+#
+# No GPU nor display needed. Exits 77, which meson takes as skipped, when
+# wayfire doesn't start.
+
+import argparse
+import glob
+import json
+import os
+import shutil
+import signal
+import statistics
+import subprocess
+import sys
+import tempfile
+import time
+
+EXIT_SKIP = 77
+# how long wayfire has to create its socket, and to quit
+START_TIMEOUT = 10
+STOP_TIMEOUT = 10
+
+WAYFIRE_INI = """
+[core]
+plugins = {plugin}
+xwayland = false
+
+[wf-external-decorator]
+decorator = {decorator}
+decorator_processes = {processes}
+"""
+
+
+def wait_for_socket(runtime_dir, wayfire):
+    deadline = time.monotonic() + START_TIMEOUT
+    while time.monotonic() < deadline:
+        if wayfire.poll() is not None:
+            return None
+        sockets = [s for s in glob.glob(os.path.join(runtime_dir, "wayland-*")) if not s.endswith(".lock")]
+        if sockets:
+            return os.path.basename(sockets[0])
+        time.sleep(0.05)
+    return None
+
+
+def stop(process):
+    if process.poll() is not None:
+        return
+    process.send_signal(signal.SIGTERM)
+    try:
+        process.wait(STOP_TIMEOUT)
+    except subprocess.TimeoutExpired:
+        process.kill()
+        process.wait()
+
+
+# the events of all the traces; a process killed leaves its trace without the closing ]
+def load_traces(trace_dir):
+    events = []
+    for path in glob.glob(os.path.join(trace_dir, "*.json")):
+        with open(path) as f:
+            text = f.read()
+        try:
+            events += json.loads(text)
+        except json.JSONDecodeError:
+            events += json.loads(text.rstrip().rstrip(",") + "]")
+    return events
+
+
+def percentile(values, fraction):
+    values = sorted(values)
+    return values[min(len(values) - 1, int(len(values) * fraction))]
+
+
+def summarize(views, events):
+    spans = lambda name: [e for e in events if e.get("ph") == "X" and e["name"] == name]
+
+    created = spans("create decoration")
+    decorated_ms = 0
+    if created:
+        decorated_ms = (max(e["ts"] + e["dur"] for e in created) - min(e["ts"] for e in created)) / 1000
+
+    round_trips = [e["dur"] / 1000 for e in spans("decoration round trip")]
+    focus = [e["dur"] for e in spans("view activated")]
+
+    # the peak of each decorator process, all of them together
+    resident = {}
+    for e in events:
+        if e.get("ph") == "C" and e["name"] == "decorator resident kB":
+            resident[e["id"]] = max(resident.get(e["id"], 0), e["args"]["value"])
+
+    return {
+        "views": views,
+        "decorated": len(created),
+        "all decorated ms": round(decorated_ms, 1),
+        "resizes": len(round_trips),
+        "round trip median ms": round(statistics.median(round_trips), 2) if round_trips else None,
+        "round trip p95 ms": round(percentile(round_trips, 0.95), 2) if round_trips else None,
+        "focus changes": len(focus),
+        "focus mean us": round(statistics.mean(focus), 1) if focus else None,
+        "focus max us": round(max(focus), 1) if focus else None,
+        "decorator kB": sum(resident.values()),
+    }
+
+
+def run(args, views):
+    work = tempfile.mkdtemp(prefix="wf-decorator-bench-")
+    try:
+        runtime_dir = os.path.join(work, "runtime")
+        trace_dir = os.path.join(work, "trace")
+        os.makedirs(runtime_dir, mode=0o700)
+        os.makedirs(trace_dir)
+        config = os.path.join(work, "wayfire.ini")
+        with open(config, "w") as f:
+            f.write(WAYFIRE_INI.format(plugin=args.plugin, decorator=args.decorator, processes=args.processes))
+
+        env = dict(os.environ)
+        env.pop("WAYLAND_DISPLAY", None)
+        env.pop("DISPLAY", None)
+        env.update({
+            "WLR_BACKENDS": "headless",
+            "WLR_RENDERER": "pixman",
+            "WLR_HEADLESS_OUTPUTS": "1",
+            "XDG_RUNTIME_DIR": runtime_dir,
+            "WAYFIRE_PLUGIN_XML_PATH": args.metadata,
+            "WF_DECORATOR_TRACE": trace_dir,
+            "WF_DECORATOR_LOG": "warn",
+        })
+
+        with open(os.path.join(work, "wayfire.log"), "w") as log:
+            wayfire = subprocess.Popen([args.wayfire, "-c", config], env=env, stdout=log, stderr=log)
+            socket = wait_for_socket(runtime_dir, wayfire)
+            if socket is None:
+                stop(wayfire)
+                with open(os.path.join(work, "wayfire.log")) as f:
+                    sys.stderr.write(f.read()[-2000:])
+                print("wayfire did not start, skipping")
+                sys.exit(EXIT_SKIP)
+
+            # let the decorators bind and send their borders
+            time.sleep(args.settle / 1000)
+            env["WAYLAND_DISPLAY"] = socket
+            client = subprocess.run([args.client, str(views), str(args.settle)], env=env,
+                                    stdout=subprocess.PIPE, universal_newlines=True)
+            sys.stderr.write(client.stdout)
+            stop(wayfire)
+
+        if client.returncode != 0:
+            print("stress-client failed with", client.returncode)
+            sys.exit(1)
+        return summarize(views, load_traces(trace_dir))
+    finally:
+        if args.keep:
+            print("kept", work, file=sys.stderr)
+        else:
+            shutil.rmtree(work, ignore_errors=True)
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Measures the decorations of N views on a headless wayfire")
+    parser.add_argument("--wayfire", default="wayfire")
+    parser.add_argument("--plugin", required=True, help="the plugin module, by its full path")
+    parser.add_argument("--decorator", required=True)
+    parser.add_argument("--client", required=True, help="stress-client")
+    parser.add_argument("--metadata", required=True, help="the directory of the plugin xml")
+    parser.add_argument("--views", default="10,50,200", help="the numbers of views, comma separated")
+    parser.add_argument("--processes", type=int, default=1, help="decorator processes")
+    parser.add_argument("--settle", type=int, default=1000, help="ms given to the decorations after each step")
+    parser.add_argument("--json", action="store_true", help="one json object per N instead of a table")
+    parser.add_argument("--keep", action="store_true", help="keep the traces and the wayfire log")
+    args = parser.parse_args()
+
+    if shutil.which(args.wayfire) is None:
+        print("no", args.wayfire, "to run, skipping")
+        sys.exit(EXIT_SKIP)
+
+    results = [run(args, int(n)) for n in args.views.split(",")]
+    if args.json:
+        for result in results:
+            print(json.dumps(result))
+        return
+
+    keys = list(results[0].keys())
+    print("  ".join(keys))
+    for result in results:
+        print("  ".join("%*s" % (len(k), "-" if result[k] is None else result[k]) for k in keys))
+
+    # every view must have had a decoration
+    if any(r["decorated"] < r["views"] for r in results):
+        print("some views were not decorated")
+        sys.exit(1)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,481 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+
+/* Checks the pixel kernels against their scalar code, and times them
+ * when run with --bench
+ */
+
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+/* The kernels are static, so they are built in here */
+#include "pixel-ops.c"
+
+#include <stdlib.h>
+
+#define BENCH_PIXELS 65536
+#define BENCH_ROUNDS 200
+
+/* Largest difference allowed from the floating point colorize the fixed
+ * point code replaced, per channel
+ */
+#define DOUBLE_TOLERANCE 2
+
+typedef struct
+{
+  const char *name;
+  ColorizeRowFunc func;
+  int n_channels;
+} ColorizeKernel;
+
+typedef int (* ScaleRowFunc) (guchar       *pixels,
+                              int           n_pixels,
+                              const guchar *alphas,
+                              guchar        alpha);
+
+typedef int (* RampRowFunc) (guint32      *dest,
+                             int           n_pixels,
+                             const gint32  start[4],
+                             const gint32  step[4]);
+
+typedef int (* FillRowFunc) (guint32 *dest,
+                             int      n_pixels,
+                             guint32  value);
+
+static GRand *rand_state;
+static int failures;
+
+static void
+fail (const char *what,
+      const char *name,
+      int         n_pixels,
+      int         x)
+{
+  if (failures++ < 20)
+    g_printerr ("FAIL %s %s: %d pixels, first difference at %d\n",
+                what, name, n_pixels, x);
+}
+
+static void
+random_bytes (guchar *bytes,
+              int     n)
+{
+  int i;
+
+  for (i = 0; i < n; i++)
+    bytes[i] = g_rand_int_range (rand_state, 0, 256);
+}
+
+static int
+colorize_kernels (ColorizeKernel *kernels)
+{
+  int n = 0;
+
+#ifdef HAVE_SSE2
+  kernels[n++] = (ColorizeKernel) { "sse2", colorize_rgba_sse2, 4 };
+#endif
+#ifdef HAVE_AVX2
+  __builtin_cpu_init ();
+  if (__builtin_cpu_supports ("avx2"))
+    kernels[n++] = (ColorizeKernel) { "avx2", colorize_rgba_avx2, 4 };
+#endif
+#ifdef HAVE_NEON
+  kernels[n++] = (ColorizeKernel) { "neon", colorize_rgba_neon, 4 };
+  kernels[n++] = (ColorizeKernel) { "neon", colorize_rgb_neon, 3 };
+#endif
+
+  return n;
+}
+
+/* The colorize of the theme engine before it went to fixed point */
+static void
+colorize_row_double (guchar       *dest,
+                     const guchar *src,
+                     int           n_pixels,
+                     int           n_channels,
+                     const guchar  color[3])
+{
+  double intensity, d;
+  int x, c;
+
+  for (x = 0; x < n_pixels; x++)
+    {
+      intensity = (src[0] * 0.30 + src[1] * 0.59 + src[2] * 0.11) / 255.0;
+
+      for (c = 0; c < 3; c++)
+        {
+          if (intensity <= 0.5)
+            d = color[c] / 255.0 * intensity * 2.0;
+          else
+            d = color[c] / 255.0 + (1.0 - color[c] / 255.0) * (intensity - 0.5) * 2.0;
+
+          dest[c] = CLAMP ((int) (255 * d), 0, 255);
+        }
+
+      if (n_channels == 4)
+        dest[3] = src[3];
+
+      src += n_channels;
+      dest += n_channels;
+    }
+}
+
+static int
+first_difference (const guchar *a,
+                  const guchar *b,
+                  int           n_bytes,
+                  int           tolerance)
+{
+  int i;
+
+  for (i = 0; i < n_bytes; i++)
+    if (ABS (a[i] - b[i]) > tolerance)
+      return i;
+
+  return -1;
+}
+
+static void
+check_colorize (void)
+{
+  ColorizeKernel kernels[4];
+  int n_kernels, k, n_channels, n_pixels, round, x;
+  guchar color[3];
+  guchar *src, *expected, *dest;
+  guint32 rgb;
+
+  n_kernels = colorize_kernels (kernels);
+  src = g_malloc (1100 * 4);
+  expected = g_malloc (1100 * 4);
+  dest = g_malloc (1100 * 4);
+
+  for (round = 0; round < 200; round++)
+    {
+      /* every tail length, then a long row */
+      n_pixels = round < 70 ? round : 1024 + round % 67;
+      rgb = round == 0 ? 0x000000 : round == 1 ? 0xffffff :
+            g_rand_int (rand_state) & 0xffffff;
+      color[0] = (rgb >> 16) & 0xff;
+      color[1] = (rgb >> 8) & 0xff;
+      color[2] = rgb & 0xff;
+
+      for (n_channels = 3; n_channels <= 4; n_channels++)
+        {
+          random_bytes (src, n_pixels * n_channels);
+          colorize_row_scalar (expected, src, n_pixels, n_channels, color);
+
+          for (k = 0; k < n_kernels; k++)
+            {
+              int done;
+
+              if (kernels[k].n_channels != n_channels)
+                continue;
+
+              memset (dest, 0, n_pixels * n_channels);
+              done = kernels[k].func (dest, src, n_pixels, color);
+              colorize_row_scalar (dest + done * n_channels, src + done * n_channels,
+                                   n_pixels - done, n_channels, color);
+
+              x = first_difference (dest, expected, n_pixels * n_channels, 0);
+              if (x >= 0)
+                fail ("colorize", kernels[k].name, n_pixels, x / n_channels);
+            }
+
+          meta_pixel_colorize_row (dest, src, n_pixels, n_channels, rgb);
+          x = first_difference (dest, expected, n_pixels * n_channels, 0);
+          if (x >= 0)
+            fail ("colorize", "meta_pixel_colorize_row", n_pixels, x / n_channels);
+
+          colorize_row_double (dest, src, n_pixels, n_channels, color);
+          x = first_difference (dest, expected, n_pixels * n_channels, DOUBLE_TOLERANCE);
+          if (x >= 0)
+            fail ("colorize", "double", n_pixels, x / n_channels);
+        }
+    }
+
+  g_free (src);
+  g_free (expected);
+  g_free (dest);
+}
+
+static void
+scale_row_scalar (guchar       *pixels,
+                  int           n_pixels,
+                  const guchar *alphas,
+                  guchar        alpha)
+{
+  int x, c;
+
+  for (x = 0; x < n_pixels; x++)
+    for (c = 0; c < 4; c++)
+      pixels[x * 4 + c] = div255 (pixels[x * 4 + c] * (alphas ? alphas[x] : alpha));
+}
+
+static void
+check_scale (void)
+{
+  ScaleRowFunc kernel = NULL;
+  guchar *pixels, *expected, *dest, *alphas;
+  int round, n_pixels, k, x, done;
+  guchar alpha;
+
+#if defined (HAVE_SSE2)
+  kernel = scale_row_sse2;
+#elif defined (HAVE_NEON)
+  kernel = scale_row_neon;
+#endif
+
+  pixels = g_malloc (1100 * 4);
+  expected = g_malloc (1100 * 4);
+  dest = g_malloc (1100 * 4);
+  alphas = g_malloc (1100);
+
+  for (round = 0; round < 200; round++)
+    {
+      n_pixels = round < 70 ? round : 1024 + round % 67;
+      random_bytes (pixels, n_pixels * 4);
+      random_bytes (alphas, n_pixels);
+      alpha = round == 0 ? 0 : round == 1 ? 255 : g_rand_int_range (rand_state, 0, 256);
+
+      /* one alpha for the row, then one per pixel */
+      for (k = 0; k < 2; k++)
+        {
+          const guchar *row_alphas = k ? alphas : NULL;
+
+          memcpy (expected, pixels, n_pixels * 4);
+          scale_row_scalar (expected, n_pixels, row_alphas, alpha);
+
+          if (kernel)
+            {
+              memcpy (dest, pixels, n_pixels * 4);
+              done = kernel (dest, n_pixels, row_alphas, alpha);
+              scale_row_scalar (dest + done * 4, n_pixels - done,
+                                row_alphas ? row_alphas + done : NULL, alpha);
+              x = first_difference (dest, expected, n_pixels * 4, 0);
+              if (x >= 0)
+                fail ("scale", "simd", n_pixels, x / 4);
+            }
+
+          memcpy (dest, pixels, n_pixels * 4);
+          meta_pixel_scale_row ((guint32 *) dest, n_pixels, row_alphas, alpha);
+          x = first_difference (dest, expected, n_pixels * 4, 0);
+          if (x >= 0)
+            fail ("scale", "meta_pixel_scale_row", n_pixels, x / 4);
+        }
+    }
+
+  g_free (pixels);
+  g_free (expected);
+  g_free (dest);
+  g_free (alphas);
+}
+
+static void
+ramp_row_scalar (guint32      *dest,
+                 int           n_pixels,
+                 const gint32  start[4],
+                 const gint32  step[4])
+{
+  int x;
+
+  for (x = 0; x < n_pixels; x++)
+    dest[x] = pack_argb (start[0] + x * step[0], start[1] + x * step[1],
+                         start[2] + x * step[2], start[3] + x * step[3]);
+}
+
+static void
+check_ramp_and_fill (void)
+{
+  RampRowFunc ramp = NULL;
+  FillRowFunc fill = NULL;
+  guint32 *expected, *dest;
+  gint32 start[4], step[4], tail[4];
+  int round, n_pixels, c, x, done;
+  guint32 value;
+
+#if defined (HAVE_SSE2)
+  ramp = ramp_row_sse2;
+  fill = fill_row_sse2;
+#elif defined (HAVE_NEON)
+  ramp = ramp_row_neon;
+  fill = fill_row_neon;
+#endif
+
+  expected = g_new (guint32, 1100);
+  dest = g_new (guint32, 1100);
+
+  for (round = 0; round < 200; round++)
+    {
+      n_pixels = round < 70 ? round : 1024 + round % 67;
+
+      /* from one random value to another, as the gradients make them */
+      for (c = 0; c < 4; c++)
+        {
+          int first = g_rand_int_range (rand_state, 0, 256);
+          int last = g_rand_int_range (rand_state, 0, 256);
+
+          start[c] = (first << 16) + 0x8000;
+          step[c] = ((last - first) << 16) / MAX (n_pixels - 1, 1);
+        }
+
+      ramp_row_scalar (expected, n_pixels, start, step);
+
+      if (ramp)
+        {
+          memset (dest, 0, n_pixels * 4);
+          done = ramp (dest, n_pixels, start, step);
+          for (c = 0; c < 4; c++)
+            tail[c] = start[c] + done * step[c];
+          ramp_row_scalar (dest + done, n_pixels - done, tail, step);
+          x = first_difference ((guchar *) dest, (guchar *) expected, n_pixels * 4, 0);
+          if (x >= 0)
+            fail ("ramp", "simd", n_pixels, x / 4);
+        }
+
+      meta_pixel_ramp_row (dest, n_pixels, start, step);
+      x = first_difference ((guchar *) dest, (guchar *) expected, n_pixels * 4, 0);
+      if (x >= 0)
+        fail ("ramp", "meta_pixel_ramp_row", n_pixels, x / 4);
+
+      value = g_rand_int (rand_state);
+      for (x = 0; x < n_pixels; x++)
+        expected[x] = value;
+
+      if (fill)
+        {
+          memset (dest, 0, n_pixels * 4);
+          done = fill (dest, n_pixels, value);
+          for (x = done; x < n_pixels; x++)
+            dest[x] = value;
+          x = first_difference ((guchar *) dest, (guchar *) expected, n_pixels * 4, 0);
+          if (x >= 0)
+            fail ("fill", "simd", n_pixels, x / 4);
+        }
+
+      meta_pixel_fill_row (dest, n_pixels, value);
+      x = first_difference ((guchar *) dest, (guchar *) expected, n_pixels * 4, 0);
+      if (x >= 0)
+        fail ("fill", "meta_pixel_fill_row", n_pixels, x / 4);
+    }
+
+  g_free (expected);
+  g_free (dest);
+}
+
+static void
+report (const char *what,
+        const char *name,
+        gint64      start)
+{
+  double ms = (g_get_monotonic_time () - start) / 1000.0 / BENCH_ROUNDS;
+
+  g_print ("%-10s %-8s %8.3f ms per %d pixels\n", what, name, ms, BENCH_PIXELS);
+}
+
+static void
+bench (void)
+{
+  ColorizeKernel kernels[4];
+  int n_kernels, k, round;
+  guchar color[3] = { 0x33, 0x66, 0x99 };
+  guchar *src, *dest, *alphas;
+  gint32 start[4] = { 0x8000, 0x108000, 0x208000, 0x408000 };
+  gint32 step[4] = { 0x100, 0x80, 0x40, 0x20 };
+  gint64 t;
+
+  src = g_malloc (BENCH_PIXELS * 4);
+  dest = g_malloc (BENCH_PIXELS * 4);
+  alphas = g_malloc (BENCH_PIXELS);
+  random_bytes (src, BENCH_PIXELS * 4);
+  random_bytes (alphas, BENCH_PIXELS);
+
+  t = g_get_monotonic_time ();
+  for (round = 0; round < BENCH_ROUNDS; round++)
+    colorize_row_double (dest, src, BENCH_PIXELS, 4, color);
+  report ("colorize", "double", t);
+
+  t = g_get_monotonic_time ();
+  for (round = 0; round < BENCH_ROUNDS; round++)
+    colorize_row_scalar (dest, src, BENCH_PIXELS, 4, color);
+  report ("colorize", "scalar", t);
+
+  n_kernels = colorize_kernels (kernels);
+  for (k = 0; k < n_kernels; k++)
+    {
+      if (kernels[k].n_channels != 4)
+        continue;
+
+      t = g_get_monotonic_time ();
+      for (round = 0; round < BENCH_ROUNDS; round++)
+        kernels[k].func (dest, src, BENCH_PIXELS, color);
+      report ("colorize", kernels[k].name, t);
+    }
+
+  memcpy (dest, src, BENCH_PIXELS * 4);
+  t = g_get_monotonic_time ();
+  for (round = 0; round < BENCH_ROUNDS; round++)
+    scale_row_scalar (dest, BENCH_PIXELS, alphas, 0);
+  report ("scale", "scalar", t);
+
+  t = g_get_monotonic_time ();
+  for (round = 0; round < BENCH_ROUNDS; round++)
+    meta_pixel_scale_row ((guint32 *) dest, BENCH_PIXELS, alphas, 0);
+  report ("scale", "best", t);
+
+  t = g_get_monotonic_time ();
+  for (round = 0; round < BENCH_ROUNDS; round++)
+    for (k = 0; k < BENCH_PIXELS; k += 256)
+      ramp_row_scalar ((guint32 *) dest + k, 256, start, step);
+  report ("ramp", "scalar", t);
+
+  t = g_get_monotonic_time ();
+  for (round = 0; round < BENCH_ROUNDS; round++)
+    for (k = 0; k < BENCH_PIXELS; k += 256)
+      meta_pixel_ramp_row ((guint32 *) dest + k, 256, start, step);
+  report ("ramp", "best", t);
+
+  g_free (src);
+  g_free (dest);
+  g_free (alphas);
+}
+
+int
+main (int    argc,
+      char **argv)
+{
+  rand_state = g_rand_new_with_seed (20240917);
+
+  if (argc > 1 && strcmp (argv[1], "--bench") == 0)
+    {
+      bench ();
+      g_rand_free (rand_state);
+      return 0;
+    }
+
+  check_colorize ();
+  check_scale ();
+  check_ramp_and_fill ();
+
+  g_rand_free (rand_state);
+
+  if (failures)
+    {
+      g_printerr ("%d failures\n", failures);
+      return 1;
+    }
+
+  return 0;
+}
@@ -0,0 +1,305 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+
+/* Maps a number of xdg toplevels, resizes each of them once and closes
+ * them one by one, for headless-bench.py to measure what the decorations
+ * of as many views cost
+ */
+
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+#define _GNU_SOURCE
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <wayland-client.h>
+#include "xdg-shell-client-protocol.h"
+
+#define SMALL_WIDTH   200
+#define SMALL_HEIGHT  150
+#define LARGE_WIDTH   320
+#define LARGE_HEIGHT  240
+#define STRIDE        (LARGE_WIDTH * 4)
+#define POOL_SIZE     (STRIDE * LARGE_HEIGHT)
+
+/* time given to the decorations after each step, ms */
+#define DEFAULT_SETTLE 1000
+
+typedef struct
+{
+  struct wl_surface *surface;
+  struct xdg_surface *xdg_surface;
+  struct xdg_toplevel *toplevel;
+  struct wl_buffer *small, *large, *current;
+  int configured;
+} Window;
+
+static struct wl_compositor *compositor;
+static struct wl_shm *shm;
+static struct xdg_wm_base *wm_base;
+static struct wl_shm_pool *pool;
+static int n_configured;
+
+static double
+now_ms (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+static void
+wm_base_ping (void               *data,
+              struct xdg_wm_base *base,
+              uint32_t            serial)
+{
+  xdg_wm_base_pong (base, serial);
+}
+
+static const struct xdg_wm_base_listener wm_base_listener = {
+  .ping = wm_base_ping,
+};
+
+static void
+registry_global (void               *data,
+                 struct wl_registry *registry,
+                 uint32_t            name,
+                 const char         *interface,
+                 uint32_t            version)
+{
+  if (strcmp (interface, wl_compositor_interface.name) == 0)
+    compositor = wl_registry_bind (registry, name, &wl_compositor_interface, 4);
+  else if (strcmp (interface, wl_shm_interface.name) == 0)
+    shm = wl_registry_bind (registry, name, &wl_shm_interface, 1);
+  else if (strcmp (interface, xdg_wm_base_interface.name) == 0)
+    {
+      wm_base = wl_registry_bind (registry, name, &xdg_wm_base_interface, 1);
+      xdg_wm_base_add_listener (wm_base, &wm_base_listener, NULL);
+    }
+}
+
+static void
+registry_global_remove (void               *data,
+                        struct wl_registry *registry,
+                        uint32_t            name)
+{
+}
+
+static const struct wl_registry_listener registry_listener = {
+  .global = registry_global,
+  .global_remove = registry_global_remove,
+};
+
+/* the window keeps the size it chose, whatever the configure says */
+static void
+xdg_surface_configure (void               *data,
+                       struct xdg_surface *xdg_surface,
+                       uint32_t            serial)
+{
+  Window *window = data;
+
+  xdg_surface_ack_configure (xdg_surface, serial);
+  wl_surface_attach (window->surface, window->current, 0, 0);
+  wl_surface_damage (window->surface, 0, 0, LARGE_WIDTH, LARGE_HEIGHT);
+  wl_surface_commit (window->surface);
+  if (!window->configured)
+    {
+      window->configured = 1;
+      n_configured++;
+    }
+}
+
+static const struct xdg_surface_listener xdg_surface_listener = {
+  .configure = xdg_surface_configure,
+};
+
+static void
+toplevel_configure (void                *data,
+                    struct xdg_toplevel *toplevel,
+                    int32_t              width,
+                    int32_t              height,
+                    struct wl_array     *states)
+{
+}
+
+static void
+toplevel_close (void                *data,
+                struct xdg_toplevel *toplevel)
+{
+}
+
+static const struct xdg_toplevel_listener toplevel_listener = {
+  .configure = toplevel_configure,
+  .close = toplevel_close,
+};
+
+static void
+create_pool (void)
+{
+  int fd;
+  void *data;
+
+  fd = memfd_create ("stress-client", MFD_CLOEXEC);
+  if (fd < 0 || ftruncate (fd, POOL_SIZE) < 0)
+    {
+      perror ("memfd");
+      exit (1);
+    }
+
+  /* light grey, opaque */
+  data = mmap (NULL, POOL_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  memset (data, 0xc0, POOL_SIZE);
+  munmap (data, POOL_SIZE);
+
+  pool = wl_shm_create_pool (shm, fd, POOL_SIZE);
+  close (fd);
+}
+
+static void
+create_window (Window *window,
+               int     index)
+{
+  char title[64];
+
+  window->small = wl_shm_pool_create_buffer (pool, 0, SMALL_WIDTH, SMALL_HEIGHT,
+                                             STRIDE, WL_SHM_FORMAT_XRGB8888);
+  window->large = wl_shm_pool_create_buffer (pool, 0, LARGE_WIDTH, LARGE_HEIGHT,
+                                             STRIDE, WL_SHM_FORMAT_XRGB8888);
+  window->current = window->small;
+
+  window->surface = wl_compositor_create_surface (compositor);
+  window->xdg_surface = xdg_wm_base_get_xdg_surface (wm_base, window->surface);
+  xdg_surface_add_listener (window->xdg_surface, &xdg_surface_listener, window);
+  window->toplevel = xdg_surface_get_toplevel (window->xdg_surface);
+  xdg_toplevel_add_listener (window->toplevel, &toplevel_listener, window);
+
+  snprintf (title, sizeof (title), "stress %d", index);
+  xdg_toplevel_set_title (window->toplevel, title);
+  xdg_toplevel_set_app_id (window->toplevel, "wf-decorator-stress");
+  wl_surface_commit (window->surface);
+}
+
+static void
+destroy_window (Window *window)
+{
+  xdg_toplevel_destroy (window->toplevel);
+  xdg_surface_destroy (window->xdg_surface);
+  wl_surface_destroy (window->surface);
+  wl_buffer_destroy (window->small);
+  wl_buffer_destroy (window->large);
+}
+
+/* dispatches events for ms milliseconds */
+static void
+dispatch_for (struct wl_display *display,
+              int                ms)
+{
+  double end = now_ms () + ms;
+  struct pollfd fd = { wl_display_get_fd (display), POLLIN, 0 };
+
+  while (now_ms () < end)
+    {
+      while (wl_display_prepare_read (display) != 0)
+        wl_display_dispatch_pending (display);
+      wl_display_flush (display);
+      if (poll (&fd, 1, (int) (end - now_ms ()) + 1) > 0)
+        wl_display_read_events (display);
+      else
+        wl_display_cancel_read (display);
+      wl_display_dispatch_pending (display);
+    }
+}
+
+int
+main (int    argc,
+      char **argv)
+{
+  struct wl_display *display;
+  Window *windows;
+  double start;
+  int n_windows, settle, i;
+
+  if (argc < 2)
+    {
+      fprintf (stderr, "usage: %s views [settle ms]\n", argv[0]);
+      return 1;
+    }
+  n_windows = atoi (argv[1]);
+  settle = argc > 2 ? atoi (argv[2]) : DEFAULT_SETTLE;
+
+  display = wl_display_connect (NULL);
+  if (display == NULL)
+    {
+      fprintf (stderr, "cannot connect to the compositor\n");
+      return 1;
+    }
+  wl_registry_add_listener (wl_display_get_registry (display), &registry_listener, NULL);
+  wl_display_roundtrip (display);
+  if (!compositor || !shm || !wm_base)
+    {
+      fprintf (stderr, "the compositor has no xdg_wm_base\n");
+      return 1;
+    }
+  create_pool ();
+
+  /* map them all */
+  windows = calloc (n_windows, sizeof (Window));
+  start = now_ms ();
+  for (i = 0; i < n_windows; i++)
+    create_window (&windows[i], i);
+  while (n_configured < n_windows && wl_display_dispatch (display) >= 0)
+    ;
+  wl_display_roundtrip (display);
+  printf ("mapped %d views in %.1f ms\n", n_windows, now_ms () - start);
+  fflush (stdout);
+  dispatch_for (display, settle);
+
+  /* a resize the client starts, every decoration follows it */
+  start = now_ms ();
+  for (i = 0; i < n_windows; i++)
+    {
+      windows[i].current = windows[i].large;
+      wl_surface_attach (windows[i].surface, windows[i].current, 0, 0);
+      wl_surface_damage (windows[i].surface, 0, 0, LARGE_WIDTH, LARGE_HEIGHT);
+      wl_surface_commit (windows[i].surface);
+    }
+  wl_display_roundtrip (display);
+  printf ("resized %d views in %.1f ms\n", n_windows, now_ms () - start);
+  fflush (stdout);
+  dispatch_for (display, settle);
+
+  /* the focus goes to the next view each time one is closed */
+  start = now_ms ();
+  for (i = n_windows - 1; i >= 0; i--)
+    {
+      destroy_window (&windows[i]);
+      wl_display_roundtrip (display);
+    }
+  printf ("closed %d views in %.1f ms\n", n_windows, now_ms () - start);
+  dispatch_for (display, settle);
+
+  free (windows);
+  wl_shm_pool_destroy (pool);
+  wl_display_disconnect (display);
+
+  return 0;
+}
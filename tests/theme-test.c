@@ -0,0 +1,239 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+
+/* Draws op lists the way the frames of a theme do, and checks the
+ * pixels that come out
+ */
+
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+#include <glib/gstdio.h>
+#include <gtk/gtk.h>
+#include "theme.h"
+
+/* meson takes this exit status as a skipped test */
+#define EXIT_SKIP 77
+
+#define FRAME_WIDTH  200
+#define FRAME_HEIGHT 40
+#define BUTTON_SIZE  18
+#define IMAGE_SIZE   10
+#define IMAGE_PIXEL  0xffff0000 /* opaque red, as ARGB32 */
+
+static int failures;
+
+static guint32
+pixel_at (cairo_surface_t *surface,
+          int              x,
+          int              y)
+{
+  const guchar *data = cairo_image_surface_get_data (surface);
+  int stride = cairo_image_surface_get_stride (surface);
+
+  return *(const guint32 *) (data + y * stride + x * 4);
+}
+
+static void
+check_pixel (const char      *what,
+             cairo_surface_t *surface,
+             int              x,
+             int              y,
+             guint32          expected)
+{
+  guint32 pixel = pixel_at (surface, x, y);
+
+  if (pixel != expected)
+    {
+      g_printerr ("FAIL %s: pixel %d,%d is %08x, not %08x\n",
+                  what, x, y, pixel, expected);
+      failures++;
+    }
+}
+
+static char *
+write_image (const char *dir)
+{
+  GdkPixbuf *pixbuf;
+  GError *error = NULL;
+  char *path;
+
+  pixbuf = gdk_pixbuf_new (GDK_COLORSPACE_RGB, TRUE, 8, IMAGE_SIZE, IMAGE_SIZE);
+  gdk_pixbuf_fill (pixbuf, 0xff0000ff);
+
+  path = g_build_filename (dir, "button.png", NULL);
+  if (!gdk_pixbuf_save (pixbuf, path, "png", &error, NULL))
+    g_error ("Failed to write %s: %s", path, error->message);
+
+  g_object_unref (pixbuf);
+
+  return path;
+}
+
+/* A button image centred in its button, the way most themes draw them */
+static MetaDrawOpList *
+centred_image_list (MetaTheme *theme)
+{
+  MetaDrawOpList *op_list;
+  MetaDrawOp *op;
+  GError *error = NULL;
+
+  op = meta_draw_op_new (META_DRAW_IMAGE);
+  op->data.image.image = meta_theme_load_image (theme, "button.png", 0, &error);
+  if (op->data.image.image == NULL)
+    g_error ("Failed to load button.png: %s",
+             error ? error->message : "no such file");
+  op->data.image.x = meta_draw_spec_new (theme, "(width-object_width)/2", NULL);
+  op->data.image.y = meta_draw_spec_new (theme, "(height-object_height)/2", NULL);
+  op->data.image.width = meta_draw_spec_new (theme, "object_width", NULL);
+  op->data.image.height = meta_draw_spec_new (theme, "object_height", NULL);
+  op->data.image.fill_type = META_IMAGE_FILL_SCALE;
+
+  op_list = meta_draw_op_list_new (1);
+  meta_draw_op_list_append (op_list, op);
+
+  return op_list;
+}
+
+/* Draws the list into the button at x, y with only clip_rect exposed,
+ * as a redraw of a single button does
+ */
+static cairo_surface_t *
+draw_button (MetaDrawOpList  *op_list,
+             GtkStyleContext *style,
+             int              x,
+             int              y,
+             GdkRectangle    *clip_rect)
+{
+  cairo_surface_t *surface;
+  MetaDrawInfo info;
+  MetaRectangle rect;
+  cairo_t *cr;
+
+  surface = cairo_image_surface_create (CAIRO_FORMAT_ARGB32,
+                                        FRAME_WIDTH, FRAME_HEIGHT);
+  cr = cairo_create (surface);
+
+  gdk_cairo_rectangle (cr, clip_rect);
+  cairo_clip (cr);
+
+  memset (&info, 0, sizeof (info));
+  rect.x = x;
+  rect.y = y;
+  rect.width = BUTTON_SIZE;
+  rect.height = BUTTON_SIZE;
+  meta_draw_op_list_draw_with_style (op_list, style, cr, &info, rect);
+
+  cairo_destroy (cr);
+  cairo_surface_flush (surface);
+
+  return surface;
+}
+
+static void
+check_button_clip (MetaDrawOpList  *op_list,
+                   GtkStyleContext *style)
+{
+  GdkRectangle clip;
+  cairo_surface_t *surface;
+  int x = FRAME_WIDTH - 2 * BUTTON_SIZE;
+  int y = (FRAME_HEIGHT - BUTTON_SIZE) / 2;
+  int margin = (BUTTON_SIZE - IMAGE_SIZE) / 2;
+
+  /* the button alone is exposed, its image must be drawn */
+  clip.x = x;
+  clip.y = y;
+  clip.width = BUTTON_SIZE;
+  clip.height = BUTTON_SIZE;
+  surface = draw_button (op_list, style, x, y, &clip);
+  check_pixel ("button clip, image", surface,
+               x + BUTTON_SIZE / 2, y + BUTTON_SIZE / 2, IMAGE_PIXEL);
+  check_pixel ("button clip, image corner", surface,
+               x + margin, y + margin, IMAGE_PIXEL);
+  check_pixel ("button clip, around the image", surface,
+               x + margin - 1, y + margin - 1, 0);
+  cairo_surface_destroy (surface);
+
+  /* only the middle of the button, away from the corner where the
+   * bounds of the image would be were object_width unknown
+   */
+  clip.x = x + margin + 2;
+  clip.y = y + margin + 2;
+  clip.width = IMAGE_SIZE - 4;
+  clip.height = IMAGE_SIZE - 4;
+  surface = draw_button (op_list, style, x, y, &clip);
+  check_pixel ("middle clip, image", surface,
+               x + BUTTON_SIZE / 2, y + BUTTON_SIZE / 2, IMAGE_PIXEL);
+  cairo_surface_destroy (surface);
+
+  /* nothing is drawn outside the clip */
+  clip.x = 0;
+  clip.y = y;
+  clip.width = BUTTON_SIZE;
+  clip.height = BUTTON_SIZE;
+  surface = draw_button (op_list, style, x, y, &clip);
+  check_pixel ("clip beside, button", surface,
+               x + BUTTON_SIZE / 2, y + BUTTON_SIZE / 2, 0);
+  cairo_surface_destroy (surface);
+}
+
+int
+main (int    argc,
+      char **argv)
+{
+  MetaTheme *theme;
+  MetaDrawOpList *op_list;
+  GtkStyleContext *style;
+  GError *error = NULL;
+  char *dir, *image;
+
+  /* images are scaled to the output, which takes a display */
+  if (!gtk_init_check (&argc, &argv))
+    {
+      g_print ("No display, skipping\n");
+      return EXIT_SKIP;
+    }
+
+  dir = g_dir_make_tmp ("wf-theme-test-XXXXXX", &error);
+  if (dir == NULL)
+    g_error ("Failed to make a directory: %s", error->message);
+  image = write_image (dir);
+
+  theme = meta_theme_new ();
+  theme->name = g_strdup ("test");
+  theme->dirname = g_strdup (dir);
+  meta_theme_replace_current (theme);
+
+  style = gtk_style_context_new ();
+  op_list = centred_image_list (theme);
+
+  check_button_clip (op_list, style);
+
+  meta_draw_op_list_unref (op_list);
+  g_object_unref (style);
+  g_unlink (image);
+  g_rmdir (dir);
+  g_free (image);
+  g_free (dir);
+
+  if (failures)
+    {
+      g_printerr ("%d failures\n", failures);
+      return 1;
+    }
+
+  return 0;
+}
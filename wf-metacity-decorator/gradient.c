@@ -30,9 +30,11 @@
 
 #include "config.h"
 
+#include <math.h>
 #include <string.h>
 
 #include "gradient.h"
+#include "pixel-ops.h"
 
 /* Used as the destroy notification function for gdk_pixbuf_new() */
 static void
@@ -508,67 +510,24 @@ meta_gradient_create_multi_diagonal (int width, int height,
   return pixbuf;
 }
 
-static void
-simple_multiply_alpha (GdkPixbuf *pixbuf,
-                       guchar     alpha)
-{
-  guchar *pixels;
-  int rowstride;
-  int height;
-  int row;
-
-  g_return_if_fail (GDK_IS_PIXBUF (pixbuf));
-
-  if (alpha == 255)
-    return;
-
-  g_assert (gdk_pixbuf_get_has_alpha (pixbuf));
-
-  pixels = gdk_pixbuf_get_pixels (pixbuf);
-  rowstride = gdk_pixbuf_get_rowstride (pixbuf);
-  height = gdk_pixbuf_get_height (pixbuf);
-
-  row = 0;
-  while (row < height)
-    {
-      guchar *p;
-      guchar *end;
-
-      p = pixels + row * rowstride;
-      end = p + rowstride;
-
-      while (p != end)
-        {
-          p += 3; /* skip RGB */
-
-          /* multiply the two alpha channels. not sure this is right.
-           * but some end cases are that if the pixbuf contains 255,
-           * then it should be modified to contain "alpha"; if the
-           * pixbuf contains 0, it should remain 0.
-           */
-          /* ((*p / 255.0) * (alpha / 255.0)) * 255; */
-          *p = (guchar) (((int) *p * (int) alpha) / (int) 255);
-
-          ++p; /* skip A */
-        }
-
-      ++row;
-    }
-}
-
-static void
-meta_gradient_add_alpha_horizontal (GdkPixbuf           *pixbuf,
-                                    const unsigned char *alphas,
-                                    int                  n_alphas)
+/**
+ * meta_gradient_render_alpha_row:
+ * @dest: (array length=width): Where to write the alpha values
+ * @width: Width in pixels
+ * @alphas: (array length=n_alphas): Alpha values to go through
+ * @n_alphas: Number of alpha values
+ *
+ * Renders a horizontal alpha gradient, one value per pixel.
+ */
+void
+meta_gradient_render_alpha_row (guchar       *dest,
+                                int           width,
+                                const guchar *alphas,
+                                int           n_alphas)
 {
   int i, j;
   long a, da;
-  unsigned char *p;
-  unsigned char *pixels;
   int width2;
-  int rowstride;
-  int width, height;
-  unsigned char *gradient;
   unsigned char *gradient_p;
   unsigned char *gradient_end;
 
@@ -576,16 +535,11 @@ meta_gradient_add_alpha_horizontal (GdkPixbuf           *pixbuf,
 
   if (n_alphas == 1)
     {
-      /* Optimize this */
-      simple_multiply_alpha (pixbuf, alphas[0]);
+      memset (dest, alphas[0], width);
       return;
     }
 
-  width = gdk_pixbuf_get_width (pixbuf);
-  height = gdk_pixbuf_get_height (pixbuf);
-
-  gradient = g_new (unsigned char, width);
-  gradient_end = gradient + width;
+  gradient_end = dest + width;
 
   if (n_alphas > width)
     n_alphas = width;
@@ -596,7 +550,7 @@ meta_gradient_add_alpha_horizontal (GdkPixbuf           *pixbuf,
     width2 = width;
 
   a = alphas[0] << 8;
-  gradient_p = gradient;
+  gradient_p = dest;
 
   /* render the gradient into an array */
   for (i = 1; i < n_alphas; i++)
@@ -618,38 +572,6 @@ meta_gradient_add_alpha_horizontal (GdkPixbuf           *pixbuf,
     {
       *gradient_p++ = a >> 8;
     }
-
-  /* Now for each line of the pixbuf, fill in with the gradient */
-  pixels = gdk_pixbuf_get_pixels (pixbuf);
-  rowstride = gdk_pixbuf_get_rowstride (pixbuf);
-
-  p = pixels;
-  i = 0;
-  while (i < height)
-    {
-      unsigned char *row_end = p + rowstride;
-      gradient_p = gradient;
-
-      p += 3;
-      while (gradient_p != gradient_end)
-        {
-          /* multiply the two alpha channels. not sure this is right.
-           * but some end cases are that if the pixbuf contains 255,
-           * then it should be modified to contain "alpha"; if the
-           * pixbuf contains 0, it should remain 0.
-           */
-          /* ((*p / 255.0) * (alpha / 255.0)) * 255; */
-          *p = (guchar) (((int) *p * (int) *gradient_p) / (int) 255);
-
-          p += 4;
-          ++gradient_p;
-        }
-
-      p = row_end;
-      ++i;
-    }
-
-  g_free (gradient);
 }
 
 /**
@@ -850,36 +772,154 @@ meta_gradient_create_interwoven (int            width,
   return pixbuf;
 }
 
-void
-meta_gradient_add_alpha (GdkPixbuf       *pixbuf,
-                         const guchar    *alphas,
-                         int              n_alphas,
-                         MetaGradientType type)
+/*
+ * Writes the gradient running through the premultiplied stops (four
+ * doubles each, ARGB, 0 to 255) to a row of pixels, the first one at
+ * gradient position t0 and each next one dt further along. Stops are
+ * evenly spaced between positions 0 and 1.
+ */
+static void
+render_ramp (guint32      *dest,
+             int           n_pixels,
+             const double *stops,
+             int           n_stops,
+             double        t0,
+             double        dt)
 {
-  g_return_if_fail (GDK_IS_PIXBUF (pixbuf));
-  g_return_if_fail (gdk_pixbuf_get_has_alpha (pixbuf));
-  g_return_if_fail (n_alphas > 0);
+  int segments;
+  int k, c, x, x_end;
+  double f0, df;
+  gint32 start[4], step[4];
 
-  switch (type)
+  segments = n_stops - 1;
+  x = 0;
+
+  for (k = 0; k < segments && x < n_pixels; k++)
+    {
+      const double *from = stops + k * 4;
+      const double *to = stops + (k + 1) * 4;
+
+      /* first pixel past the end of this segment */
+      if (k == segments - 1)
+        x_end = n_pixels;
+      else
+        x_end = CLAMP ((int) ceil (((double) (k + 1) / segments - t0) / dt),
+                       x, n_pixels);
+
+      if (x_end == x)
+        continue;
+
+      f0 = (t0 + x * dt) * segments - k;
+      df = dt * segments;
+
+      for (c = 0; c < 4; c++)
+        {
+          start[c] = (gint32) ((from[c] + (to[c] - from[c]) * f0) * 65536.0) + 0x8000;
+          step[c] = (gint32) ((to[c] - from[c]) * df * 65536.0);
+        }
+
+      meta_pixel_ramp_row (dest + x, x_end - x, start, step);
+      x = x_end;
+    }
+}
+
+/**
+ * meta_gradient_create_surface:
+ * @width: Width in pixels
+ * @height: Height in pixels
+ * @colors: (array length=n_colors): Array of colors
+ * @n_colors: Number of colors
+ * @style: Gradient style
+ *
+ * Renders a gradient straight to premultiplied ARGB32, laid out like the
+ * cairo linear gradient from one side of the area to the other with
+ * evenly spaced stops, so it can be painted without any conversion.
+ * Colours are interpolated premultiplied.
+ *
+ * Returns: (transfer full): A new image surface, or %NULL
+ */
+cairo_surface_t*
+meta_gradient_create_surface (int               width,
+                              int               height,
+                              const GdkRGBA    *colors,
+                              int               n_colors,
+                              MetaGradientType  style)
+{
+  cairo_surface_t *surface;
+  guchar *pixels;
+  int stride;
+  double *stops;
+  guint32 *column;
+  int i, y;
+
+  g_return_val_if_fail (width > 0, NULL);
+  g_return_val_if_fail (height > 0, NULL);
+  g_return_val_if_fail (n_colors > 0, NULL);
+
+  surface = cairo_image_surface_create (CAIRO_FORMAT_ARGB32, width, height);
+  if (cairo_surface_status (surface) != CAIRO_STATUS_SUCCESS)
+    {
+      cairo_surface_destroy (surface);
+      return NULL;
+    }
+
+  cairo_surface_flush (surface);
+  pixels = cairo_image_surface_get_data (surface);
+  stride = cairo_image_surface_get_stride (surface);
+
+  /* A single colour is a gradient between two equal stops */
+  stops = g_new (double, 4 * MAX (n_colors, 2));
+  for (i = 0; i < MAX (n_colors, 2); i++)
+    {
+      const GdkRGBA *color = &colors[MIN (i, n_colors - 1)];
+      double alpha = CLAMP (color->alpha, 0.0, 1.0);
+
+      stops[i * 4 + 0] = alpha * 255.0;
+      stops[i * 4 + 1] = CLAMP (color->red, 0.0, 1.0) * alpha * 255.0;
+      stops[i * 4 + 2] = CLAMP (color->green, 0.0, 1.0) * alpha * 255.0;
+      stops[i * 4 + 3] = CLAMP (color->blue, 0.0, 1.0) * alpha * 255.0;
+    }
+  n_colors = MAX (n_colors, 2);
+
+  switch (style)
     {
     case META_GRADIENT_HORIZONTAL:
-      meta_gradient_add_alpha_horizontal (pixbuf, alphas, n_alphas);
+      render_ramp ((guint32 *) pixels, width, stops, n_colors,
+                   0.5 / width, 1.0 / width);
+
+      for (y = 1; y < height; y++)
+        memcpy (pixels + y * stride, pixels, width * 4);
       break;
 
     case META_GRADIENT_VERTICAL:
-      g_printerr ("marco: vertical alpha channel gradient not implemented yet\n");
+      column = g_new (guint32, height);
+      render_ramp (column, height, stops, n_colors,
+                   0.5 / height, 1.0 / height);
+
+      for (y = 0; y < height; y++)
+        meta_pixel_fill_row ((guint32 *) (pixels + y * stride), width, column[y]);
+
+      g_free (column);
       break;
 
     case META_GRADIENT_DIAGONAL:
-      g_printerr ("marco: diagonal alpha channel gradient not implemented yet\n");
+      /* Along the diagonal of the area, so position is (u + v) / 2 with
+       * u and v the coordinates scaled to the unit square.
+       */
+      for (y = 0; y < height; y++)
+        render_ramp ((guint32 *) (pixels + y * stride), width, stops, n_colors,
+                     (y + 0.5) / (2.0 * height) + 0.5 / (2.0 * width),
+                     1.0 / (2.0 * width));
       break;
 
     case META_GRADIENT_LAST:
-      g_assert_not_reached ();
-      break;
-
     default:
       g_assert_not_reached ();
       break;
     }
+
+  g_free (stops);
+  cairo_surface_mark_dirty (surface);
+
+  return surface;
 }
@@ -60,12 +60,15 @@ GdkPixbuf* meta_gradient_create_interwoven (int               width,
                                             const GdkRGBA     colors2[2],
                                             int               thickness2);
 
-/* Generate an alpha gradient and multiply it with the existing alpha
- * channel of the given pixbuf
- */
-void meta_gradient_add_alpha (GdkPixbuf       *pixbuf,
-                              const guchar    *alphas,
-                              int              n_alphas,
-                              MetaGradientType type);
+cairo_surface_t* meta_gradient_create_surface (int               width,
+                                               int               height,
+                                               const GdkRGBA    *colors,
+                                               int               n_colors,
+                                               MetaGradientType  style);
+
+void meta_gradient_render_alpha_row (guchar       *dest,
+                                     int           width,
+                                     const guchar *alphas,
+                                     int           n_alphas);
 
 #endif
@@ -5,19 +5,27 @@ of Mate Desktop, used also by the latest versions of compiz.
 It parses and renders metacity themes of all versions, i.e. v1, v2 and v3. 
 Not all metacity themes out there support the stick and shade buttons, only those made for marco. 
 
-The view_state_changed event carries a state, a bit mask:
+The view_state_changed and configure_hint events carry a state, a bit mask:
 
 static uint32_t STATE_FOCUSED   = 1;
 static uint32_t STATE_MAXIMIZED = 2;
 static uint32_t STATE_STICKY    = 4;
 static uint32_t STATE_SHADED    = 8;
+static uint32_t STATE_RESIZING  = 16;
+
+STATE_RESIZING is set by the plugin while the view is being resized, interactively
+or by size changes in quick succession; it is the only thing that makes the frames
+drafts, see draw_window.
 
 */
-#include <map>
-#include <iostream>
 #include <fstream>
+#include <signal.h>
+#include <glib-unix.h>
 #include <nlohmann/json.hpp>
+#include "log.hpp"
+#include "trace.h"
 #include "protocol.hpp"
+#include "registry.hpp"
 #include "nonstd.hpp"
 
 using json = nlohmann::json;
@@ -30,6 +38,22 @@ MetaFrameGeometry fgeom;
 GtkWidget *view_focused;
 PangoFontDescription *font_desc = pango_font_description_from_string("Bitstream Vera Sans Book 11");
 MetaButtonLayout        button_layout, dialog_button_layout;
+// all the titles are shaped in one context, sharing its font and metrics caches
+static PangoContext     *title_context = NULL;
+// the height of a title line in font_desc, measured once per font by send_borders
+static int              title_text_height = 0;
+
+// a guard against titles of megabytes, cut before shaping; the theme
+// ellipsizes whatever is left to the title rect
+#define MAX_TITLE_BYTES 4096
+
+static PangoContext *get_title_context ()
+{
+    // the screen's context is enough, titles don't need a window
+    if (!title_context)
+        title_context = gdk_pango_context_get ();
+    return title_context;
+}
 
 #define MODE_HOVER   0
 #define MODE_CLICK   1
@@ -39,6 +63,8 @@ class decoration_data_t
 {
 public:
 
+    uint32_t                view_id;
+    GtkWidget               *window;
     MetaFrameGeometry       frame_geometry;
     MetaButtonState         button_states[META_BUTTON_TYPE_LAST];
     PangoLayout             *layout = NULL;
@@ -51,30 +77,110 @@ public:
     uint                    type = 0;
     GdkRectangle            *title_bar;
     int                     current_edge = -1;
+    std::vector<DecoHitRegion> hit_map;
+    // the last configure_hint, acked once a frame of its size is drawn
+    uint32_t                hint_serial = 0;
+    int                     hint_width = 0;
+    int                     hint_height = 0;
+    bool                    hint_pending = false;
     
     ~decoration_data_t ()
     {
         if (title)
             g_free (title);
+        if (layout)
+            g_object_unref (layout);
     }
     
-    decoration_data_t (GtkWidget *window, uint what)
+    decoration_data_t (uint32_t view, GtkWidget *window, uint what) : view_id (view), window (window)
     {
         type = what;            // 0 toplevel, 1 dialog
         reset_button_states ();
         title_bar = &frame_geometry.title_rect;
-        create_title_layout (window);
+        create_title_layout ();
     }
     
-    void create_title_layout(GtkWidget *window)
+    void create_title_layout()
     {
-        layout = gtk_widget_create_pango_layout(window, title ? title : "  ");
+        layout = pango_layout_new (get_title_context ());
         pango_layout_set_font_description(layout, font_desc);  
-        pango_layout_set_wrap (layout, PANGO_WRAP_CHAR);
+        // a single line, the theme ellipsizes it to the room in the title bar
+        pango_layout_set_single_paragraph_mode (layout, TRUE);
+        pango_layout_set_ellipsize (layout, PANGO_ELLIPSIZE_END);
         pango_layout_set_auto_dir (layout, FALSE);
-        pango_layout_get_pixel_size (layout, NULL, &text_height);
+        set_layout_text (title ? title : "  ");
+        text_height = title_text_height;
     }    
 
+    void set_layout_text (const char *text)
+    {
+        size_t length = strlen (text);
+        // cut before the character the limit falls in
+        if (length > MAX_TITLE_BYTES)
+            length = g_utf8_find_prev_char (text, text + MAX_TITLE_BYTES + 1) - text;
+        pango_layout_set_text (layout, text, length);
+    }
+
+    // redraw only the buttons whose state is not the one in old_states
+    void queue_draw_buttons (GtkWidget *window, const MetaButtonState *old_states)
+    {
+        for (int f = 0; f < META_BUTTON_FUNCTION_LAST; f++)
+        {
+            MetaButtonType type = meta_function_to_type ((MetaButtonFunction)f);
+            int rx,ry,rw,rh;
+            if (type == META_BUTTON_TYPE_LAST || button_states[type] == old_states[type])
+                continue;
+            if (meta_get_button_position (f, &frame_geometry, &rx,&ry,&rw,&rh))
+                gtk_widget_queue_draw_area (window, rx, ry, rw, rh);
+        }
+    }
+
+    // publish to the plugin the regions motion_notify_event hit-tests, if they changed,
+    // so that it handles the pointer by itself outside the buttons; a maximized view
+    // has only its visible borders and is not resized from them
+    void update_hit_map (int width, int height)
+    {
+        bool resizable = !(state & STATE_MAXIMIZED);
+        const GtkBorder& borders = resizable ? frame_geometry.borders.total : frame_geometry.borders.visible;
+        int top = title_bar->y;
+        int left = borders.left, right = borders.right, bottom = borders.bottom;
+        std::vector<DecoHitRegion> regions;
+        auto add = [&] (int32_t x, int32_t y, int32_t w, int32_t h, uint32_t type, uint32_t detail)
+        {
+            if (w > 0 && h > 0)
+                regions.push_back ({x, y, w, h, type, detail});
+        };
+
+        if (resizable)
+        {
+            add (0, 0, left, top, DECO_HIT_RESIZE, DECO_EDGE_TOP | DECO_EDGE_LEFT);
+            add (width - right, 0, right, top, DECO_HIT_RESIZE, DECO_EDGE_TOP | DECO_EDGE_RIGHT);
+            add (left, 0, width - left - right, top, DECO_HIT_RESIZE, DECO_EDGE_TOP);
+        }
+        for (int f = 0; f < META_BUTTON_FUNCTION_LAST; f++)
+        {
+            int rx,ry,rw,rh;
+            if (meta_get_button_position (f, &frame_geometry, &rx,&ry,&rw,&rh))
+                add (rx, ry, rw, rh, DECO_HIT_BUTTON, f);
+        }
+        if (resizable)
+        {
+            add (0, height - bottom, left, bottom, DECO_HIT_RESIZE, DECO_EDGE_BOTTOM | DECO_EDGE_LEFT);
+            add (width - right, height - bottom, right, bottom, DECO_HIT_RESIZE, DECO_EDGE_BOTTOM | DECO_EDGE_RIGHT);
+            add (left, height - bottom, width - left - right, bottom, DECO_HIT_RESIZE, DECO_EDGE_BOTTOM);
+            add (0, top, left, height - top - bottom, DECO_HIT_RESIZE, DECO_EDGE_LEFT);
+            add (width - right, top, right, height - top - bottom, DECO_HIT_RESIZE, DECO_EDGE_RIGHT);
+        }
+        // the rest is the title bar
+        add (0, 0, width, height, DECO_HIT_MOVE, 0);
+
+        if (regions.size () == hit_map.size () &&
+            memcmp (regions.data (), hit_map.data (), regions.size () * sizeof (DecoHitRegion)) == 0)
+            return;
+        hit_map.swap (regions);
+        ::update_hit_map (view_id, hit_map);
+    }
+
     void reset_button_states ()
     {
         for (int i = 0; i < META_BUTTON_TYPE_LAST; i++)
@@ -122,12 +228,12 @@ public:
                 last_active_button = which_buttons[i];
                 if (pressed)
                 {
-                    printf("button %d click\n",which_buttons[i]);
+                    DLOGD("button %d click\n",which_buttons[i]);
                     last_pressed_button = which_buttons[i];
                 }
                 else
                 {
-                    printf("button %d hover\n",which_buttons[i]);
+                    DLOGT("button %d hover\n",which_buttons[i]);
                 }
                 return TRUE;
             }
@@ -135,34 +241,65 @@ public:
         return FALSE;
     }
     
-    void update_title (const char *new_title)
+    // gtk commits this frame after the draw handler returns, the ack reaches the plugin first
+    void ack_hint (int width, int height)
+    {
+        if (hint_pending && width == hint_width && height == hint_height)
+        {
+            ack_configure_hint (view_id, hint_serial);
+            hint_pending = false;
+        }
+    }
+
+    // returns whether the title changed
+    bool update_title (const char *new_title)
     {
-        printf("update_title %s\n", new_title);
+        DLOGD("update_title %s\n", new_title);
+        // the same title again, the layout keeps its shaping
+        if (title && strcmp (title, new_title) == 0)
+            return false;
         if (title)
             g_free (title);
         title = g_strdup (new_title);
         if (layout)
         {
-            pango_layout_set_text (layout, title, -1);
+            set_layout_text (title);
         }
+        return true;
     }
 };
 
-// map windows pointer to decoration data
-std::map<GtkWidget*,decoration_data_t*> views_data;
+// decoration data, by view id and by window
+static decoration_registry_t<decoration_data_t> decorations;
+
+static gchar *config_file = NULL;
 
-static void load_config ()
+// returns false and keeps the current config if the file can't be parsed,
+// e.g. while an editor is still writing it
+static bool load_config ()
 {
-    const char *config_dir = g_build_filename (g_get_user_config_dir (), "wf-metacity-decorator", NULL);
-    g_mkdir_with_parents (config_dir, S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
-    const char *config_file = g_build_filename (config_dir, "config.json", NULL);
-    GFile *cnf = g_file_new_for_path(config_file);
-    if (g_file_query_exists (cnf, NULL))
+    if (config_file == NULL)
     {
-        std::ifstream f(config_file);
-        config = json::parse(f);
+        gchar *config_dir = g_build_filename (g_get_user_config_dir (), "wf-metacity-decorator", NULL);
+        g_mkdir_with_parents (config_dir, S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
+        config_file = g_build_filename (config_dir, "config.json", NULL);
+        g_free (config_dir);
     }
-    else
+    if (g_file_test (config_file, G_FILE_TEST_EXISTS))
+    {
+        try
+        {
+            std::ifstream f(config_file);
+            config = json::parse(f);
+        }
+        catch (const json::exception& e)
+        {
+            DLOGW("failed to parse %s: %s\n", config_file, e.what());
+            if (!config.is_null())
+                return false;
+        }
+    }
+    if (config.is_null())
     {
         config = json::parse(R"(
                               {
@@ -173,27 +310,221 @@ static void load_config ()
                               }
                  )");
     }
-    std::cout << config.dump(4) << std::endl;
+    DLOGD("%s\n", config.dump(4).c_str());
+    return true;
 }    
 
 // determine the borders size, calculated on the theme and title font size, and send to plugin
-static void send_borders (const char *font)
+// unless they are the ones sent last time
+static void send_borders (MetaTheme *theme, const char *font, bool force)
 {
-    int text_height;
+    MetaFrameBorders old_borders = fgeom.borders;
+    if (font_desc)
+        pango_font_description_free (font_desc);
     font_desc = pango_font_description_from_string(font);
-    GtkWidget *window = gtk_window_new (GTK_WINDOW_TOPLEVEL);
-    GtkStyleContext *style_gtk = gtk_widget_get_style_context (window);
-    
-    PangoLayout* layout = gtk_widget_create_pango_layout(window, "Prova");
+    PangoLayout* layout = pango_layout_new (get_title_context ());
+    pango_layout_set_text (layout, "Prova", -1);
     pango_layout_set_font_description(layout, font_desc);  
-	pango_layout_set_wrap (layout, PANGO_WRAP_CHAR);
     pango_layout_set_auto_dir (layout, FALSE);
-    pango_layout_get_pixel_size (layout, NULL, &text_height);
+    pango_layout_get_pixel_size (layout, NULL, &title_text_height);
+    g_object_unref (layout);
 
-    meta_theme_draw_frame_test(metatheme, style_gtk, 300, 300, text_height, &fgeom, &button_layout);
+    meta_theme_draw_frame_test(theme, NULL, 300, 300, title_text_height, &fgeom, &button_layout);
+    if (!force && memcmp (&old_borders.total, &fgeom.borders.total, sizeof (GtkBorder)) == 0)
+        return;
     // send borders    
     update_borders(fgeom.borders.total.top, fgeom.borders.total.bottom, fgeom.borders.total.left, fgeom.borders.total.right, BORDERS_DELTA);
 }
+
+static void watch_theme_dir (MetaTheme *theme);
+
+static bool full_theme_loaded = false;
+
+// drawn instead of a theme which doesn't load at startup, rather than blank frames
+#define FALLBACK_THEME "ClearlooksRe"
+
+static MetaTheme *load_fallback_theme (const std::string& failed)
+{
+    if (failed == FALLBACK_THEME)
+        return NULL;
+    DLOGW("falling back to the %s theme\n", FALLBACK_THEME);
+    GError *error = NULL;
+    MetaTheme *theme = meta_theme_load (FALLBACK_THEME, &error);
+    if (theme == NULL)
+    {
+        DLOGE("%s\n", error->message);
+        g_error_free (error);
+    }
+    return theme;
+}
+
+// parse the draw ops and load the images of the theme, if not done yet
+static void load_full_theme ()
+{
+    if (full_theme_loaded)
+        return;
+    full_theme_loaded = true;
+    std::string val = config["theme"];
+    meta_theme_set_current(val.c_str(), TRUE);
+    if (!meta_theme_get_current())
+    {
+        if (MetaTheme *fallback = load_fallback_theme (val))
+            meta_theme_replace_current (fallback);
+    }
+    metatheme = meta_theme_get_current();
+    if (metatheme)
+        watch_theme_dir (metatheme);
+}
+
+// images decoded on their first draw go to the on-disk cache a bit later, in one write
+#define IMAGE_CACHE_SAVE_DELAY 5   // s
+static guint image_cache_timeout = 0;
+
+static gboolean save_image_cache (gpointer)
+{
+    image_cache_timeout = 0;
+    if (metatheme)
+        meta_theme_save_image_cache (metatheme);
+    return G_SOURCE_REMOVE;
+}
+
+/*
+ * Hot reload: config.json and the directory of the current theme are
+ * monitored. After a change the theme is parsed, and its images decoded,
+ * on a worker thread while the old one keeps drawing; the new one is
+ * then swapped in on the main thread and the decorations redrawn.
+ * The full theme is loaded the same way at startup, after the borders
+ * were sent from its geometry alone.
+ */
+static GFileMonitor *config_monitor = NULL;
+static GFileMonitor *theme_monitor = NULL;
+static guint reload_timeout = 0;
+static bool reload_running = false;
+static bool reload_again = false;
+
+static void start_reload ();
+
+static void load_theme_thread (GTask *task, gpointer, gpointer task_data, GCancellable *)
+{
+    GError *error = NULL;
+    MetaTheme *theme = meta_theme_load ((const char*)task_data, &error);
+    if (theme)
+        g_task_return_pointer (task, theme, (GDestroyNotify)meta_theme_free);
+    else
+        g_task_return_error (task, error);
+}
+
+static void theme_reloaded (GObject *, GAsyncResult *result, gpointer)
+{
+    GError *error = NULL;
+    MetaTheme *theme = (MetaTheme*)g_task_propagate_pointer (G_TASK(result), &error);
+    reload_running = false;
+
+    if (theme == NULL)
+    {
+        DLOGE("theme reload failed: %s\n", error->message);
+        g_error_free (error);
+        // a reload keeps the theme drawing, at startup there is none yet
+        if (!full_theme_loaded)
+        {
+            std::string val = config["theme"];
+            theme = load_fallback_theme (val);
+        }
+    }
+    if (theme)
+    {
+        meta_theme_replace_current (theme);
+        metatheme = theme;
+        full_theme_loaded = true;
+        watch_theme_dir (theme);
+
+        std::string val = config["button-layout"];
+        meta_update_button_layout (val.c_str(), &button_layout);
+        val = config["dialog-button-layout"];
+        meta_update_button_layout (val.c_str(), &dialog_button_layout);
+        val = config["font"];
+        send_borders (theme, val.c_str(), false);
+
+        decorations.for_each ([] (GtkWidget *window, decoration_data_t& deco)
+        {
+            pango_layout_set_font_description (deco.layout, font_desc);
+            deco.text_height = title_text_height;
+            if (gtk_widget_get_mapped (window))
+                gtk_widget_queue_draw (window);
+        });
+    }
+
+    if (reload_again)
+        start_reload ();
+}
+
+static void load_theme_async ()
+{
+    reload_running = true;
+    std::string val = config["theme"];
+    GTask *task = g_task_new (NULL, NULL, theme_reloaded, NULL);
+    g_task_set_task_data (task, g_strdup (val.c_str()), g_free);
+    g_task_run_in_thread (task, load_theme_thread);
+    g_object_unref (task);
+}
+
+static void start_reload ()
+{
+    reload_again = false;
+    if (!load_config ())
+        return;
+    load_theme_async ();
+}
+
+static gboolean reload_timeout_cb (gpointer)
+{
+    reload_timeout = 0;
+    // one reload at a time, changes made meanwhile get another one
+    if (reload_running)
+        reload_again = true;
+    else
+        start_reload ();
+    return G_SOURCE_REMOVE;
+}
+
+static void file_changed (GFileMonitor *, GFile *, GFile *, GFileMonitorEvent event, gpointer)
+{
+    if (event != G_FILE_MONITOR_EVENT_CHANGES_DONE_HINT &&
+        event != G_FILE_MONITOR_EVENT_CREATED &&
+        event != G_FILE_MONITOR_EVENT_DELETED &&
+        event != G_FILE_MONITOR_EVENT_MOVED_IN &&
+        event != G_FILE_MONITOR_EVENT_RENAMED)
+        return;
+    // editors write in several steps, wait for them to settle
+    if (reload_timeout)
+        g_source_remove (reload_timeout);
+    reload_timeout = g_timeout_add (200, reload_timeout_cb, NULL);
+}
+
+static GFileMonitor *watch (const char *path, bool directory)
+{
+    GFile *file = g_file_new_for_path (path);
+    GFileMonitor *monitor = directory ?
+        g_file_monitor_directory (file, G_FILE_MONITOR_WATCH_MOVES, NULL, NULL) :
+        g_file_monitor_file (file, G_FILE_MONITOR_WATCH_MOVES, NULL, NULL);
+    g_object_unref (file);
+    if (monitor)
+        g_signal_connect (monitor, "changed", G_CALLBACK (file_changed), NULL);
+    return monitor;
+}
+
+static void watch_theme_dir (MetaTheme *theme)
+{
+    static gchar *watched_dir = NULL;
+    if (theme->dirname == NULL || g_strcmp0 (watched_dir, theme->dirname) == 0)
+        return;
+    g_free (watched_dir);
+    watched_dir = g_strdup (theme->dirname);
+    if (theme_monitor)
+        g_object_unref (theme_monitor);
+    theme_monitor = watch (watched_dir, true);
+}
+
 GMenuModel *make_popup()
 {
     GMenu *menu = g_menu_new();
@@ -206,9 +537,10 @@ GMenuModel *make_popup()
 void menu_activate (GtkMenuItem *mi, gpointer user_data)
 {
     const gchar *action = gtk_menu_item_get_label (mi);
-    GtkWidget *window = (GtkWidget*)user_data;
-    window_action (window, action);
-    printf("activate %s\n", action);
+    decoration_data_t *deco = decorations.find_window ((GtkWidget*)user_data);
+    if (deco)
+        window_action (deco->view_id, action);
+    DLOGD("activate %s\n", action);
 } 
 
 void popup_menu(GtkWidget *window, GdkEventButton *event)
@@ -238,10 +570,19 @@ static void activate (GtkApplication* app, gpointer)
     // use the same cursors as wayfire
     g_object_set (settings, "gtk-cursor-theme-name", "default", NULL);
     load_config();
+    config_monitor = watch (config_file, false);
 
+    // the borders only need the frame geometry, so send them before
+    // the draw ops and the images of the theme are loaded
     std::string val = config["theme"];
-    meta_theme_set_current(val.c_str(), TRUE);
-    metatheme = meta_theme_get_current();
+    GError *error = NULL;
+    MetaTheme *geometry = meta_theme_load_geometry(val.c_str(), &error);
+    if (geometry == NULL)
+    {
+        DLOGW("geometry-only load failed: %s\n", error->message);
+        g_error_free(error);
+        load_full_theme();
+    }
     
     /*FIXME: string handling*/
     val = config["button-layout"];
@@ -249,7 +590,13 @@ static void activate (GtkApplication* app, gpointer)
     val = config["dialog-button-layout"];
     meta_update_button_layout (val.c_str(), &dialog_button_layout);
     val = config["font"];
-    send_borders (val.c_str());
+    send_borders (geometry ? geometry : metatheme, val.c_str(), true);
+    if (geometry)
+    {
+        meta_theme_free(geometry);
+        // frames stay blank until it is in, the first draws don't wait for it
+        load_theme_async ();
+    }
     
 //    gtk_application_set_menubar (app, make_popup());
     g_application_hold(G_APPLICATION(app));
@@ -257,18 +604,27 @@ static void activate (GtkApplication* app, gpointer)
 
 gboolean draw_window(GtkWindow *window, cairo_t *cr, gpointer)
 {
+    int width, height;
     int client_width, client_height;
-    if(!views_data.count(GTK_WIDGET(window)))
+    decoration_data_t *deco = decorations.find_window (GTK_WIDGET(window));
+    if(!deco)
     {
         cairo_paint (cr);
         return FALSE;
     }
     cairo_set_source_rgba (cr, 0, 0, 0, 0);
     cairo_paint (cr);        
-    decoration_data_t *deco = views_data[GTK_WIDGET(window)];
     
     // get the actual total window size
-    gtk_window_get_size (window, &client_width, &client_height);
+    gtk_window_get_size (window, &width, &height);
+    // the full theme is still loading, theme_reloaded redraws everything once it is in
+    if (!metatheme)
+    {
+        deco->ack_hint (width, height);
+        return TRUE;
+    }
+    client_width = width;
+    client_height = height;
     
     // calculate decorated window dimensions    
     if (deco->state & STATE_MAXIMIZED)
@@ -281,10 +637,14 @@ gboolean draw_window(GtkWindow *window, cairo_t *cr, gpointer)
         client_width -= (fgeom.borders.total.left + fgeom.borders.total.right);
         client_height -= (fgeom.borders.total.top + fgeom.borders.total.bottom);
     }
-    printf("width %d - height %d\n", client_width, client_height);
+    DLOGT("width %d - height %d\n", client_width, client_height);
     GtkStyleContext *style_gtk = gtk_widget_get_style_context (GTK_WIDGET(window));
     
+    // the plugin clearing STATE_RESIZING brings the frame in full quality
+    bool draft = deco->state & STATE_RESIZING;
+    
     // draw decoration
+    DECO_TRACE_BEGIN(draw_start);
     meta_theme_draw_frame (metatheme, 
                            deco->state, 
                            style_gtk, 
@@ -296,16 +656,24 @@ gboolean draw_window(GtkWindow *window, cairo_t *cr, gpointer)
                            &deco->frame_geometry,
                            deco->type ? &dialog_button_layout : &button_layout,
                            deco->button_states);
+    DECO_TRACE_END(draw_start, "draw", draft ? "meta_theme_draw_frame draft" : "meta_theme_draw_frame");
+    // the frame geometry is up to date now
+    deco->update_hit_map (width, height);
+    if (!image_cache_timeout)
+        image_cache_timeout = g_timeout_add_seconds (IMAGE_CACHE_SAVE_DELAY, save_image_cache, NULL);
+    deco->ack_hint (width, height);
                            
     return TRUE;
 }
 
 gboolean motion_notify_event (GtkWidget *window, GdkEventMotion *ev, gpointer data)
 {
-    if(views_data.count(window))
+    decoration_data_t *deco = decorations.find_window (window);
+    if(deco)
     {
-        decoration_data_t *deco = views_data[window];
         const char *cursor_name = NULL;
+        MetaButtonState old_states[META_BUTTON_TYPE_LAST];
+        memcpy (old_states, deco->button_states, sizeof (old_states));
         deco->current_edge = -1;
         int x = (int)ev->x;
         int y = (int)ev->y;
@@ -331,11 +699,7 @@ gboolean motion_notify_event (GtkWidget *window, GdkEventMotion *ev, gpointer da
                 cursor_name = "n-resize";
             }                
         }
-        else if (deco->check_button (MODE_HOVER, x, y, META_BUTTON_STATE_PRELIGHT, 0, &what))
-        {
-            gtk_widget_queue_draw(window);
-        }
-        else 
+        else if (!deco->check_button (MODE_HOVER, x, y, META_BUTTON_STATE_PRELIGHT, 0, &what))
         {
             deco->reset_button_states();
             if (y > height - deco->frame_geometry.borders.total.bottom)
@@ -377,36 +741,49 @@ gboolean motion_notify_event (GtkWidget *window, GdkEventMotion *ev, gpointer da
         {
             gdk_window_set_cursor (gdkw, NULL);
         }
-        gtk_widget_queue_draw(window);
+        deco->queue_draw_buttons (window, old_states);
     }    
     return TRUE;
 }
 
+// with a hit map the plugin takes the pointer away when it leaves the buttons
+gboolean leave_notify_event (GtkWidget *window, GdkEventCrossing *ev, gpointer data)
+{
+    decoration_data_t *deco = decorations.find_window (window);
+    if(deco && deco->last_pressed_button == META_BUTTON_FUNCTION_LAST)
+    {
+        MetaButtonState old_states[META_BUTTON_TYPE_LAST];
+        memcpy (old_states, deco->button_states, sizeof (old_states));
+        deco->reset_button_states ();
+        deco->queue_draw_buttons (window, old_states);
+    }
+    return TRUE;
+}
+
 gboolean button_press_event (GtkWidget *window, GdkEventButton *ev, gpointer data)
 {
     if(ev->button != 1)
         return TRUE;
-    if(views_data.count(window))
+    decoration_data_t *deco = decorations.find_window (window);
+    if(deco)
     {
         int x = (int)ev->x;
         int y = (int)ev->y;
         MetaButtonFunction what;
 
-        decoration_data_t *deco = views_data[window];
+        MetaButtonState old_states[META_BUTTON_TYPE_LAST];
+        memcpy (old_states, deco->button_states, sizeof (old_states));
         if( deco->current_edge >= 0)
         {
             gtk_window_begin_resize_drag (GTK_WINDOW(window), (GdkWindowEdge)deco->current_edge, ev->button, ev->x_root, ev->y_root, ev->time);
             deco->reset_button_states ();
         }            
-        else if (deco->check_button (MODE_CLICK, x, y, META_BUTTON_STATE_PRESSED, 1, &what))
-        {
-            gtk_widget_queue_draw(window);
-        }
-        else
+        else if (!deco->check_button (MODE_CLICK, x, y, META_BUTTON_STATE_PRESSED, 1, &what))
         {                   
             gtk_window_begin_move_drag (GTK_WINDOW(window), ev->button, ev->x_root, ev->y_root, ev->time);
             deco->reset_button_states ();
         }            
+        deco->queue_draw_buttons (window, old_states);
     }
     return TRUE;
 }
@@ -415,28 +792,30 @@ gboolean button_release_event (GtkWidget *window, GdkEventButton *ev, gpointer d
 {
     if(ev->button != 1)
         return TRUE;
-    if(views_data.count(window))
+    decoration_data_t *deco = decorations.find_window (window);
+    if(deco)
     {
         int x = (int)ev->x;
         int y = (int)ev->y;
         MetaButtonFunction what;
 
-        decoration_data_t *deco = views_data[window];
         if (deco->last_pressed_button != META_BUTTON_FUNCTION_LAST)
         {
+            MetaButtonState old_states[META_BUTTON_TYPE_LAST];
+            memcpy (old_states, deco->button_states, sizeof (old_states));
             if (deco->check_button (MODE_RELEASE, x, y, META_BUTTON_STATE_PRESSED, 0, &what))
             {
                 const char *action = meta_button_function_to_string (what);
-                printf("action %s\n", action);
+                DLOGD("action %s\n", action);
                 deco->reset_button_states();
                 if (strcmp(action, "menu") == 0)
                 {
                     popup_menu (window, ev);
                 }
                 // send button action
-                window_action (window, action);
+                window_action (deco->view_id, action);
             }
-            gtk_widget_queue_draw(window);
+            deco->queue_draw_buttons (window, old_states);
         }
     }        
     return TRUE;
@@ -444,49 +823,48 @@ gboolean button_release_event (GtkWidget *window, GdkEventButton *ev, gpointer d
 
 // type: 0 toplevel, 1 dialog 
 // the title has the format: __wf_decorator:<id> 
-GtkWidget *create_deco_window (std::string title, uint type)
+void create_decoration (uint32_t view, uint type)
 {
+    std::string title = "__wf_decorator:" + std::to_string(view);
     GtkWidget *window;
     window = gtk_application_window_new(app);
     gtk_window_set_title(GTK_WINDOW(window), title.c_str());
     GdkScreen *screen = gtk_window_get_screen (GTK_WINDOW(window));
     GdkVisual *visual = gdk_screen_get_rgba_visual (screen);
     gtk_widget_set_visual (window, visual);
-    gtk_widget_set_events (window, GDK_BUTTON_PRESS_MASK | GDK_BUTTON_RELEASE_MASK | GDK_POINTER_MOTION_MASK | GDK_BUTTON1_MOTION_MASK);
+    gtk_widget_set_events (window, GDK_BUTTON_PRESS_MASK | GDK_BUTTON_RELEASE_MASK | GDK_POINTER_MOTION_MASK | GDK_BUTTON1_MOTION_MASK | GDK_LEAVE_NOTIFY_MASK);
     g_signal_connect (window,"draw", (GCallback)draw_window, NULL);
     g_signal_connect (window,"button-press-event", (GCallback)button_press_event, NULL);
     g_signal_connect (window,"button-release-event", (GCallback)button_release_event, NULL);
     g_signal_connect (window,"motion-notify-event", (GCallback)motion_notify_event, NULL);
+    g_signal_connect (window,"leave-notify-event", (GCallback)leave_notify_event, NULL);
     gtk_widget_show_all(window);
-    printf("CREATED new decoration: %s\n", title.c_str());
-    decoration_data_t *deco = new decoration_data_t (window, type);
-    views_data[window] = deco;
-    printf("%d windows\n", g_list_length(gtk_application_get_windows(app)));
-    return window;
+    DLOGI("CREATED new decoration: %s\n", title.c_str());
+    decorations.add (view, window, view, window, type);
+    DLOGD("%d windows\n", g_list_length(gtk_application_get_windows(app)));
 }
 
-void set_title(GtkWidget *window, const char *title)
+void set_title(uint32_t view, const char *title)
 {
-    g_return_if_fail(GTK_IS_WINDOW(window));
-    printf("set_title - %s\n", title);
-    if(views_data.count(window))
+    DLOGD("set_title - %s\n", title);
+    decoration_data_t *deco = decorations.find_view (view);
+    if(deco)
     {
-        decoration_data_t *deco = views_data[window];
-        deco->update_title (title);
-        gtk_widget_queue_draw(window);
+        if (deco->update_title (title))
+            gtk_widget_queue_draw(deco->window);
     }        
 }
 
-void set_view_state(GtkWidget *window, uint state)
+static void apply_view_state(decoration_data_t *deco, uint state)
 {
-    g_return_if_fail(GTK_IS_WINDOW(window));
+    GtkWidget *window = deco->window;
     if(state & STATE_FOCUSED)
     {
         // reset all decorations to inactive
-        for (const auto& pair : views_data) 
+        decorations.for_each ([] (GtkWidget*, decoration_data_t& other)
         {
-            pair.second->state &= ~STATE_FOCUSED;           
-        }
+            other.state &= ~STATE_FOCUSED;           
+        });
         // redraw last active, if any 
         if(GTK_IS_WINDOW(view_focused) && window != view_focused)
         {
@@ -494,35 +872,70 @@ void set_view_state(GtkWidget *window, uint state)
         }
         view_focused = window;
     }        
-    if(views_data.count(window))
-    {
-        decoration_data_t *deco = views_data[window];
-        deco->state = state;
-    }
-    gtk_widget_queue_draw(window);
+    deco->state = state;
+}
+
+void set_view_state(uint32_t view, uint state)
+{
+    decoration_data_t *deco = decorations.find_view (view);
+    if(!deco)
+        return;
+    apply_view_state(deco, state);
+    gtk_widget_queue_draw(deco->window);
+}
+
+// the configure resizing the window follows, its frame is drawn with the new state
+// and acked in draw_window; if the window has that size already nothing else comes
+void set_configure_hint(uint32_t view, uint32_t serial, uint32_t width, uint32_t height, uint32_t state)
+{
+    decoration_data_t *deco = decorations.find_view (view);
+    if(!deco)
+        return;
+    apply_view_state(deco, state);
+    deco->hint_serial = serial;
+    deco->hint_width = width;
+    deco->hint_height = height;
+    deco->hint_pending = true;
+
+    int current_width, current_height;
+    gtk_window_get_size (GTK_WINDOW(deco->window), &current_width, &current_height);
+    if (current_width == (int)width && current_height == (int)height)
+        gtk_widget_queue_draw(deco->window);
 }
 
 // free data
-void set_view_unmapped(GtkWidget *window)
+void set_view_unmapped(uint32_t view)
 {
-    g_return_if_fail(GTK_IS_WINDOW(window));
-    if(views_data.count(window))
+    decoration_data_t *deco = decorations.find_view (view);
+    if(deco)
     {
-        decoration_data_t *deco = views_data[window];
-        views_data.erase (window);
-        delete deco;
+        GtkWidget *window = deco->window;
+        decorations.remove (window);
+        if (window == view_focused)
+            view_focused = NULL;
         gtk_widget_destroy(GTK_WIDGET(window));
-        printf("%d windows\n", g_list_length(gtk_application_get_windows(app)));
+        DLOGD("%d windows\n", g_list_length(gtk_application_get_windows(app)));
     }        
 }
 
+// the plugin stops us with SIGTERM, leave the main loop so that the trace is closed
+static gboolean terminate (gpointer user_data)
+{
+    g_application_quit (G_APPLICATION (app));
+    return G_SOURCE_REMOVE;
+}
+
 int main(int argc, char **argv)
 {
     int status;
-    app = gtk_application_new("org.wf.metacity-decorator", G_APPLICATION_DEFAULT_FLAGS);
+    deco_trace_init("wf-metacity-decorator");
+    // the plugin may run several of us, each drawing its own share of the views
+    app = gtk_application_new("org.wf.metacity-decorator", G_APPLICATION_NON_UNIQUE);
     g_signal_connect(app, "activate", G_CALLBACK (activate), NULL);
+    g_unix_signal_add (SIGTERM, terminate, NULL);
     status = g_application_run(G_APPLICATION (app), argc, argv);
     g_object_unref (app);
+    deco_trace_close();
 
     return status;
 }
@@ -0,0 +1,780 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+
+/* Marco pixel processing kernels */
+
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+#include <string.h>
+#include "pixel-ops.h"
+
+#if defined (__SSE2__)
+#define HAVE_SSE2 1
+#include <emmintrin.h>
+#endif
+
+#if defined (__GNUC__) && (defined (__x86_64__) || defined (__i386__))
+#define HAVE_AVX2 1
+#include <immintrin.h>
+#endif
+
+#if defined (__ARM_NEON)
+#define HAVE_NEON 1
+#include <arm_neon.h>
+#endif
+
+/* Weights of the red, green and blue channels in the intensity of a
+ * pixel, out of 256; 0.30, 0.59 and 0.11 in the original floating point.
+ */
+#define INTENSITY_RED   77
+#define INTENSITY_GREEN 151
+#define INTENSITY_BLUE  28
+
+/* Kernels handle as many whole blocks of pixels as they can and return
+ * how many that was; the scalar code does the rest.
+ */
+typedef int (* ColorizeRowFunc) (guchar       *dest,
+                                 const guchar *src,
+                                 int           n_pixels,
+                                 const guchar  color[3]);
+
+/* x / 255 rounded down, for x < 65535 */
+static inline guint
+div255 (guint x)
+{
+  return (x + 1 + (x >> 8)) >> 8;
+}
+
+static void
+colorize_row_scalar (guchar       *dest,
+                     const guchar *src,
+                     int           n_pixels,
+                     int           n_channels,
+                     const guchar  color[3])
+{
+  guint intensity;
+  int x, c;
+
+  for (x = 0; x < n_pixels; x++)
+    {
+      intensity = (src[0] * INTENSITY_RED +
+                   src[1] * INTENSITY_GREEN +
+                   src[2] * INTENSITY_BLUE + 128) >> 8;
+
+      for (c = 0; c < 3; c++)
+        {
+          if (intensity <= 127)
+            {
+              /* Go from black at intensity = 0 to color at intensity = 127 */
+              dest[c] = div255 (color[c] * 2 * intensity);
+            }
+          else
+            {
+              /* Go from color at intensity = 128 to white at intensity = 255 */
+              dest[c] = color[c] + div255 ((255 - color[c]) * (2 * intensity - 255));
+            }
+        }
+
+      if (n_channels == 4)
+        dest[3] = src[3];
+
+      src += n_channels;
+      dest += n_channels;
+    }
+}
+
+#ifdef HAVE_SSE2
+static inline __m128i
+div255_sse2 (__m128i x)
+{
+  __m128i t;
+
+  t = _mm_add_epi16 (x, _mm_set1_epi16 (1));
+  t = _mm_add_epi16 (t, _mm_srli_epi16 (x, 8));
+
+  return _mm_srli_epi16 (t, 8);
+}
+
+/* Two pixels widened to 16 bits a channel in, the intensity of each
+ * repeated over its four channels out.
+ */
+static inline __m128i
+intensity_sse2 (__m128i pixels)
+{
+  const __m128i weights = _mm_set_epi16 (0, INTENSITY_BLUE, INTENSITY_GREEN, INTENSITY_RED,
+                                         0, INTENSITY_BLUE, INTENSITY_GREEN, INTENSITY_RED);
+  __m128i sum;
+
+  /* r * wr + g * wg and b * wb, then add the pairs together */
+  sum = _mm_madd_epi16 (pixels, weights);
+  sum = _mm_add_epi32 (sum, _mm_shuffle_epi32 (sum, _MM_SHUFFLE (2, 3, 0, 1)));
+  sum = _mm_srli_epi32 (_mm_add_epi32 (sum, _mm_set1_epi32 (128)), 8);
+
+  return _mm_or_si128 (sum, _mm_slli_epi32 (sum, 16));
+}
+
+static inline __m128i
+colorize_channels_sse2 (__m128i intensity,
+                        __m128i color,
+                        __m128i inverse)
+{
+  __m128i twice, dark, light, mask;
+
+  twice = _mm_add_epi16 (intensity, intensity);
+  dark = div255_sse2 (_mm_mullo_epi16 (color, twice));
+  light = _mm_sub_epi16 (twice, _mm_set1_epi16 (255));
+  light = _mm_add_epi16 (color, div255_sse2 (_mm_mullo_epi16 (inverse, light)));
+  mask = _mm_cmpgt_epi16 (intensity, _mm_set1_epi16 (127));
+
+  return _mm_or_si128 (_mm_and_si128 (mask, light),
+                       _mm_andnot_si128 (mask, dark));
+}
+
+static inline __m128i
+colorize4_sse2 (__m128i pixels,
+                __m128i color,
+                __m128i inverse)
+{
+  const __m128i alpha = _mm_set1_epi32 ((int) 0xff000000);
+  const __m128i zero = _mm_setzero_si128 ();
+  __m128i lo, hi, result;
+
+  lo = _mm_unpacklo_epi8 (pixels, zero);
+  hi = _mm_unpackhi_epi8 (pixels, zero);
+
+  lo = colorize_channels_sse2 (intensity_sse2 (lo), color, inverse);
+  hi = colorize_channels_sse2 (intensity_sse2 (hi), color, inverse);
+  result = _mm_packus_epi16 (lo, hi);
+
+  return _mm_or_si128 (_mm_andnot_si128 (alpha, result),
+                       _mm_and_si128 (alpha, pixels));
+}
+
+static int
+colorize_rgba_sse2 (guchar       *dest,
+                    const guchar *src,
+                    int           n_pixels,
+                    const guchar  color[3])
+{
+  __m128i c, inverse;
+  int x;
+
+  c = _mm_set_epi16 (0, color[2], color[1], color[0],
+                     0, color[2], color[1], color[0]);
+  inverse = _mm_sub_epi16 (_mm_set_epi16 (0, 255, 255, 255, 0, 255, 255, 255), c);
+
+  for (x = 0; x + 8 <= n_pixels; x += 8)
+    {
+      __m128i a = _mm_loadu_si128 ((const __m128i *) (src + x * 4));
+      __m128i b = _mm_loadu_si128 ((const __m128i *) (src + x * 4 + 16));
+
+      _mm_storeu_si128 ((__m128i *) (dest + x * 4), colorize4_sse2 (a, c, inverse));
+      _mm_storeu_si128 ((__m128i *) (dest + x * 4 + 16), colorize4_sse2 (b, c, inverse));
+    }
+
+  return x;
+}
+#endif /* HAVE_SSE2 */
+
+#ifdef HAVE_AVX2
+/* The same steps as the SSE2 code; every AVX2 instruction used works
+ * within each 128 bit half, so the pixels never cross between halves.
+ */
+__attribute__ ((target ("avx2"))) static inline __m256i
+div255_avx2 (__m256i x)
+{
+  __m256i t;
+
+  t = _mm256_add_epi16 (x, _mm256_set1_epi16 (1));
+  t = _mm256_add_epi16 (t, _mm256_srli_epi16 (x, 8));
+
+  return _mm256_srli_epi16 (t, 8);
+}
+
+__attribute__ ((target ("avx2"))) static inline __m256i
+intensity_avx2 (__m256i pixels)
+{
+  const __m256i weights = _mm256_set_epi16 (0, INTENSITY_BLUE, INTENSITY_GREEN, INTENSITY_RED,
+                                            0, INTENSITY_BLUE, INTENSITY_GREEN, INTENSITY_RED,
+                                            0, INTENSITY_BLUE, INTENSITY_GREEN, INTENSITY_RED,
+                                            0, INTENSITY_BLUE, INTENSITY_GREEN, INTENSITY_RED);
+  __m256i sum;
+
+  sum = _mm256_madd_epi16 (pixels, weights);
+  sum = _mm256_add_epi32 (sum, _mm256_shuffle_epi32 (sum, _MM_SHUFFLE (2, 3, 0, 1)));
+  sum = _mm256_srli_epi32 (_mm256_add_epi32 (sum, _mm256_set1_epi32 (128)), 8);
+
+  return _mm256_or_si256 (sum, _mm256_slli_epi32 (sum, 16));
+}
+
+__attribute__ ((target ("avx2"))) static inline __m256i
+colorize_channels_avx2 (__m256i intensity,
+                        __m256i color,
+                        __m256i inverse)
+{
+  __m256i twice, dark, light, mask;
+
+  twice = _mm256_add_epi16 (intensity, intensity);
+  dark = div255_avx2 (_mm256_mullo_epi16 (color, twice));
+  light = _mm256_sub_epi16 (twice, _mm256_set1_epi16 (255));
+  light = _mm256_add_epi16 (color, div255_avx2 (_mm256_mullo_epi16 (inverse, light)));
+  mask = _mm256_cmpgt_epi16 (intensity, _mm256_set1_epi16 (127));
+
+  return _mm256_blendv_epi8 (dark, light, mask);
+}
+
+__attribute__ ((target ("avx2"))) static inline __m256i
+colorize8_avx2 (__m256i pixels,
+                __m256i color,
+                __m256i inverse)
+{
+  const __m256i alpha = _mm256_set1_epi32 ((int) 0xff000000);
+  const __m256i zero = _mm256_setzero_si256 ();
+  __m256i lo, hi, result;
+
+  lo = _mm256_unpacklo_epi8 (pixels, zero);
+  hi = _mm256_unpackhi_epi8 (pixels, zero);
+
+  lo = colorize_channels_avx2 (intensity_avx2 (lo), color, inverse);
+  hi = colorize_channels_avx2 (intensity_avx2 (hi), color, inverse);
+  result = _mm256_packus_epi16 (lo, hi);
+
+  return _mm256_blendv_epi8 (result, pixels, alpha);
+}
+
+__attribute__ ((target ("avx2"))) static int
+colorize_rgba_avx2 (guchar       *dest,
+                    const guchar *src,
+                    int           n_pixels,
+                    const guchar  color[3])
+{
+  __m256i c, inverse;
+  int x;
+
+  c = _mm256_set_epi16 (0, color[2], color[1], color[0],
+                        0, color[2], color[1], color[0],
+                        0, color[2], color[1], color[0],
+                        0, color[2], color[1], color[0]);
+  inverse = _mm256_set_epi16 (0, 255, 255, 255, 0, 255, 255, 255,
+                              0, 255, 255, 255, 0, 255, 255, 255);
+  inverse = _mm256_sub_epi16 (inverse, c);
+
+  for (x = 0; x + 16 <= n_pixels; x += 16)
+    {
+      __m256i a = _mm256_loadu_si256 ((const __m256i *) (src + x * 4));
+      __m256i b = _mm256_loadu_si256 ((const __m256i *) (src + x * 4 + 32));
+
+      _mm256_storeu_si256 ((__m256i *) (dest + x * 4), colorize8_avx2 (a, c, inverse));
+      _mm256_storeu_si256 ((__m256i *) (dest + x * 4 + 32), colorize8_avx2 (b, c, inverse));
+    }
+
+  return x;
+}
+#endif /* HAVE_AVX2 */
+
+#ifdef HAVE_NEON
+static inline uint16x8_t
+div255_neon (uint16x8_t x)
+{
+  uint16x8_t t;
+
+  t = vaddq_u16 (x, vdupq_n_u16 (1));
+  t = vaddq_u16 (t, vshrq_n_u16 (x, 8));
+
+  return vshrq_n_u16 (t, 8);
+}
+
+static inline uint16x8_t
+intensity_neon (uint8x8_t r,
+                uint8x8_t g,
+                uint8x8_t b)
+{
+  uint16x8_t sum;
+
+  /* At most 255 * 256, so the sum fits in 16 bits */
+  sum = vmull_u8 (r, vdup_n_u8 (INTENSITY_RED));
+  sum = vmlal_u8 (sum, g, vdup_n_u8 (INTENSITY_GREEN));
+  sum = vmlal_u8 (sum, b, vdup_n_u8 (INTENSITY_BLUE));
+
+  return vrshrq_n_u16 (sum, 8);
+}
+
+static inline uint8x8_t
+colorize_channel_neon (uint16x8_t intensity,
+                       guchar     color)
+{
+  uint16x8_t twice, dark, light, mask;
+
+  twice = vaddq_u16 (intensity, intensity);
+  dark = div255_neon (vmulq_n_u16 (twice, color));
+  light = vsubq_u16 (twice, vdupq_n_u16 (255));
+  light = vaddq_u16 (vdupq_n_u16 (color),
+                     div255_neon (vmulq_n_u16 (light, 255 - color)));
+  mask = vcgtq_u16 (intensity, vdupq_n_u16 (127));
+
+  return vmovn_u16 (vbslq_u16 (mask, light, dark));
+}
+
+static inline void
+colorize8_neon (uint8x8_t       *r,
+                uint8x8_t       *g,
+                uint8x8_t       *b,
+                const guchar     color[3])
+{
+  uint16x8_t intensity;
+
+  intensity = intensity_neon (*r, *g, *b);
+  *r = colorize_channel_neon (intensity, color[0]);
+  *g = colorize_channel_neon (intensity, color[1]);
+  *b = colorize_channel_neon (intensity, color[2]);
+}
+
+static int
+colorize_rgba_neon (guchar       *dest,
+                    const guchar *src,
+                    int           n_pixels,
+                    const guchar  color[3])
+{
+  int x;
+
+  for (x = 0; x + 8 <= n_pixels; x += 8)
+    {
+      uint8x8x4_t pixels = vld4_u8 (src + x * 4);
+
+      colorize8_neon (&pixels.val[0], &pixels.val[1], &pixels.val[2], color);
+      vst4_u8 (dest + x * 4, pixels);
+    }
+
+  return x;
+}
+
+static int
+colorize_rgb_neon (guchar       *dest,
+                   const guchar *src,
+                   int           n_pixels,
+                   const guchar  color[3])
+{
+  int x;
+
+  for (x = 0; x + 8 <= n_pixels; x += 8)
+    {
+      uint8x8x3_t pixels = vld3_u8 (src + x * 3);
+
+      colorize8_neon (&pixels.val[0], &pixels.val[1], &pixels.val[2], color);
+      vst3_u8 (dest + x * 3, pixels);
+    }
+
+  return x;
+}
+#endif /* HAVE_NEON */
+
+#if !defined (HAVE_SSE2) && !defined (HAVE_NEON)
+static int
+colorize_row_none (guchar       *dest     G_GNUC_UNUSED,
+                   const guchar *src      G_GNUC_UNUSED,
+                   int           n_pixels G_GNUC_UNUSED,
+                   const guchar  color[3] G_GNUC_UNUSED)
+{
+  return 0;
+}
+#endif
+
+static ColorizeRowFunc
+choose_colorize_rgba (void)
+{
+#ifdef HAVE_AVX2
+  __builtin_cpu_init ();
+  if (__builtin_cpu_supports ("avx2"))
+    return colorize_rgba_avx2;
+#endif
+#if defined (HAVE_SSE2)
+  return colorize_rgba_sse2;
+#elif defined (HAVE_NEON)
+  return colorize_rgba_neon;
+#else
+  return colorize_row_none;
+#endif
+}
+
+void
+meta_pixel_colorize_row (guchar       *dest,
+                         const guchar *src,
+                         int           n_pixels,
+                         int           n_channels,
+                         guint32       rgb)
+{
+  static gsize colorize_rgba_init = 0;
+  static ColorizeRowFunc colorize_rgba;
+  guchar color[3];
+  int done = 0;
+
+  if (g_once_init_enter (&colorize_rgba_init))
+    {
+      colorize_rgba = choose_colorize_rgba ();
+      g_once_init_leave (&colorize_rgba_init, 1);
+    }
+
+  color[0] = (rgb >> 16) & 0xff;
+  color[1] = (rgb >> 8) & 0xff;
+  color[2] = rgb & 0xff;
+
+  if (n_channels == 4)
+    done = colorize_rgba (dest, src, n_pixels, color);
+#ifdef HAVE_NEON
+  else if (n_channels == 3)
+    done = colorize_rgb_neon (dest, src, n_pixels, color);
+#endif
+
+  colorize_row_scalar (dest + done * n_channels, src + done * n_channels,
+                       n_pixels - done, n_channels, color);
+}
+
+/* Packs four 16.16 channels into one ARGB32 pixel */
+static inline guint32
+pack_argb (gint32 a,
+           gint32 r,
+           gint32 g,
+           gint32 b)
+{
+  return (((guint32) a << 8) & 0xff000000) |
+         ((guint32) r & 0x00ff0000) |
+         (((guint32) g >> 8) & 0x0000ff00) |
+         ((guint32) b >> 16);
+}
+
+#ifdef HAVE_SSE2
+static inline __m128i
+pack_argb_sse2 (__m128i a,
+                __m128i r,
+                __m128i g,
+                __m128i b)
+{
+  __m128i pixels;
+
+  pixels = _mm_and_si128 (_mm_slli_epi32 (a, 8), _mm_set1_epi32 ((int) 0xff000000));
+  pixels = _mm_or_si128 (pixels, _mm_and_si128 (r, _mm_set1_epi32 (0x00ff0000)));
+  pixels = _mm_or_si128 (pixels, _mm_and_si128 (_mm_srli_epi32 (g, 8), _mm_set1_epi32 (0x0000ff00)));
+
+  return _mm_or_si128 (pixels, _mm_srli_epi32 (b, 16));
+}
+
+static int
+ramp_row_sse2 (guint32      *dest,
+               int           n_pixels,
+               const gint32  start[4],
+               const gint32  step[4])
+{
+  __m128i acc[4], step4[4];
+  int x, c;
+
+  for (c = 0; c < 4; c++)
+    {
+      acc[c] = _mm_setr_epi32 (start[c], start[c] + step[c],
+                               start[c] + 2 * step[c], start[c] + 3 * step[c]);
+      step4[c] = _mm_set1_epi32 (4 * step[c]);
+    }
+
+  for (x = 0; x + 8 <= n_pixels; x += 8)
+    {
+      _mm_storeu_si128 ((__m128i *) (dest + x),
+                        pack_argb_sse2 (acc[0], acc[1], acc[2], acc[3]));
+      for (c = 0; c < 4; c++)
+        acc[c] = _mm_add_epi32 (acc[c], step4[c]);
+
+      _mm_storeu_si128 ((__m128i *) (dest + x + 4),
+                        pack_argb_sse2 (acc[0], acc[1], acc[2], acc[3]));
+      for (c = 0; c < 4; c++)
+        acc[c] = _mm_add_epi32 (acc[c], step4[c]);
+    }
+
+  return x;
+}
+
+static int
+fill_row_sse2 (guint32 *dest,
+               int      n_pixels,
+               guint32  value)
+{
+  __m128i v = _mm_set1_epi32 ((int) value);
+  int x;
+
+  for (x = 0; x + 8 <= n_pixels; x += 8)
+    {
+      _mm_storeu_si128 ((__m128i *) (dest + x), v);
+      _mm_storeu_si128 ((__m128i *) (dest + x + 4), v);
+    }
+
+  return x;
+}
+#endif /* HAVE_SSE2 */
+
+#ifdef HAVE_NEON
+static inline uint32x4_t
+pack_argb_neon (int32x4_t a,
+                int32x4_t r,
+                int32x4_t g,
+                int32x4_t b)
+{
+  uint32x4_t pixels;
+
+  pixels = vandq_u32 (vshlq_n_u32 (vreinterpretq_u32_s32 (a), 8), vdupq_n_u32 (0xff000000));
+  pixels = vorrq_u32 (pixels, vandq_u32 (vreinterpretq_u32_s32 (r), vdupq_n_u32 (0x00ff0000)));
+  pixels = vorrq_u32 (pixels, vandq_u32 (vshrq_n_u32 (vreinterpretq_u32_s32 (g), 8),
+                                         vdupq_n_u32 (0x0000ff00)));
+
+  return vorrq_u32 (pixels, vshrq_n_u32 (vreinterpretq_u32_s32 (b), 16));
+}
+
+static int
+ramp_row_neon (guint32      *dest,
+               int           n_pixels,
+               const gint32  start[4],
+               const gint32  step[4])
+{
+  int32x4_t acc[4], step4[4];
+  int x, c;
+
+  for (c = 0; c < 4; c++)
+    {
+      gint32 first[4];
+
+      first[0] = start[c];
+      first[1] = start[c] + step[c];
+      first[2] = start[c] + 2 * step[c];
+      first[3] = start[c] + 3 * step[c];
+      acc[c] = vld1q_s32 (first);
+      step4[c] = vdupq_n_s32 (4 * step[c]);
+    }
+
+  for (x = 0; x + 8 <= n_pixels; x += 8)
+    {
+      vst1q_u32 (dest + x, pack_argb_neon (acc[0], acc[1], acc[2], acc[3]));
+      for (c = 0; c < 4; c++)
+        acc[c] = vaddq_s32 (acc[c], step4[c]);
+
+      vst1q_u32 (dest + x + 4, pack_argb_neon (acc[0], acc[1], acc[2], acc[3]));
+      for (c = 0; c < 4; c++)
+        acc[c] = vaddq_s32 (acc[c], step4[c]);
+    }
+
+  return x;
+}
+
+static int
+fill_row_neon (guint32 *dest,
+               int      n_pixels,
+               guint32  value)
+{
+  uint32x4_t v = vdupq_n_u32 (value);
+  int x;
+
+  for (x = 0; x + 8 <= n_pixels; x += 8)
+    {
+      vst1q_u32 (dest + x, v);
+      vst1q_u32 (dest + x + 4, v);
+    }
+
+  return x;
+}
+#endif /* HAVE_NEON */
+
+void
+meta_pixel_fill_row (guint32 *dest,
+                     int      n_pixels,
+                     guint32  value)
+{
+  int x = 0;
+
+#if defined (HAVE_SSE2)
+  x = fill_row_sse2 (dest, n_pixels, value);
+#elif defined (HAVE_NEON)
+  x = fill_row_neon (dest, n_pixels, value);
+#endif
+
+  for (; x < n_pixels; x++)
+    dest[x] = value;
+}
+
+void
+meta_pixel_ramp_row (guint32      *dest,
+                     int           n_pixels,
+                     const gint32  start[4],
+                     const gint32  step[4])
+{
+  int x = 0;
+
+#if defined (HAVE_SSE2)
+  x = ramp_row_sse2 (dest, n_pixels, start, step);
+#elif defined (HAVE_NEON)
+  x = ramp_row_neon (dest, n_pixels, start, step);
+#endif
+
+  for (; x < n_pixels; x++)
+    {
+      dest[x] = pack_argb (start[0] + x * step[0], start[1] + x * step[1],
+                           start[2] + x * step[2], start[3] + x * step[3]);
+    }
+}
+
+#ifdef HAVE_SSE2
+/* The per channel factors of four pixels */
+static inline __m128i
+factors_sse2 (const guchar *alphas,
+              guchar        alpha)
+{
+  __m128i f;
+  guint32 a4;
+
+  if (alphas)
+    {
+      memcpy (&a4, alphas, 4);
+      f = _mm_cvtsi32_si128 ((int) a4);
+      f = _mm_unpacklo_epi8 (f, f);
+      f = _mm_unpacklo_epi16 (f, f);
+    }
+  else
+    {
+      f = _mm_set1_epi8 ((char) alpha);
+    }
+
+  return f;
+}
+
+static inline __m128i
+multiply4_sse2 (__m128i pixels,
+                __m128i factors)
+{
+  const __m128i zero = _mm_setzero_si128 ();
+  __m128i lo, hi;
+
+  lo = _mm_mullo_epi16 (_mm_unpacklo_epi8 (pixels, zero),
+                        _mm_unpacklo_epi8 (factors, zero));
+  hi = _mm_mullo_epi16 (_mm_unpackhi_epi8 (pixels, zero),
+                        _mm_unpackhi_epi8 (factors, zero));
+
+  return _mm_packus_epi16 (div255_sse2 (lo), div255_sse2 (hi));
+}
+
+static int
+scale_row_sse2 (guchar       *pixels,
+                int           n_pixels,
+                const guchar *alphas,
+                guchar        alpha)
+{
+  int x;
+
+  for (x = 0; x + 8 <= n_pixels; x += 8)
+    {
+      __m128i a = _mm_loadu_si128 ((const __m128i *) (pixels + x * 4));
+      __m128i b = _mm_loadu_si128 ((const __m128i *) (pixels + x * 4 + 16));
+
+      a = multiply4_sse2 (a, factors_sse2 (alphas ? alphas + x : NULL, alpha));
+      b = multiply4_sse2 (b, factors_sse2 (alphas ? alphas + x + 4 : NULL, alpha));
+
+      _mm_storeu_si128 ((__m128i *) (pixels + x * 4), a);
+      _mm_storeu_si128 ((__m128i *) (pixels + x * 4 + 16), b);
+    }
+
+  return x;
+}
+#endif /* HAVE_SSE2 */
+
+#ifdef HAVE_NEON
+static inline uint8x16_t
+factors_neon (const guchar *alphas,
+              guchar        alpha)
+{
+  uint8x16_t f;
+  uint8x8x2_t pairs, quads;
+  guint32 a4;
+
+  if (alphas)
+    {
+      memcpy (&a4, alphas, 4);
+      pairs = vzip_u8 (vreinterpret_u8_u32 (vdup_n_u32 (a4)),
+                       vreinterpret_u8_u32 (vdup_n_u32 (a4)));
+      quads = vzip_u8 (pairs.val[0], pairs.val[0]);
+      f = vcombine_u8 (quads.val[0], quads.val[1]);
+    }
+  else
+    {
+      f = vdupq_n_u8 (alpha);
+    }
+
+  return f;
+}
+
+static inline uint8x16_t
+multiply4_neon (uint8x16_t pixels,
+                uint8x16_t factors)
+{
+  uint16x8_t lo, hi;
+
+  lo = vmull_u8 (vget_low_u8 (pixels), vget_low_u8 (factors));
+  hi = vmull_u8 (vget_high_u8 (pixels), vget_high_u8 (factors));
+
+  return vcombine_u8 (vmovn_u16 (div255_neon (lo)), vmovn_u16 (div255_neon (hi)));
+}
+
+static int
+scale_row_neon (guchar       *pixels,
+                int           n_pixels,
+                const guchar *alphas,
+                guchar        alpha)
+{
+  int x;
+
+  for (x = 0; x + 8 <= n_pixels; x += 8)
+    {
+      uint8x16_t a = vld1q_u8 (pixels + x * 4);
+      uint8x16_t b = vld1q_u8 (pixels + x * 4 + 16);
+
+      a = multiply4_neon (a, factors_neon (alphas ? alphas + x : NULL, alpha));
+      b = multiply4_neon (b, factors_neon (alphas ? alphas + x + 4 : NULL, alpha));
+
+      vst1q_u8 (pixels + x * 4, a);
+      vst1q_u8 (pixels + x * 4 + 16, b);
+    }
+
+  return x;
+}
+#endif /* HAVE_NEON */
+
+void
+meta_pixel_scale_row (guint32      *pixels,
+                      int           n_pixels,
+                      const guchar *alphas,
+                      guchar        alpha)
+{
+  guchar *bytes = (guchar *) pixels;
+  int x = 0;
+  int c;
+
+#if defined (HAVE_SSE2)
+  x = scale_row_sse2 (bytes, n_pixels, alphas, alpha);
+#elif defined (HAVE_NEON)
+  x = scale_row_neon (bytes, n_pixels, alphas, alpha);
+#endif
+
+  for (; x < n_pixels; x++)
+    {
+      guint a = alphas ? alphas[x] : alpha;
+
+      for (c = 0; c < 4; c++)
+        bytes[x * 4 + c] = div255 (bytes[x * 4 + c] * a);
+    }
+}
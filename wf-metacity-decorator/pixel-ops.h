@@ -0,0 +1,69 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+
+/* Marco pixel processing kernels */
+
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+#ifndef META_PIXEL_OPS_H
+#define META_PIXEL_OPS_H
+
+#include <glib.h>
+
+/**
+ * Colorizes a row of 8 bit RGB or RGBA pixels: dark pixels go towards
+ * black, light ones towards white and mid-tones take the colour, which
+ * is given as 0xRRGGBB. Alpha is copied unchanged.
+ *
+ * Works in fixed point and picks the widest vector unit the CPU has the
+ * first time it is called; every implementation gives the same output.
+ */
+void meta_pixel_colorize_row (guchar       *dest,
+                              const guchar *src,
+                              int           n_pixels,
+                              int           n_channels,
+                              guint32       rgb);
+
+/**
+ * Fills a row of ARGB32 pixels with one value.
+ */
+void meta_pixel_fill_row     (guint32      *dest,
+                              int           n_pixels,
+                              guint32       value);
+
+/**
+ * Writes a linear ramp to a row of ARGB32 pixels. Channels are given in
+ * alpha, red, green, blue order as 16.16 fixed point; start is the value
+ * of the first pixel, rounding included, and step is added once per
+ * pixel. Every channel has to stay within 0 and 255 along the row.
+ */
+void meta_pixel_ramp_row     (guint32      *dest,
+                              int           n_pixels,
+                              const gint32  start[4],
+                              const gint32  step[4]);
+
+/**
+ * Multiplies the alpha of a row of premultiplied ARGB32 pixels, as found
+ * in a cairo image surface, by alphas[x] / 255, or by alpha / 255 if
+ * alphas is NULL; which means scaling every channel.
+ */
+void meta_pixel_scale_row    (guint32      *pixels,
+                              int           n_pixels,
+                              const guchar *alphas,
+                              guchar        alpha);
+
+#endif
@@ -2,65 +2,86 @@
 #include "wf-decorator-client-protocol.h"
 #include <wayland-client.h>
 #include <string.h>
-#include <iostream>
-#include <map>
+#include <algorithm>
+#include "log.hpp"
+#include "trace.h"
 
 wl_display *display;
 wf_decorator_manager *decorator_manager;
-
-static std::map<uint32_t, GtkWidget*> view_to_decor;
-static std::map<GtkWidget*, uint32_t> decor_to_view;
+static uint32_t decorator_manager_version;
 
 static void create_new_decoration(void*, wf_decorator_manager*, uint32_t view, uint32_t type)
 {
-    std::cout << "create new decoration" << std::endl;
-    GtkWidget *window = create_deco_window("__wf_decorator:" + std::to_string(view), type);
-    
-    view_to_decor[view] = window;
-    decor_to_view[window] = view;
+    DECO_TRACE_SCOPE("protocol", "create_new_decoration");
+    DLOGD("create new decoration %u\n", view);
+    create_decoration(view, type);
 }
 
 static void title_changed(void*,
     wf_decorator_manager*, uint32_t view, const char *new_title)
 {
-    if(view_to_decor.count(view) > 0)
-    {
-        std::cout << "title_changed" << std::endl;
-        set_title(view_to_decor[view], new_title);
-    }        
+    DECO_TRACE_SCOPE("protocol", "title_changed");
+    DLOGD("title_changed %u\n", view);
+    set_title(view, new_title);
 }
 
 static void view_state_changed(void*,
     wf_decorator_manager*, uint32_t view, uint32_t state)
 {
-    if(view_to_decor.count(view) > 0)
-    {
-        std::cout << "view state changed " << state << std::endl;
-        set_view_state(view_to_decor[view], state);
-    }        
+    DECO_TRACE_SCOPE("protocol", "view_state_changed");
+    DLOGD("view state changed %u %u\n", view, state);
+    set_view_state(view, state);
+}
+
+static void configure_hint(void*,
+    wf_decorator_manager*, uint32_t view, uint32_t serial, uint32_t width, uint32_t height, uint32_t state)
+{
+    DECO_TRACE_SCOPE("protocol", "configure_hint");
+    DLOGD("configure hint %u serial %u %ux%u state %u\n", view, serial, width, height, state);
+    set_configure_hint(view, serial, width, height, state);
 }
 
 static void view_unmapped(void*,
     wf_decorator_manager*, uint32_t view)
 {
-    if(view_to_decor.count(view) > 0)
-    {
-        std::cout << "view_unmapped" << std::endl;
-        GtkWidget *window = view_to_decor[view];
-        set_view_unmapped(window);
-        view_to_decor.erase(view);
-        decor_to_view.erase(window);
-    }        
+    DECO_TRACE_SCOPE("protocol", "view_unmapped");
+    DLOGD("view_unmapped %u\n", view);
+    set_view_unmapped(view);
 }
 
 void update_borders(uint32_t top, uint32_t bottom, uint32_t left, uint32_t right, uint32_t delta)
 {
     wf_decorator_manager_update_borders(decorator_manager, top, bottom, left, right, delta);
+    // the compositor waits for this before decorating anything
+    wl_display_flush(display);
+}
+
+void update_hit_map(uint32_t view, const std::vector<DecoHitRegion>& regions)
+{
+    // an older plugin hit-tests nothing, the pointer keeps coming here
+    if (decorator_manager_version < WF_DECORATOR_MANAGER_UPDATE_HIT_MAP_SINCE_VERSION)
+        return;
+    wl_array array;
+    wl_array_init(&array);
+    void *data = wl_array_add(&array, regions.size() * sizeof(DecoHitRegion));
+    if (data)
+    {
+        memcpy(data, regions.data(), regions.size() * sizeof(DecoHitRegion));
+        wf_decorator_manager_update_hit_map(decorator_manager, view, &array);
+    }
+    wl_array_release(&array);
+}
+
+void ack_configure_hint(uint32_t view, uint32_t serial)
+{
+    if (decorator_manager_version < WF_DECORATOR_MANAGER_ACK_CONFIGURE_HINT_SINCE_VERSION)
+        return;
+    wf_decorator_manager_ack_configure_hint(decorator_manager, view, serial);
 }
 
-void window_action(GtkWidget *window, const char *action)
+void window_action(uint32_t view, const char *action)
 {
-    wf_decorator_manager_window_action(decorator_manager, decor_to_view[window], action);
+    wf_decorator_manager_window_action(decorator_manager, view, action);
 }
 
 const wf_decorator_manager_listener decorator_listener =
@@ -68,18 +89,21 @@ const wf_decorator_manager_listener decorator_listener =
     create_new_decoration,
     title_changed,
     view_state_changed,
-    view_unmapped
+    view_unmapped,
+    configure_hint
 };
 
 void registry_add_object(void*, struct wl_registry *registry, uint32_t name,
-        const char *interface, uint32_t)
+        const char *interface, uint32_t version)
 {
-    // std::cout << "new registry: " << interface << std::endl;
+    DLOGT("new registry: %s\n", interface);
     if (strcmp(interface, wf_decorator_manager_interface.name) == 0)
     {
-        std::cout << "bind it" << std::endl;
+        DLOGD("bind it\n");
+        decorator_manager_version = std::min(version, 3u);
         decorator_manager =
-            (wf_decorator_manager*) wl_registry_bind(registry, name, &wf_decorator_manager_interface, 1u);
+            (wf_decorator_manager*) wl_registry_bind(registry, name, &wf_decorator_manager_interface,
+                                                     decorator_manager_version);
 
         wf_decorator_manager_add_listener(decorator_manager, &decorator_listener, NULL);
     }
@@ -98,7 +122,7 @@ static struct wl_registry_listener registry_listener =
 
 void setup_protocol(GdkDisplay *displ)
 {
-    auto display = gdk_wayland_display_get_wl_display(displ);
+    display = gdk_wayland_display_get_wl_display(displ);
     auto registry = wl_display_get_registry(display);
 
     wl_registry_add_listener(registry, &registry_listener, NULL);
@@ -5,16 +5,21 @@
 #include <gtk/gtk.h>
 #include <string>
 #include <stdio.h>
+#include <vector>
+#include "hit-map.h"
 
 void setup_protocol(GdkDisplay *display);
 
-/* Before mapping (widget.show_all()) the window title must be set EXACTLY as the parameter title */
-GtkWidget *create_deco_window(std::string title, uint32_t type);
+/* Before mapping (widget.show_all()) the window title must be set EXACTLY as __wf_decorator:<view> */
+void create_decoration(uint32_t view, uint32_t type);
 
-void set_title       (GtkWidget *window, const char *title);
-void set_view_state(GtkWidget *window, uint32_t state);
-void set_view_unmapped(GtkWidget *window);
+void set_title       (uint32_t view, const char *title);
+void set_view_state(uint32_t view, uint32_t state);
+void set_view_unmapped(uint32_t view);
+void set_configure_hint(uint32_t view, uint32_t serial, uint32_t width, uint32_t height, uint32_t state);
 void update_borders(uint32_t left, uint32_t right, uint32_t bottom, uint32_t top, uint32_t delta);
-void window_action(GtkWidget *window, const char *action);
+void window_action(uint32_t view, const char *action);
+void update_hit_map(uint32_t view, const std::vector<DecoHitRegion>& regions);
+void ack_configure_hint(uint32_t view, uint32_t serial);
 
 #endif /* end of include guard: PROTOCOL_HPP */
@@ -0,0 +1,216 @@
+#ifndef REGISTRY_HPP
+#define REGISTRY_HPP
+
+#include <gtk/gtk.h>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <utility>
+#include <vector>
+
+/*
+ * Registry of the decorations, one record per decorated view.
+ *
+ * Records live in a slab of fixed size chunks, which never move, so a
+ * record pointer stays valid while other views come and go, and the slots
+ * of unmapped views are reused. Records are found by view id and by
+ * window through two flat hash maps of handles; a handle also carries
+ * the generation of its slot, so a stale one can't reach the record of a
+ * later view that reused the slot.
+ */
+
+struct decoration_handle_t
+{
+    uint32_t index = 0;
+    uint32_t generation = 0;
+};
+
+// open addressing with linear probing, for integer and pointer keys
+template<class Key>
+class flat_map_t
+{
+    struct entry_t
+    {
+        Key key;
+        decoration_handle_t value;
+        bool used = false;
+    };
+
+    std::vector<entry_t> entries;
+    size_t count = 0;
+
+    size_t home(Key key) const
+    {
+        uint64_t hash = (uint64_t)(uintptr_t)key * 0x9e3779b97f4a7c15ull;
+        return (size_t)(hash >> 32) & (entries.size() - 1);
+    }
+
+    size_t probe(Key key) const
+    {
+        size_t i = home(key);
+        while (entries[i].used && entries[i].key != key)
+            i = (i + 1) & (entries.size() - 1);
+        return i;
+    }
+
+    void grow()
+    {
+        std::vector<entry_t> old = std::move(entries);
+        entries.assign(old.empty() ? 16 : old.size() * 2, entry_t{});
+        for (const auto& entry : old)
+        {
+            if (entry.used)
+                entries[probe(entry.key)] = entry;
+        }
+    }
+
+public:
+
+    const decoration_handle_t *find(Key key) const
+    {
+        if (count == 0)
+            return NULL;
+        const entry_t& entry = entries[probe(key)];
+        return entry.used ? &entry.value : NULL;
+    }
+
+    void insert(Key key, decoration_handle_t value)
+    {
+        // keep the load under 3/4, probes stay short
+        if ((count + 1) * 4 > entries.size() * 3)
+            grow();
+        entry_t& entry = entries[probe(key)];
+        if (!entry.used)
+            count++;
+        entry = {key, value, true};
+    }
+
+    void erase(Key key)
+    {
+        if (count == 0)
+            return;
+        size_t mask = entries.size() - 1;
+        size_t i = probe(key);
+        if (!entries[i].used)
+            return;
+        entries[i].used = false;
+        count--;
+        // shift back the entries after the hole which can't be found past it
+        for (size_t j = (i + 1) & mask; entries[j].used; j = (j + 1) & mask)
+        {
+            size_t k = home(entries[j].key);
+            bool reachable = i <= j ? (i < k && k <= j) : (i < k || k <= j);
+            if (reachable)
+                continue;
+            entries[i] = entries[j];
+            entries[j].used = false;
+            i = j;
+        }
+    }
+};
+
+template<class Record>
+class decoration_registry_t
+{
+    static constexpr uint32_t CHUNK_SIZE = 32;
+
+    struct slot_t
+    {
+        std::optional<Record> record;
+        uint32_t generation = 0;
+        uint32_t view_id = 0;
+        GtkWidget *window = NULL;
+    };
+
+    struct chunk_t
+    {
+        slot_t slots[CHUNK_SIZE];
+    };
+
+    std::vector<std::unique_ptr<chunk_t>> chunks;
+    std::vector<uint32_t> free_slots;
+    uint32_t n_slots = 0;
+    flat_map_t<uint32_t> by_view;
+    flat_map_t<GtkWidget*> by_window;
+
+    slot_t& slot(uint32_t index)
+    {
+        return chunks[index / CHUNK_SIZE]->slots[index % CHUNK_SIZE];
+    }
+
+    slot_t *get(const decoration_handle_t *handle)
+    {
+        if (handle == NULL)
+            return NULL;
+        slot_t& s = slot(handle->index);
+        return s.record && s.generation == handle->generation ? &s : NULL;
+    }
+
+public:
+
+    template<class... Args>
+    Record *add(uint32_t view_id, GtkWidget *window, Args&&... args)
+    {
+        uint32_t index;
+        if (!free_slots.empty())
+        {
+            index = free_slots.back();
+            free_slots.pop_back();
+        }
+        else
+        {
+            if (n_slots % CHUNK_SIZE == 0)
+                chunks.push_back(std::make_unique<chunk_t>());
+            index = n_slots++;
+        }
+
+        slot_t& s = slot(index);
+        s.record.emplace(std::forward<Args>(args)...);
+        s.view_id = view_id;
+        s.window = window;
+        by_view.insert(view_id, {index, s.generation});
+        by_window.insert(window, {index, s.generation});
+        return &*s.record;
+    }
+
+    Record *find_view(uint32_t view_id)
+    {
+        slot_t *s = get(by_view.find(view_id));
+        return s ? &*s->record : NULL;
+    }
+
+    Record *find_window(GtkWidget *window)
+    {
+        slot_t *s = get(by_window.find(window));
+        return s ? &*s->record : NULL;
+    }
+
+    void remove(GtkWidget *window)
+    {
+        const decoration_handle_t *handle = by_window.find(window);
+        slot_t *s = get(handle);
+        if (s == NULL)
+            return;
+        uint32_t index = handle->index;
+        by_view.erase(s->view_id);
+        by_window.erase(s->window);
+        s->record.reset();
+        // handles to the old record no longer match
+        s->generation++;
+        s->window = NULL;
+        free_slots.push_back(index);
+    }
+
+    template<class F>
+    void for_each(F f)
+    {
+        for (uint32_t i = 0; i < n_slots; i++)
+        {
+            slot_t& s = slot(i);
+            if (s.record)
+                f(s.window, *s.record);
+        }
+    }
+};
+
+#endif /* end of include guard: REGISTRY_HPP */
@@ -0,0 +1,217 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+
+/* Marco rendered surface cache */
+
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+#include <string.h>
+#include "surface-cache.h"
+
+typedef struct
+{
+  gsize size;
+  guchar data[];
+} CacheKey;
+
+typedef struct
+{
+  /* in the LRU queue, data points back at the entry */
+  GList link;
+  CacheKey *key;
+  cairo_surface_t *surface;
+  gsize bytes;
+} CacheEntry;
+
+struct _MetaSurfaceCache
+{
+  gsize key_size;
+  gsize max_bytes;
+  gsize bytes;
+  /* CacheKey -> CacheEntry, the key belongs to the entry */
+  GHashTable *entries;
+  /* most recently used first */
+  GQueue lru;
+  guint hits;
+  guint misses;
+};
+
+static guint
+cache_key_hash (gconstpointer v)
+{
+  const CacheKey *key = v;
+  guint hash = 5381;
+  gsize i;
+
+  for (i = 0; i < key->size; i++)
+    hash = hash * 33 + key->data[i];
+
+  return hash;
+}
+
+static gboolean
+cache_key_equal (gconstpointer a,
+                 gconstpointer b)
+{
+  const CacheKey *key_a = a;
+  const CacheKey *key_b = b;
+
+  return key_a->size == key_b->size &&
+         memcmp (key_a->data, key_b->data, key_a->size) == 0;
+}
+
+static gsize
+surface_bytes (cairo_surface_t *surface)
+{
+  if (cairo_surface_get_type (surface) != CAIRO_SURFACE_TYPE_IMAGE)
+    return 0;
+
+  return (gsize) cairo_image_surface_get_stride (surface) *
+         cairo_image_surface_get_height (surface);
+}
+
+static void
+cache_entry_free (gpointer data)
+{
+  CacheEntry *entry = data;
+
+  cairo_surface_destroy (entry->surface);
+  g_free (entry->key);
+  g_free (entry);
+}
+
+static void
+cache_remove (MetaSurfaceCache *cache,
+              CacheEntry       *entry)
+{
+  g_queue_unlink (&cache->lru, &entry->link);
+  cache->bytes -= entry->bytes;
+  /* frees the entry */
+  g_hash_table_remove (cache->entries, entry->key);
+}
+
+MetaSurfaceCache *
+meta_surface_cache_new (gsize key_size,
+                        gsize max_bytes)
+{
+  MetaSurfaceCache *cache;
+
+  cache = g_new0 (MetaSurfaceCache, 1);
+  cache->key_size = key_size;
+  cache->max_bytes = max_bytes;
+  cache->entries = g_hash_table_new_full (cache_key_hash, cache_key_equal,
+                                          NULL, cache_entry_free);
+  g_queue_init (&cache->lru);
+
+  return cache;
+}
+
+void
+meta_surface_cache_free (MetaSurfaceCache *cache)
+{
+  if (cache == NULL)
+    return;
+
+  g_hash_table_destroy (cache->entries);
+  g_free (cache);
+}
+
+/**
+ * \return A new reference to the cached surface, or NULL on a miss
+ */
+cairo_surface_t *
+meta_surface_cache_lookup (MetaSurfaceCache *cache,
+                           gconstpointer     key)
+{
+  CacheKey *lookup;
+  CacheEntry *entry;
+
+  lookup = g_alloca (sizeof (CacheKey) + cache->key_size);
+  lookup->size = cache->key_size;
+  memcpy (lookup->data, key, cache->key_size);
+
+  entry = g_hash_table_lookup (cache->entries, lookup);
+  if (entry == NULL)
+    {
+      cache->misses++;
+      return NULL;
+    }
+
+  cache->hits++;
+  g_queue_unlink (&cache->lru, &entry->link);
+  g_queue_push_head_link (&cache->lru, &entry->link);
+
+  return cairo_surface_reference (entry->surface);
+}
+
+/**
+ * Adds a surface to the cache, which takes a reference of its own.
+ * Surfaces larger than the whole cache are not kept.
+ */
+void
+meta_surface_cache_insert (MetaSurfaceCache *cache,
+                           gconstpointer     key,
+                           cairo_surface_t  *surface)
+{
+  CacheEntry *entry, *old;
+  gsize bytes;
+
+  bytes = surface_bytes (surface);
+  if (bytes > cache->max_bytes)
+    return;
+
+  entry = g_new0 (CacheEntry, 1);
+  entry->key = g_malloc (sizeof (CacheKey) + cache->key_size);
+  entry->key->size = cache->key_size;
+  memcpy (entry->key->data, key, cache->key_size);
+  entry->surface = cairo_surface_reference (surface);
+  entry->bytes = bytes;
+  entry->link.data = entry;
+
+  old = g_hash_table_lookup (cache->entries, entry->key);
+  if (old)
+    cache_remove (cache, old);
+
+  g_hash_table_insert (cache->entries, entry->key, entry);
+  g_queue_push_head_link (&cache->lru, &entry->link);
+  cache->bytes += bytes;
+
+  while (cache->bytes > cache->max_bytes)
+    cache_remove (cache, g_queue_peek_tail (&cache->lru));
+}
+
+void
+meta_surface_cache_clear (MetaSurfaceCache *cache)
+{
+  g_queue_init (&cache->lru);
+  g_hash_table_remove_all (cache->entries);
+  cache->bytes = 0;
+}
+
+void
+meta_surface_cache_get_stats (MetaSurfaceCache *cache,
+                              guint            *hits,
+                              guint            *misses,
+                              gsize            *bytes)
+{
+  if (hits)
+    *hits = cache->hits;
+  if (misses)
+    *misses = cache->misses;
+  if (bytes)
+    *bytes = cache->bytes;
+}
@@ -0,0 +1,52 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+
+/* Marco rendered surface cache */
+
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+#ifndef META_SURFACE_CACHE_H
+#define META_SURFACE_CACHE_H
+
+#include <glib.h>
+#include <cairo.h>
+
+/**
+ * A least recently used cache of rendered cairo surfaces.
+ *
+ * Keys are plain structs of a size fixed when the cache is created and
+ * are compared bytewise, so callers must zero them (padding included)
+ * before filling them in. Once the pixels held go over the byte limit,
+ * the least recently used surfaces are dropped.
+ */
+typedef struct _MetaSurfaceCache MetaSurfaceCache;
+
+MetaSurfaceCache *meta_surface_cache_new       (gsize             key_size,
+                                                gsize             max_bytes);
+void              meta_surface_cache_free      (MetaSurfaceCache *cache);
+cairo_surface_t  *meta_surface_cache_lookup    (MetaSurfaceCache *cache,
+                                                gconstpointer     key);
+void              meta_surface_cache_insert    (MetaSurfaceCache *cache,
+                                                gconstpointer     key,
+                                                cairo_surface_t  *surface);
+void              meta_surface_cache_clear     (MetaSurfaceCache *cache);
+void              meta_surface_cache_get_stats (MetaSurfaceCache *cache,
+                                                guint            *hits,
+                                                guint            *misses,
+                                                gsize            *bytes);
+
+#endif
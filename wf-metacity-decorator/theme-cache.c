@@ -0,0 +1,425 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+
+/* Marco theme image cache */
+
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+#include <glib/gstdio.h>
+#include <errno.h>
+#include <string.h>
+#include "theme-cache.h"
+#include "util.h"
+
+#define CACHE_SUBDIR "wf-metacity-decorator"
+#define CACHE_MAGIC  0x4d544331 /* "MTC1"; also catches a byte order mismatch */
+#define CACHE_ALIGN  64
+
+/* On-disk layout: a header, n_entries entries, the NUL terminated
+ * image names, then the pixel data of every image, each one aligned
+ * to CACHE_ALIGN bytes. All offsets are relative to the start of the
+ * file.
+ */
+typedef struct
+{
+  guint32 magic;
+  guint32 version;
+  guint32 scale;
+  guint32 n_entries;
+  gint64  theme_mtime;
+  gint64  theme_size;
+} CacheHeader;
+
+typedef struct
+{
+  guint64 name_offset;
+  guint64 data_offset;
+  gint64  mtime;
+  gint64  size;
+  guint32 width;
+  guint32 height;
+  guint32 rowstride;
+  guint32 has_alpha;
+} CacheEntry;
+
+typedef struct
+{
+  GdkPixbuf *pixbuf;
+  gint64 mtime;
+  gint64 size;
+} CacheImage;
+
+struct _MetaThemeCache
+{
+  char *path;
+  int scale;
+  gint64 theme_mtime;
+  gint64 theme_size;
+
+  /* the cache file as it was when we started, may be NULL */
+  GMappedFile *mapped;
+  GBytes *bytes;
+  const CacheHeader *header;
+  const CacheEntry *entries;
+  /* name -> CacheEntry of the mapped file, keys point into the mapping */
+  GHashTable *index;
+
+  /* filename -> CacheImage, what goes into the file on the next save */
+  GHashTable *images;
+  gboolean dirty;
+};
+
+static void
+cache_image_free (gpointer data)
+{
+  CacheImage *image = data;
+
+  g_object_unref (image->pixbuf);
+  g_free (image);
+}
+
+static gboolean
+stat_file (const char *path,
+           gint64     *mtime,
+           gint64     *size)
+{
+  GStatBuf buf;
+
+  if (g_stat (path, &buf) != 0)
+    return FALSE;
+
+  *mtime = (gint64) buf.st_mtime;
+  *size = (gint64) buf.st_size;
+
+  return TRUE;
+}
+
+/* Indexes the entries by name, checking that every name lies within the
+ * file; FALSE if one does not, the whole file is then taken as corrupt.
+ */
+static gboolean
+cache_index (MetaThemeCache *cache,
+             const char     *data,
+             gsize           length)
+{
+  guint32 i;
+
+  cache->index = g_hash_table_new (g_str_hash, g_str_equal);
+
+  for (i = 0; i < cache->header->n_entries; i++)
+    {
+      const CacheEntry *entry = &cache->entries[i];
+      const char *name;
+
+      if (entry->name_offset >= length)
+        return FALSE;
+
+      name = data + entry->name_offset;
+      if (memchr (name, '\0', length - entry->name_offset) == NULL)
+        return FALSE;
+
+      g_hash_table_insert (cache->index, (gpointer) name, (gpointer) entry);
+    }
+
+  return TRUE;
+}
+
+static void
+cache_unmap (MetaThemeCache *cache)
+{
+  g_clear_pointer (&cache->index, g_hash_table_destroy);
+  g_clear_pointer (&cache->bytes, g_bytes_unref);
+  g_clear_pointer (&cache->mapped, g_mapped_file_unref);
+  cache->header = NULL;
+  cache->entries = NULL;
+}
+
+static gboolean
+cache_map (MetaThemeCache *cache)
+{
+  const CacheHeader *header;
+  gsize length;
+
+  cache->mapped = g_mapped_file_new (cache->path, FALSE, NULL);
+  if (cache->mapped == NULL)
+    return FALSE;
+
+  length = g_mapped_file_get_length (cache->mapped);
+  header = (const CacheHeader *) g_mapped_file_get_contents (cache->mapped);
+
+  if (length < sizeof (CacheHeader) ||
+      header->magic != CACHE_MAGIC ||
+      header->version != META_THEME_CACHE_VERSION ||
+      header->scale != (guint32) cache->scale ||
+      header->theme_mtime != cache->theme_mtime ||
+      header->theme_size != cache->theme_size ||
+      header->n_entries > (length - sizeof (CacheHeader)) / sizeof (CacheEntry))
+    {
+      meta_topic (META_DEBUG_THEMES, "Ignoring stale image cache %s\n",
+                  cache->path);
+      g_mapped_file_unref (cache->mapped);
+      cache->mapped = NULL;
+      return FALSE;
+    }
+
+  cache->bytes = g_mapped_file_get_bytes (cache->mapped);
+  cache->header = header;
+  cache->entries = (const CacheEntry *) (header + 1);
+
+  if (!cache_index (cache, (const char *) header, length))
+    {
+      meta_topic (META_DEBUG_THEMES, "Ignoring corrupt image cache %s\n",
+                  cache->path);
+      cache_unmap (cache);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+MetaThemeCache *
+meta_theme_cache_open (const char *theme_file,
+                       int         scale)
+{
+  MetaThemeCache *cache;
+  char *checksum;
+  char *basename;
+
+  cache = g_new0 (MetaThemeCache, 1);
+
+  if (!stat_file (theme_file, &cache->theme_mtime, &cache->theme_size))
+    {
+      g_free (cache);
+      return NULL;
+    }
+
+  checksum = g_compute_checksum_for_string (G_CHECKSUM_SHA1, theme_file, -1);
+  basename = g_strconcat (checksum, ".cache", NULL);
+  cache->path = g_build_filename (g_get_user_cache_dir (), CACHE_SUBDIR,
+                                  basename, NULL);
+  g_free (basename);
+  g_free (checksum);
+
+  cache->scale = scale;
+  cache->images = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                         g_free, cache_image_free);
+
+  /* A missing or stale cache gets rewritten once the theme is loaded */
+  if (!cache_map (cache))
+    cache->dirty = TRUE;
+
+  return cache;
+}
+
+void
+meta_theme_cache_free (MetaThemeCache *cache)
+{
+  if (cache == NULL)
+    return;
+
+  g_hash_table_destroy (cache->images);
+  cache_unmap (cache);
+  g_free (cache->path);
+  g_free (cache);
+}
+
+static const CacheEntry *
+find_entry (MetaThemeCache *cache,
+            const char     *filename)
+{
+  if (cache->index == NULL)
+    return NULL;
+
+  return g_hash_table_lookup (cache->index, filename);
+}
+
+GdkPixbuf *
+meta_theme_cache_lookup (MetaThemeCache *cache,
+                         const char     *filename,
+                         const char     *full_path)
+{
+  const CacheEntry *entry;
+  CacheImage *image;
+  GBytes *pixels;
+  GdkPixbuf *pixbuf;
+  gint64 mtime, size;
+  guint64 byte_length;
+
+  image = g_hash_table_lookup (cache->images, filename);
+  if (image)
+    return g_object_ref (image->pixbuf);
+
+  entry = find_entry (cache, filename);
+  if (entry == NULL)
+    return NULL;
+
+  if (!stat_file (full_path, &mtime, &size) ||
+      mtime != entry->mtime || size != entry->size)
+    {
+      cache->dirty = TRUE;
+      return NULL;
+    }
+
+  if (entry->width == 0 || entry->height == 0)
+    return NULL;
+
+  byte_length = (guint64) (entry->height - 1) * entry->rowstride +
+                (guint64) entry->width * (entry->has_alpha ? 4 : 3);
+
+  if (entry->data_offset > g_bytes_get_size (cache->bytes) ||
+      byte_length > g_bytes_get_size (cache->bytes) - entry->data_offset)
+    return NULL;
+
+  pixels = g_bytes_new_from_bytes (cache->bytes, entry->data_offset, byte_length);
+  pixbuf = gdk_pixbuf_new_from_bytes (pixels, GDK_COLORSPACE_RGB,
+                                      entry->has_alpha, 8,
+                                      entry->width, entry->height,
+                                      entry->rowstride);
+  g_bytes_unref (pixels);
+
+  /* a bad entry is a miss, the image is decoded and the cache rewritten */
+  if (pixbuf == NULL)
+    {
+      cache->dirty = TRUE;
+      return NULL;
+    }
+
+  image = g_new (CacheImage, 1);
+  image->pixbuf = g_object_ref (pixbuf);
+  image->mtime = mtime;
+  image->size = size;
+  g_hash_table_replace (cache->images, g_strdup (filename), image);
+
+  return pixbuf;
+}
+
+void
+meta_theme_cache_insert (MetaThemeCache *cache,
+                         const char     *filename,
+                         const char     *full_path,
+                         GdkPixbuf      *pixbuf)
+{
+  CacheImage *image;
+  gint64 mtime, size;
+
+  if (gdk_pixbuf_get_bits_per_sample (pixbuf) != 8 ||
+      gdk_pixbuf_get_n_channels (pixbuf) != (gdk_pixbuf_get_has_alpha (pixbuf) ? 4 : 3))
+    return;
+
+  if (!stat_file (full_path, &mtime, &size))
+    return;
+
+  image = g_new (CacheImage, 1);
+  image->pixbuf = g_object_ref (pixbuf);
+  image->mtime = mtime;
+  image->size = size;
+  g_hash_table_replace (cache->images, g_strdup (filename), image);
+
+  cache->dirty = TRUE;
+}
+
+void
+meta_theme_cache_save (MetaThemeCache *cache)
+{
+  GHashTableIter iter;
+  gpointer key, value;
+  CacheHeader *header;
+  CacheEntry *entry;
+  char *contents;
+  char *dirname;
+  gsize names_offset, data_offset, length;
+  guint n_entries;
+  GError *error = NULL;
+
+  if (cache == NULL || !cache->dirty)
+    return;
+
+  n_entries = g_hash_table_size (cache->images);
+
+  /* First pass works out where everything goes */
+  names_offset = sizeof (CacheHeader) + n_entries * sizeof (CacheEntry);
+  data_offset = names_offset;
+  g_hash_table_iter_init (&iter, cache->images);
+  while (g_hash_table_iter_next (&iter, &key, NULL))
+    data_offset += strlen (key) + 1;
+
+  length = data_offset;
+  g_hash_table_iter_init (&iter, cache->images);
+  while (g_hash_table_iter_next (&iter, NULL, &value))
+    {
+      CacheImage *image = value;
+
+      length = (length + CACHE_ALIGN - 1) & ~((gsize) CACHE_ALIGN - 1);
+      length += gdk_pixbuf_get_byte_length (image->pixbuf);
+    }
+
+  contents = g_malloc0 (length);
+
+  header = (CacheHeader *) contents;
+  header->magic = CACHE_MAGIC;
+  header->version = META_THEME_CACHE_VERSION;
+  header->scale = cache->scale;
+  header->n_entries = n_entries;
+  header->theme_mtime = cache->theme_mtime;
+  header->theme_size = cache->theme_size;
+
+  entry = (CacheEntry *) (header + 1);
+  g_hash_table_iter_init (&iter, cache->images);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    {
+      CacheImage *image = value;
+      gsize name_length = strlen (key) + 1;
+      gsize byte_length = gdk_pixbuf_get_byte_length (image->pixbuf);
+
+      data_offset = (data_offset + CACHE_ALIGN - 1) & ~((gsize) CACHE_ALIGN - 1);
+
+      entry->name_offset = names_offset;
+      entry->data_offset = data_offset;
+      entry->mtime = image->mtime;
+      entry->size = image->size;
+      entry->width = gdk_pixbuf_get_width (image->pixbuf);
+      entry->height = gdk_pixbuf_get_height (image->pixbuf);
+      entry->rowstride = gdk_pixbuf_get_rowstride (image->pixbuf);
+      entry->has_alpha = gdk_pixbuf_get_has_alpha (image->pixbuf);
+
+      memcpy (contents + names_offset, key, name_length);
+      memcpy (contents + data_offset,
+              gdk_pixbuf_read_pixels (image->pixbuf), byte_length);
+
+      names_offset += name_length;
+      data_offset += byte_length;
+      entry++;
+    }
+
+  dirname = g_path_get_dirname (cache->path);
+  if (g_mkdir_with_parents (dirname, 0700) != 0 ||
+      !g_file_set_contents (cache->path, contents, length, &error))
+    {
+      meta_topic (META_DEBUG_THEMES, "Failed to write image cache %s: %s\n",
+                  cache->path, error ? error->message : g_strerror (errno));
+      g_clear_error (&error);
+    }
+  else
+    {
+      meta_topic (META_DEBUG_THEMES, "Wrote %u images to cache %s\n",
+                  n_entries, cache->path);
+      cache->dirty = FALSE;
+    }
+
+  g_free (dirname);
+  g_free (contents);
+}
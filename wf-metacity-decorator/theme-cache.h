@@ -0,0 +1,56 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+
+/* Marco theme image cache */
+
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+#ifndef META_THEME_CACHE_H
+#define META_THEME_CACHE_H
+
+#include <gdk-pixbuf/gdk-pixbuf.h>
+
+/**
+ * Bump this whenever the way images are decoded or the layout of the
+ * cache file changes, so stale caches from older engines are ignored.
+ */
+#define META_THEME_CACHE_VERSION 1
+
+/**
+ * A per-theme on-disk cache of decoded theme images.
+ *
+ * The cache lives in $XDG_CACHE_HOME/wf-metacity-decorator and is keyed
+ * on the path of the theme file; it is only used if the theme file, the
+ * engine version and the output scale all match what was recorded. The
+ * file is mapped read-only and the pixbufs handed out point straight
+ * into the mapping, so every decorator process shares the same pages.
+ */
+typedef struct _MetaThemeCache MetaThemeCache;
+
+MetaThemeCache *meta_theme_cache_open   (const char     *theme_file,
+                                         int             scale);
+void            meta_theme_cache_free   (MetaThemeCache *cache);
+GdkPixbuf      *meta_theme_cache_lookup (MetaThemeCache *cache,
+                                         const char     *filename,
+                                         const char     *full_path);
+void            meta_theme_cache_insert (MetaThemeCache *cache,
+                                         const char     *filename,
+                                         const char     *full_path,
+                                         GdkPixbuf      *pixbuf);
+void            meta_theme_cache_save   (MetaThemeCache *cache);
+
+#endif
@@ -122,6 +122,7 @@ typedef struct
   MetaButtonType button_type;   /* type of button/menuitem being parsed */
   MetaButtonState button_state; /* state of button being parsed */
   int skip_level;               /* depth of elements that we're ignoring */
+  gboolean geometry_only;       /* skip everything that is only needed to draw */
 } ParseInfo;
 
 typedef enum {
@@ -322,6 +323,7 @@ parse_info_init (ParseInfo *info)
   info->button_type = META_BUTTON_TYPE_LAST;
   info->button_state = META_BUTTON_STATE_LAST;
   info->skip_level = 0;
+  info->geometry_only = FALSE;
 }
 
 static void
@@ -2174,12 +2176,9 @@ parse_draw_op_element (GMarkupParseContext  *context,
       const char *colorize;
       const char *fill_type;
       MetaAlphaGradientSpec *alpha_spec;
-      GdkPixbuf *pixbuf;
+      MetaThemeImage *image;
       MetaColorSpec *colorize_spec = NULL;
       MetaImageFillType fill_type_val;
-      int h, w, c;
-      int pixbuf_width, pixbuf_height, pixbuf_n_channels, pixbuf_rowstride;
-      guchar *pixbuf_pixels;
 
       if (!locate_attributes (context, element_name, attribute_names, attribute_values,
                               error,
@@ -2223,10 +2222,13 @@ parse_draw_op_element (GMarkupParseContext  *context,
        *
        * If it's a theme image, ask for it at 64px, which is
        * the largest possible. We scale it anyway.
+       *
+       * Files are only looked up here, they get decoded once the
+       * whole theme is parsed.
        */
-      pixbuf = meta_theme_load_image (info->theme, filename, 64, error);
+      image = meta_theme_load_image (info->theme, filename, 64, error);
 
-      if (pixbuf == NULL)
+      if (image == NULL)
         {
           add_context_to_error (error, context);
           return;
@@ -2239,7 +2241,7 @@ parse_draw_op_element (GMarkupParseContext  *context,
           if (colorize_spec == NULL)
             {
               add_context_to_error (error, context);
-              g_object_unref (G_OBJECT (pixbuf));
+              meta_theme_image_unref (image);
               return;
             }
         }
@@ -2247,13 +2249,13 @@ parse_draw_op_element (GMarkupParseContext  *context,
       alpha_spec = NULL;
       if (alpha && !parse_alpha (alpha, &alpha_spec, context, error))
         {
-          g_object_unref (G_OBJECT (pixbuf));
+          meta_theme_image_unref (image);
           return;
         }
 
       op = meta_draw_op_new (META_DRAW_IMAGE);
 
-      op->data.image.pixbuf = pixbuf;
+      op->data.image.image = image;
       op->data.image.colorize_spec = colorize_spec;
 
       op->data.image.x = meta_draw_spec_new (info->theme, x, NULL);
@@ -2264,67 +2266,6 @@ parse_draw_op_element (GMarkupParseContext  *context,
       op->data.image.alpha_spec = alpha_spec;
       op->data.image.fill_type = fill_type_val;
 
-      /* Check for vertical & horizontal stripes */
-      pixbuf_n_channels = gdk_pixbuf_get_n_channels(pixbuf);
-      pixbuf_width = gdk_pixbuf_get_width(pixbuf);
-      pixbuf_height = gdk_pixbuf_get_height(pixbuf);
-      pixbuf_rowstride = gdk_pixbuf_get_rowstride(pixbuf);
-      pixbuf_pixels = gdk_pixbuf_get_pixels(pixbuf);
-
-      /* Check for horizontal stripes */
-      for (h = 0; h < pixbuf_height; h++)
-        {
-          for (w = 1; w < pixbuf_width; w++)
-            {
-              for (c = 0; c < pixbuf_n_channels; c++)
-                {
-                  if (pixbuf_pixels[(h * pixbuf_rowstride) + c] !=
-                      pixbuf_pixels[(h * pixbuf_rowstride) + w + c])
-                    break;
-                }
-              if (c < pixbuf_n_channels)
-                break;
-            }
-          if (w < pixbuf_width)
-            break;
-        }
-
-      if (h >= pixbuf_height)
-        {
-          op->data.image.horizontal_stripes = TRUE;
-        }
-      else
-        {
-          op->data.image.horizontal_stripes = FALSE;
-        }
-
-      /* Check for vertical stripes */
-      for (w = 0; w < pixbuf_width; w++)
-        {
-          for (h = 1; h < pixbuf_height; h++)
-            {
-              for (c = 0; c < pixbuf_n_channels; c++)
-                {
-                  if (pixbuf_pixels[w + c] !=
-                      pixbuf_pixels[(h * pixbuf_rowstride) + w + c])
-                    break;
-                }
-              if (c < pixbuf_n_channels)
-                break;
-            }
-          if (h < pixbuf_height)
-            break;
-        }
-
-      if (w >= pixbuf_width)
-        {
-          op->data.image.vertical_stripes = TRUE;
-        }
-      else
-        {
-          op->data.image.vertical_stripes = FALSE;
-        }
-
       g_assert (info->op_list);
 
       meta_draw_op_list_append (info->op_list, op);
@@ -3532,6 +3473,24 @@ check_version (GMarkupParseContext *context,
   return TRUE;
 }
 
+/* Draw op lists and everything that refers to them can be left out
+ * when all we want is the frame geometry.
+ */
+static gboolean
+is_drawing_element (ParseInfo   *info,
+                    const gchar *element_name)
+{
+  switch (peek_state (info))
+    {
+    case STATE_THEME:
+      return ELEMENT_IS ("draw_ops") || ELEMENT_IS ("menu_icon");
+    case STATE_FRAME_STYLE:
+      return ELEMENT_IS ("piece") || ELEMENT_IS ("button");
+    default:
+      return FALSE;
+    }
+}
+
 static void
 start_element_handler (GMarkupParseContext *context,
                        const gchar         *element_name,
@@ -3550,6 +3509,12 @@ start_element_handler (GMarkupParseContext *context,
       return;
     }
 
+  if (info->geometry_only && is_drawing_element (info, element_name))
+    {
+      info->skip_level = 1;
+      return;
+    }
+
   required_version = peek_required_version (info);
 
   version = find_version (attribute_names, attribute_values);
@@ -3768,6 +3733,8 @@ end_element_handler (GMarkupParseContext *context,
           meta_theme_free (info->theme);
           info->theme = NULL;
         }
+      else
+        meta_theme_optimize (info->theme);
 
       pop_state (info);
       g_assert (peek_state (info) == STATE_START);
@@ -3943,7 +3910,9 @@ end_element_handler (GMarkupParseContext *context,
     case STATE_FRAME_STYLE:
       g_assert (info->style);
 
-      if (!meta_frame_style_validate (info->style,
+      /* Buttons were skipped on purpose in a geometry-only load */
+      if (!info->geometry_only &&
+          !meta_frame_style_validate (info->style,
                                       peek_required_version (info),
                                       error))
         {
@@ -4264,6 +4233,7 @@ static MetaTheme*
 load_theme (const char *theme_dir,
             const char *theme_name,
 	    guint       major_version,
+            gboolean    geometry_only,
             GError    **error)
 {
   GMarkupParseContext *context;
@@ -4295,6 +4265,7 @@ load_theme (const char *theme_dir,
   info.theme_dir = theme_dir;
 
   info.format_version = 1000 * major_version;
+  info.geometry_only = geometry_only;
 
   context = g_markup_parse_context_new (&marco_theme_parser, 0, &info, NULL);
 
@@ -4307,6 +4278,9 @@ load_theme (const char *theme_dir,
   retval = info.theme;
   info.theme = NULL;
 
+  if (retval)
+    meta_theme_load_images (retval);
+
  out:
   if (*error && !theme_error_is_fatal (*error))
   {
@@ -4338,9 +4312,10 @@ keep_trying (GError **error)
   return FALSE;
 }
 
-MetaTheme*
-meta_theme_load (const char  *theme_name,
-                 GError     **err)
+static MetaTheme*
+find_and_load_theme (const char  *theme_name,
+                     gboolean     geometry_only,
+                     GError     **err)
 {
   GError *error = NULL;
   char *theme_dir;
@@ -4357,7 +4332,7 @@ meta_theme_load (const char  *theme_name,
       for (major_version = THEME_MAJOR_VERSION; (major_version > 0); major_version--)
         {
 	  theme_dir = g_build_filename ("./themes", theme_name, NULL);
-          retval = load_theme (theme_dir, theme_name, major_version, &error);
+          retval = load_theme (theme_dir, theme_name, major_version, geometry_only, &error);
 
 	  if (!keep_trying (&error))
 	    goto out;
@@ -4377,7 +4352,7 @@ meta_theme_load (const char  *theme_name,
                                     THEME_SUBDIR,
                                     NULL);
 
-      retval = load_theme (theme_dir, theme_name, major_version, &error);
+      retval = load_theme (theme_dir, theme_name, major_version, geometry_only, &error);
       g_free (theme_dir);
       if (!keep_trying (&error))
         goto out;
@@ -4389,7 +4364,7 @@ meta_theme_load (const char  *theme_name,
 				    THEME_SUBDIR,
 				    NULL);
 
-       retval = load_theme (theme_dir, theme_name, major_version, &error);
+       retval = load_theme (theme_dir, theme_name, major_version, geometry_only, &error);
        g_free (theme_dir);
 
        if (!keep_trying (&error))
@@ -4405,7 +4380,7 @@ meta_theme_load (const char  *theme_name,
                                         THEME_SUBDIR,
                                         NULL);
 
-          retval = load_theme (theme_dir, theme_name, major_version, &error);
+          retval = load_theme (theme_dir, theme_name, major_version, geometry_only, &error);
           g_free (theme_dir);
           if (!keep_trying (&error))
             goto out;
@@ -4416,7 +4391,7 @@ meta_theme_load (const char  *theme_name,
                                     theme_name,
                                     THEME_SUBDIR,
                                     NULL);
-      retval = load_theme (theme_dir, theme_name, major_version, &error);
+      retval = load_theme (theme_dir, theme_name, major_version, geometry_only, &error);
       g_free (theme_dir);
       if (!keep_trying (&error))
         goto out;
@@ -4436,3 +4411,24 @@ meta_theme_load (const char  *theme_name,
 
   return retval;
 }
+
+MetaTheme*
+meta_theme_load (const char  *theme_name,
+                 GError     **err)
+{
+  return find_and_load_theme (theme_name, FALSE, err);
+}
+
+/**
+ * Loads just enough of a theme to compute the frame geometry: constants,
+ * frame_geometry layouts, frame styles without their pieces and buttons,
+ * style sets and window types. No draw ops are parsed and no images are
+ * loaded, so this is much quicker than meta_theme_load(). The result must
+ * only be used with meta_theme_draw_frame_test().
+ */
+MetaTheme*
+meta_theme_load_geometry (const char  *theme_name,
+                          GError     **err)
+{
+  return find_and_load_theme (theme_name, TRUE, err);
+}
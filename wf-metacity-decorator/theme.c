@@ -65,8 +65,10 @@
 #include "prefs.h"
 #include "theme.h"
 #include "theme-parser.h"
+#include "pixel-ops.h"
 #include "util.h"
 #include "gradient.h"
+#include "trace.h"
 
 #define WITH_GTK 1
 
@@ -83,7 +85,6 @@
 
 #define DEBUG_FILL_STRUCT(s) memset ((s), 0xef, sizeof (*(s)))
 #define CLAMP_UCHAR(v) ((guchar) (CLAMP (((int)v), (int)0, (int)255)))
-#define INTENSITY(r, g, b) ((r) * 0.30 + (g) * 0.59 + (b) * 0.11)
 
 static void gtk_style_shade		(GdkRGBA	 *a,
 					 GdkRGBA	 *b,
@@ -227,48 +228,65 @@ scale_surface (cairo_surface_t *surface,
 }
 
 static cairo_surface_t *
-get_surface_from_pixbuf (GdkPixbuf         *pixbuf,
-                         MetaImageFillType  fill_type,
-                         gdouble            width,
-                         gdouble            height,
-                         gboolean           vertical_stripes,
-                         gboolean           horizontal_stripes)
+surface_from_pixbuf (GdkPixbuf *pixbuf)
 {
-  gdouble pixbuf_width;
-  gdouble pixbuf_height;
   cairo_surface_t *surface;
-  cairo_content_t content;
-  cairo_surface_t *copy;
+#ifndef WITH_GTK
   cairo_t *cr;
-
-  pixbuf_width = gdk_pixbuf_get_width (pixbuf);
-  pixbuf_height = gdk_pixbuf_get_height (pixbuf);
+#endif
 
 #ifdef WITH_GTK
   surface = gdk_cairo_surface_create_from_pixbuf (pixbuf, 1, NULL);
 #else
-  surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, pixbuf_width, pixbuf_height);
-  cr = cairo_create(surface);
-  gdk_cairo_set_source_pixbuf(cr, pixbuf, 0, 0);
-  cairo_paint(cr);
+  surface = cairo_image_surface_create (CAIRO_FORMAT_ARGB32,
+                                        gdk_pixbuf_get_width (pixbuf),
+                                        gdk_pixbuf_get_height (pixbuf));
+  cr = cairo_create (surface);
+  gdk_cairo_set_source_pixbuf (cr, pixbuf, 0, 0);
+  cairo_paint (cr);
   cairo_destroy (cr);
-#endif  
+#endif
+
+  return surface;
+}
+
+/**
+ * Fits a surface to the given size, tiling or stretching it as the fill
+ * type asks. The source surface is left alone.
+ *
+ * 
+eturn A new reference, which may be to the source itself if it
+ *         already has the right size
+ */
+static cairo_surface_t *
+scale_image_surface (cairo_surface_t   *source,
+                     gdouble            source_width,
+                     gdouble            source_height,
+                     MetaImageFillType  fill_type,
+                     gdouble            width,
+                     gdouble            height,
+                     gboolean           vertical_stripes,
+                     gboolean           horizontal_stripes)
+{
+  cairo_surface_t *surface;
+  cairo_content_t content;
+  cairo_surface_t *copy;
+  cairo_t *cr;
 
-  if (pixbuf_width == width && pixbuf_height == height)
+  if (source_width == width && source_height == height)
     {
-      return surface;
+      return cairo_surface_reference (source);
     }
 
   if (fill_type != META_IMAGE_FILL_TILE)
     {
-      cairo_surface_t *scaled;
-
-      scaled = scale_surface (surface, pixbuf_width, pixbuf_height,
-                              width, height, vertical_stripes,
-                              horizontal_stripes);
-
-      cairo_surface_destroy (surface);
-      surface = scaled;
+      surface = scale_surface (source, source_width, source_height,
+                               width, height, vertical_stripes,
+                               horizontal_stripes);
+    }
+  else
+    {
+      surface = cairo_surface_reference (source);
     }
 
   content = CAIRO_CONTENT_COLOR_ALPHA;
@@ -294,19 +312,39 @@ get_surface_from_pixbuf (GdkPixbuf         *pixbuf,
   return copy;
 }
 
+static cairo_surface_t *
+get_surface_from_pixbuf (GdkPixbuf         *pixbuf,
+                         MetaImageFillType  fill_type,
+                         gdouble            width,
+                         gdouble            height,
+                         gboolean           vertical_stripes,
+                         gboolean           horizontal_stripes)
+{
+  cairo_surface_t *surface;
+  cairo_surface_t *scaled;
+
+  surface = surface_from_pixbuf (pixbuf);
+  scaled = scale_image_surface (surface,
+                                gdk_pixbuf_get_width (pixbuf),
+                                gdk_pixbuf_get_height (pixbuf),
+                                fill_type, width, height,
+                                vertical_stripes, horizontal_stripes);
+  cairo_surface_destroy (surface);
+
+  return scaled;
+}
+
 static GdkPixbuf *
 colorize_pixbuf (GdkPixbuf *orig,
                  GdkRGBA   *new_color)
 {
   GdkPixbuf *pixbuf;
-  double intensity;
-  int x, y;
-  const guchar *src;
-  guchar *dest;
+  int y;
   int orig_rowstride;
   int dest_rowstride;
   int width, height;
-  gboolean has_alpha;
+  int n_channels;
+  guint32 rgb;
   const guchar *src_pixels;
   guchar *dest_pixels;
 
@@ -321,55 +359,66 @@ colorize_pixbuf (GdkPixbuf *orig,
   dest_rowstride = gdk_pixbuf_get_rowstride (pixbuf);
   width = gdk_pixbuf_get_width (pixbuf);
   height = gdk_pixbuf_get_height (pixbuf);
-  has_alpha = gdk_pixbuf_get_has_alpha (orig);
-  src_pixels = gdk_pixbuf_get_pixels (orig);
+  n_channels = gdk_pixbuf_get_n_channels (orig);
+  rgb = GDK_COLOR_RGB (*new_color);
+  src_pixels = gdk_pixbuf_read_pixels (orig);
   dest_pixels = gdk_pixbuf_get_pixels (pixbuf);
 
   for (y = 0; y < height; y++)
     {
-      src = src_pixels + y * orig_rowstride;
-      dest = dest_pixels + y * dest_rowstride;
+      meta_pixel_colorize_row (dest_pixels + y * dest_rowstride,
+                               src_pixels + y * orig_rowstride,
+                               width, n_channels, rgb);
+    }
 
-      for (x = 0; x < width; x++)
-        {
-          double dr, dg, db;
+  return pixbuf;
+}
+
+/**
+ * Looks up the op's image colorized with the given colour, colorizing
+ * it and evicting the least recently used copy on a miss.
+ *
+ * \return The pixbuf, owned by the op, or NULL on failure
+ */
+static GdkPixbuf *
+get_colorized_pixbuf (const MetaDrawOp *op,
+                      GdkPixbuf        *source,
+                      GdkRGBA          *color)
+{
+  /* const cast here */
+  MetaColorizeCacheEntry *cache = ((MetaDrawOp*)op)->data.image.colorize_cache;
+  MetaColorizeCacheEntry entry;
+  guint32 pixel;
+  int i;
 
-          intensity = INTENSITY (src[0], src[1], src[2]) / 255.0;
+  pixel = GDK_COLOR_RGB (*color);
 
-          if (intensity <= 0.5)
-            {
-              /* Go from black at intensity = 0.0 to new_color at intensity = 0.5 */
-              dr = new_color->red * intensity * 2.0;
-              dg = new_color->green * intensity * 2.0;
-              db = new_color->blue * intensity * 2.0;
-            }
-          else
-            {
-              /* Go from new_color at intensity = 0.5 to white at intensity = 1.0 */
-              dr = new_color->red + (1.0 - new_color->red) * (intensity - 0.5) * 2.0;
-              dg = new_color->green + (1.0 - new_color->green) * (intensity - 0.5) * 2.0;
-              db = new_color->blue + (1.0 - new_color->blue) * (intensity - 0.5) * 2.0;
-            }
+  for (i = 0; i < META_COLORIZE_CACHE_SIZE && cache[i].pixbuf; i++)
+    {
+      if (cache[i].pixel == pixel)
+        break;
+    }
 
-          dest[0] = CLAMP_UCHAR (255 * dr);
-          dest[1] = CLAMP_UCHAR (255 * dg);
-          dest[2] = CLAMP_UCHAR (255 * db);
+  if (i < META_COLORIZE_CACHE_SIZE && cache[i].pixbuf)
+    {
+      entry = cache[i];
+    }
+  else
+    {
+      entry.pixel = pixel;
+      entry.pixbuf = colorize_pixbuf (source, color);
+      if (entry.pixbuf == NULL)
+        return NULL;
 
-          if (has_alpha)
-            {
-              dest[3] = src[3];
-              src += 4;
-              dest += 4;
-            }
-          else
-            {
-              src += 3;
-              dest += 3;
-            }
-        }
+      i = META_COLORIZE_CACHE_SIZE - 1;
+      if (cache[i].pixbuf)
+        g_object_unref (G_OBJECT (cache[i].pixbuf));
     }
 
-  return pixbuf;
+  memmove (&cache[1], &cache[0], i * sizeof (MetaColorizeCacheEntry));
+  cache[0] = entry;
+
+  return entry.pixbuf;
 }
 
 static void
@@ -1192,68 +1241,50 @@ meta_gradient_spec_new (MetaGradientType type)
   return spec;
 }
 
-static cairo_pattern_t *
-create_cairo_pattern_from_gradient_spec (const MetaGradientSpec      *spec,
-                                         const MetaAlphaGradientSpec *alpha_spec,
-                                         GtkStyleContext             *context)
+/**
+ * Resolves the colours of a gradient, with the alpha of each stop taken
+ * from the alpha gradient if there is one and opaque otherwise.
+ *
+ * \return A newly allocated array of *n_colors colours, or NULL if the
+ *         gradient has none
+ */
+static GdkRGBA *
+get_gradient_colors (const MetaGradientSpec      *spec,
+                     const MetaAlphaGradientSpec *alpha_spec,
+                     GtkStyleContext             *context,
+                     gint                        *n_colors)
 {
-  gint n_colors;
-  cairo_pattern_t *pattern;
+  GdkRGBA *colors;
   GSList *tmp;
   gint i;
 
-  n_colors = g_slist_length (spec->color_specs);
-  if (n_colors == 0)
+  *n_colors = g_slist_length (spec->color_specs);
+  if (*n_colors == 0)
     return NULL;
 
   if (alpha_spec != NULL && alpha_spec->n_alphas != 1)
-    g_assert (n_colors == alpha_spec->n_alphas);
+    g_assert (*n_colors == alpha_spec->n_alphas);
 
-  if (spec->type == META_GRADIENT_HORIZONTAL)
-    pattern = cairo_pattern_create_linear (0, 0, 1, 0);
-  else if (spec->type == META_GRADIENT_VERTICAL)
-    pattern = cairo_pattern_create_linear (0, 0, 0, 1);
-  else if (spec->type == META_GRADIENT_DIAGONAL)
-    pattern = cairo_pattern_create_linear (0, 0, 1, 1);
-  else
-    g_assert_not_reached ();
+  colors = g_new (GdkRGBA, *n_colors);
 
   i = 0;
   tmp = spec->color_specs;
   while (tmp != NULL)
     {
-      GdkRGBA color;
-
-      meta_color_spec_render (tmp->data, context, &color);
+      meta_color_spec_render (tmp->data, context, &colors[i]);
 
-      if (alpha_spec != NULL)
-        {
-          gdouble alpha;
-
-          if (alpha_spec->n_alphas == 1)
-            alpha = alpha_spec->alphas[0] / 255.0;
-          else
-            alpha = alpha_spec->alphas[i] / 255.0;
-
-          cairo_pattern_add_color_stop_rgba (pattern, i / (gfloat) (n_colors - 1),
-                                             color.red, color.green, color.blue,
-                                             alpha);
-        }
+      if (alpha_spec == NULL)
+        colors[i].alpha = 1.0;
+      else if (alpha_spec->n_alphas == 1)
+        colors[i].alpha = alpha_spec->alphas[0] / 255.0;
       else
-        cairo_pattern_add_color_stop_rgb (pattern, i / (gfloat) (n_colors - 1),
-                                          color.red, color.green, color.blue);
+        colors[i].alpha = alpha_spec->alphas[i] / 255.0;
 
       tmp = tmp->next;
       ++i;
     }
 
-  if (cairo_pattern_status (pattern) != CAIRO_STATUS_SUCCESS)
-    {
-      cairo_pattern_destroy (pattern);
-      return NULL;
-    }
-
-  return pattern;
+  return colors;
 }
 
 static void
@@ -1274,20 +1305,106 @@ meta_gradient_spec_free (MetaGradientSpec *spec)
   g_free (spec);
 }
 
+/* Gradients with more colours than this are not cached */
+#define GRADIENT_KEY_MAX_COLORS 8
+
+/* Upper bound on the pixels kept around for rendered gradients */
+#define GRADIENT_SURFACES_MAX_BYTES (8 * 1024 * 1024)
+
+/* What a rendered gradient depends on. Colours are rounded to 8 bits a
+ * channel before rendering, so equal keys always give equal pixels.
+ */
+typedef struct
+{
+  MetaGradientType type;
+  gint width;
+  gint height;
+  gint n_colors;
+  guint32 colors[GRADIENT_KEY_MAX_COLORS];
+} GradientKey;
+
+/**
+ * Draws a gradient spec over the given area.
+ *
+ * Horizontal and vertical gradients are rendered one pixel high or wide
+ * and stretched, so windows of any size share them. If a cache is given,
+ * rendered gradients are kept there and reused for the same colours at
+ * the same size.
+ */
 void
 meta_gradient_spec_render (const MetaGradientSpec      *spec,
                            const MetaAlphaGradientSpec *alpha_spec,
                            cairo_t                     *cr,
                            GtkStyleContext             *context,
+                           MetaSurfaceCache            *cache,
                            gint                         x,
                            gint                         y,
                            gint                         width,
                            gint                         height)
 {
-  cairo_pattern_t *pattern;
+  GdkRGBA *colors;
+  gint n_colors;
+  gdouble device_width, device_height;
+  GradientKey key;
+  cairo_surface_t *surface;
+  gint i;
+
+  if (width <= 0 || height <= 0)
+    return;
+
+  colors = get_gradient_colors (spec, alpha_spec, context, &n_colors);
+  if (colors == NULL)
+    return;
+
+  memset (&key, 0, sizeof (key));
+  key.type = spec->type;
+  key.n_colors = n_colors;
+
+  /* Render at the resolution we are drawing at, not in logical pixels */
+  device_width = width;
+  device_height = height;
+  cairo_user_to_device_distance (cr, &device_width, &device_height);
+  key.width = MAX (1, (gint) ceil (fabs (device_width)));
+  key.height = MAX (1, (gint) ceil (fabs (device_height)));
+
+  if (spec->type == META_GRADIENT_HORIZONTAL)
+    key.height = 1;
+  else if (spec->type == META_GRADIENT_VERTICAL)
+    key.width = 1;
+
+  for (i = 0; i < n_colors; i++)
+    {
+      guchar r, g, b, a;
+
+      r = CLAMP (colors[i].red, 0.0, 1.0) * 255 + 0.5;
+      g = CLAMP (colors[i].green, 0.0, 1.0) * 255 + 0.5;
+      b = CLAMP (colors[i].blue, 0.0, 1.0) * 255 + 0.5;
+      a = CLAMP (colors[i].alpha, 0.0, 1.0) * 255 + 0.5;
 
-  pattern = create_cairo_pattern_from_gradient_spec (spec, alpha_spec, context);
-  if (pattern == NULL)
+      colors[i].red = r / 255.0;
+      colors[i].green = g / 255.0;
+      colors[i].blue = b / 255.0;
+      colors[i].alpha = a / 255.0;
+
+      if (i < GRADIENT_KEY_MAX_COLORS)
+        key.colors[i] = ((guint32) r << 24) | (g << 16) | (b << 8) | a;
+    }
+
+  if (n_colors > GRADIENT_KEY_MAX_COLORS)
+    cache = NULL;
+
+  surface = cache ? meta_surface_cache_lookup (cache, &key) : NULL;
+  if (surface == NULL)
+    {
+      surface = meta_gradient_create_surface (key.width, key.height,
+                                              colors, n_colors, spec->type);
+      if (surface && cache)
+        meta_surface_cache_insert (cache, &key, surface);
+    }
+
+  g_free (colors);
+
+  if (surface == NULL)
     return;
 
   cairo_save (cr);
@@ -1295,11 +1412,13 @@ meta_gradient_spec_render (const MetaGradientSpec      *spec,
   cairo_rectangle (cr, x, y, width, height);
 
   cairo_translate (cr, x, y);
-  cairo_scale (cr, width, height);
+  cairo_scale (cr, width / (gdouble) key.width,
+               height / (gdouble) key.height);
 
-  cairo_set_source (cr, pattern);
+  cairo_set_source_surface (cr, surface, 0, 0);
+  cairo_pattern_set_extend (cairo_get_source (cr), CAIRO_EXTEND_PAD);
   cairo_fill (cr);
-  cairo_pattern_destroy (pattern);
+  cairo_surface_destroy (surface);
 
   cairo_restore (cr);
 }
@@ -1379,6 +1498,65 @@ meta_alpha_gradient_spec_get_mask (const MetaAlphaGradientSpec *spec)
   return pattern;
 }
 
+/* Every live colour spec owns a slot in the palette, which holds its
+ * colour as resolved against the GTK theme. The palette is resolved in
+ * one go, the first time a frame is drawn after the GTK settings change,
+ * so drawing only ever reads it.
+ */
+static GPtrArray *palette_specs = NULL;
+static GArray *palette_free_slots = NULL;
+static GArray *palette_colors = NULL;
+/* generation each slot was last resolved in */
+static GArray *palette_serials = NULL;
+static guint palette_generation = 1;
+static guint palette_resolved_generation = 0;
+/* specs come and go on whatever thread loads a theme */
+G_LOCK_DEFINE_STATIC (palette);
+
+static void
+palette_add_spec (MetaColorSpec *spec)
+{
+  G_LOCK (palette);
+
+  if (palette_specs == NULL)
+    {
+      palette_specs = g_ptr_array_new ();
+      palette_free_slots = g_array_new (FALSE, FALSE, sizeof (int));
+      palette_colors = g_array_new (FALSE, TRUE, sizeof (GdkRGBA));
+      palette_serials = g_array_new (FALSE, TRUE, sizeof (guint));
+    }
+
+  if (palette_free_slots->len > 0)
+    {
+      spec->index = g_array_index (palette_free_slots, int,
+                                   palette_free_slots->len - 1);
+      g_array_set_size (palette_free_slots, palette_free_slots->len - 1);
+      g_ptr_array_index (palette_specs, spec->index) = spec;
+    }
+  else
+    {
+      spec->index = palette_specs->len;
+      g_ptr_array_add (palette_specs, spec);
+      g_array_set_size (palette_colors, palette_specs->len);
+      g_array_set_size (palette_serials, palette_specs->len);
+    }
+
+  g_array_index (palette_serials, guint, spec->index) = 0;
+  /* the new slot is empty, so the palette has to be resolved again */
+  palette_resolved_generation = 0;
+
+  G_UNLOCK (palette);
+}
+
+static void
+palette_remove_spec (MetaColorSpec *spec)
+{
+  G_LOCK (palette);
+  g_ptr_array_index (palette_specs, spec->index) = NULL;
+  g_array_append_val (palette_free_slots, spec->index);
+  G_UNLOCK (palette);
+}
+
 MetaColorSpec*
 meta_color_spec_new (MetaColorSpecType type)
 {
@@ -1414,6 +1592,7 @@ meta_color_spec_new (MetaColorSpecType type)
   spec = g_malloc0 (size);
 
   spec->type = type;
+  palette_add_spec (spec);
 
   return spec;
 }
@@ -1456,6 +1635,7 @@ meta_color_spec_free (MetaColorSpec *spec)
       break;
     }
 
+  palette_remove_spec (spec);
   g_free (spec);
 }
 
@@ -1883,25 +2063,31 @@ meta_set_color_from_style (GdkRGBA               *color,
 }
 
 static void
-meta_set_custom_color_from_style (GdkRGBA         *color,
-                                  GtkStyleContext *context,
-                                  char            *color_name,
-                                  MetaColorSpec   *fallback)
+palette_resolve_spec (MetaColorSpec   *spec,
+                      GtkStyleContext *style);
+
+static const GdkRGBA *
+palette_get (MetaColorSpec   *spec,
+             GtkStyleContext *style)
 {
-  if (!gtk_style_context_lookup_color (context, color_name, color))
-    meta_color_spec_render (fallback, context, color);
+  palette_resolve_spec (spec, style);
+
+  return &g_array_index (palette_colors, GdkRGBA, spec->index);
 }
 
-void
-meta_color_spec_render (MetaColorSpec *spec,
-                        GtkStyleContext *style,
-                        GdkRGBA         *color)
+static void
+palette_resolve_spec (MetaColorSpec   *spec,
+                      GtkStyleContext *style)
 {
-  g_return_if_fail (spec != NULL);
+  GdkRGBA *color;
+  guint *serial;
+
+  serial = &g_array_index (palette_serials, guint, spec->index);
+  if (*serial == palette_generation)
+    return;
+
+  color = &g_array_index (palette_colors, GdkRGBA, spec->index);
 
-#ifdef WITH_GTK
-  g_return_if_fail (GTK_IS_STYLE_CONTEXT (style));
-#endif
   switch (spec->type)
     {
     case META_COLOR_SPEC_BASIC:
@@ -1916,38 +2102,116 @@ meta_color_spec_render (MetaColorSpec *spec,
       break;
 
     case META_COLOR_SPEC_GTK_CUSTOM:
-      meta_set_custom_color_from_style (color,
-                                        style,
-                                        spec->data.gtkcustom.color_name,
-                                        spec->data.gtkcustom.fallback);
+      if (!gtk_style_context_lookup_color (style,
+                                           spec->data.gtkcustom.color_name,
+                                           color))
+        *color = *palette_get (spec->data.gtkcustom.fallback, style);
       break;
 
     case META_COLOR_SPEC_BLEND:
-      {
-        GdkRGBA bg, fg;
+      color_composite (palette_get (spec->data.blend.background, style),
+                       palette_get (spec->data.blend.foreground, style),
+                       spec->data.blend.alpha,
+                       &spec->data.blend.color);
 
-        meta_color_spec_render (spec->data.blend.background, style, &bg);
-        meta_color_spec_render (spec->data.blend.foreground, style, &fg);
+      *color = spec->data.blend.color;
+      break;
 
-        color_composite (&bg, &fg, spec->data.blend.alpha,
-                         &spec->data.blend.color);
+    case META_COLOR_SPEC_SHADE:
+      spec->data.shade.color = *palette_get (spec->data.shade.base, style);
+      gtk_style_shade (&spec->data.shade.color,
+                       &spec->data.shade.color, spec->data.shade.factor);
 
-        *color = spec->data.blend.color;
-      }
+      *color = spec->data.shade.color;
       break;
+    }
 
-    case META_COLOR_SPEC_SHADE:
-      {
-        meta_color_spec_render (spec->data.shade.base, style,
-                                &spec->data.shade.color);
+  *serial = palette_generation;
+}
 
-        gtk_style_shade (&spec->data.shade.color,
-                         &spec->data.shade.color, spec->data.shade.factor);
+static void
+palette_invalidate (GtkSettings *settings,
+                    GParamSpec  *pspec,
+                    gpointer     data)
+{
+  /* no lock, GTK may get here from inside the resolve pass */
+  g_atomic_int_inc (&palette_generation);
+}
 
-        *color = spec->data.shade.color;
-      }
-      break;
+/**
+ * Resolves the colour of every spec that does not have one for the
+ * current GTK settings. Has to run on the main thread; afterwards
+ * meta_color_spec_render() makes no GTK calls until the settings
+ * change again.
+ */
+void
+meta_color_palette_update (GtkStyleContext *style)
+{
+  static gboolean settings_connected = FALSE;
+  guint i, generation;
+
+#ifdef WITH_GTK
+  g_return_if_fail (GTK_IS_STYLE_CONTEXT (style));
+#endif
+
+  G_LOCK (palette);
+
+  if (palette_specs == NULL ||
+      palette_resolved_generation == palette_generation)
+    {
+      G_UNLOCK (palette);
+      return;
+    }
+
+#ifdef WITH_GTK
+  if (!settings_connected)
+    {
+      /* any of the theme, dark variant, font or scale may change colours */
+      g_signal_connect (gtk_settings_get_default (), "notify",
+                        G_CALLBACK (palette_invalidate), NULL);
+      settings_connected = TRUE;
+    }
+#endif
+
+  generation = palette_generation;
+  meta_topic (META_DEBUG_THEMES, "Resolving %u colors, generation %u\n",
+              palette_specs->len, generation);
+
+  /* meta_set_color_from_style() adds the background class */
+  gtk_style_context_save (style);
+  for (i = 0; i < palette_specs->len; i++)
+    {
+      MetaColorSpec *spec = g_ptr_array_index (palette_specs, i);
+
+      if (spec)
+        palette_resolve_spec (spec, style);
+    }
+  gtk_style_context_restore (style);
+
+  palette_resolved_generation = generation;
+
+  G_UNLOCK (palette);
+}
+
+void
+meta_color_spec_render (MetaColorSpec *spec,
+                        GtkStyleContext *style,
+                        GdkRGBA         *color)
+{
+  g_return_if_fail (spec != NULL);
+
+  if (spec->type == META_COLOR_SPEC_BASIC)
+    {
+      *color = spec->data.basic.color;
+      return;
     }
+
+  /* only does anything if nobody updated the palette before drawing */
+  meta_color_palette_update (style);
+
+  G_LOCK (palette);
+  *color = g_array_index (palette_colors, GdkRGBA, spec->index);
+  G_UNLOCK (palette);
 }
 
 /**
@@ -2930,41 +3194,389 @@ pos_eval_helper (PosToken                   *tokens,
   return TRUE;
 }
 
-/*
- *   expr = int | double | expr * expr | expr / expr |
- *          expr + expr | expr - expr | (expr)
- *
- *   so very not worth fooling with bison, yet so very painful by hand.
- */
 /**
- * Evaluates an expression.
- *
- * \param spec  The expression to evaluate.
- * \param env   The environment context to evaluate the expression in.
- * \param[out] val_p  The integer value of the expression; if the expression
- *                    is of type float, this will be rounded. If we return
- *                    FALSE because the expression is invalid, this will be
- *                    zero.
- * \param[out] err    The error, if anything went wrong.
- *
- * \return  True if we evaluated the expression successfully; false otherwise.
+ * A node of a compiled expression. Nodes are shared by all the specs of a
+ * theme: an expression or subexpression written in several specs, as
+ * "width - 1" or "(width - title_width) / 2" often are, is a single node,
+ * so it is evaluated once for all the ops drawn in the same env.
  *
- * \bug Shouldn't spec be const?
  * \ingroup parser
  */
-static gboolean
-pos_eval (MetaDrawSpec              *spec,
-          const MetaPositionExprEnv *env,
-          int                       *val_p,
-          GError                   **err)
+typedef struct
 {
-  PosExpr expr;
-
-  *val_p = 0;
-
-  if (pos_eval_helper (spec->tokens, spec->n_tokens, env, &expr, err))
-    {
-      switch (expr.type)
+  PosExprType type;
+  union
+  {
+    double double_val;
+    int int_val;
+    struct {
+      PosOperatorType op;
+      int a, b;
+    } operator;
+    GQuark variable;
+  } d;
+  /** Is VARIABLE rather than a constant, when type is POS_EXPR_INT */
+  gboolean is_variable : 1;
+  /**
+   * Depends on object_width or object_height, which change from op to
+   * op within an env, so the value is never kept
+   */
+  gboolean per_object : 1;
+} MetaSpecNode;
+
+/** Node values of the env being drawn; a value is valid where its stamp
+ * is the one of the env, see fill_env()
+ */
+struct _MetaSpecScratch
+{
+  PosExpr *values;
+  guint *stamps;
+  guint stamp;
+  int n_nodes;
+};
+
+#define SPEC_NODE(theme, i) (&g_array_index ((theme)->spec_nodes, MetaSpecNode, (i)))
+
+static int
+intern_spec_node (MetaTheme          *theme,
+                  const MetaSpecNode *node)
+{
+  char *key;
+  gpointer index;
+
+  switch (node->type)
+    {
+    case POS_EXPR_INT:
+      if (node->is_variable)
+        key = g_strdup_printf ("v%u", node->d.variable);
+      else
+        key = g_strdup_printf ("i%d", node->d.int_val);
+      break;
+    case POS_EXPR_DOUBLE:
+      key = g_strdup_printf ("d%a", node->d.double_val);
+      break;
+    case POS_EXPR_OPERATOR:
+    default:
+      key = g_strdup_printf ("o%d,%d,%d", node->d.operator.op,
+                             node->d.operator.a, node->d.operator.b);
+      break;
+    }
+
+  if (theme->spec_nodes == NULL)
+    {
+      theme->spec_nodes = g_array_new (FALSE, FALSE, sizeof (MetaSpecNode));
+      theme->spec_node_ids = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                    g_free, NULL);
+    }
+
+  /* ids are stored plus one, NULL is not found */
+  index = g_hash_table_lookup (theme->spec_node_ids, key);
+  if (index)
+    {
+      g_free (key);
+      return GPOINTER_TO_INT (index) - 1;
+    }
+
+  g_array_append_val (theme->spec_nodes, *node);
+  g_hash_table_insert (theme->spec_node_ids, key,
+                       GINT_TO_POINTER (theme->spec_nodes->len));
+  return theme->spec_nodes->len - 1;
+}
+
+static int
+intern_spec_constant (MetaTheme     *theme,
+                      const PosExpr *value)
+{
+  MetaSpecNode node = { 0 };
+
+  node.type = value->type;
+  if (value->type == POS_EXPR_DOUBLE)
+    node.d.double_val = value->d.double_val;
+  else
+    node.d.int_val = value->d.int_val;
+
+  return intern_spec_node (theme, &node);
+}
+
+/**
+ * The node for "a op b"; folded into a constant if both are constants,
+ * unless that fails, then the error is left for drawing to report.
+ */
+static int
+intern_spec_operation (MetaTheme       *theme,
+                       int              a,
+                       PosOperatorType  op,
+                       int              b)
+{
+  MetaSpecNode *na = SPEC_NODE (theme, a);
+  MetaSpecNode *nb = SPEC_NODE (theme, b);
+  MetaSpecNode node = { 0 };
+
+  if (na->type != POS_EXPR_OPERATOR && !na->is_variable &&
+      nb->type != POS_EXPR_OPERATOR && !nb->is_variable)
+    {
+      PosExpr ea, eb;
+
+      ea.type = na->type;
+      eb.type = nb->type;
+      if (na->type == POS_EXPR_DOUBLE)
+        ea.d.double_val = na->d.double_val;
+      else
+        ea.d.int_val = na->d.int_val;
+      if (nb->type == POS_EXPR_DOUBLE)
+        eb.d.double_val = nb->d.double_val;
+      else
+        eb.d.int_val = nb->d.int_val;
+
+      if (do_operation (&ea, &eb, op, NULL))
+        return intern_spec_constant (theme, &ea);
+    }
+
+  node.type = POS_EXPR_OPERATOR;
+  node.d.operator.op = op;
+  node.d.operator.a = a;
+  node.d.operator.b = b;
+  node.per_object = na->per_object || nb->per_object;
+
+  return intern_spec_node (theme, &node);
+}
+
+/**
+ * Compiles tokens into nodes, following the precedence pos_eval_helper()
+ * gives operators, so that both evaluate to the same.
+ *
+ * \return The root node, or -1 if the expression is malformed, in which
+ *         case pos_eval_helper() gets to report it
+ * \ingroup parser
+ */
+static int
+compile_spec_tokens (MetaTheme *theme,
+                     PosToken  *tokens,
+                     int        n_tokens)
+{
+  /* an operand is a node, an operator is -1 - its PosOperatorType */
+  int items[MAX_EXPRS];
+  int n_items;
+  int paren_level;
+  int first_paren;
+  int precedence;
+  int i;
+
+  n_items = 0;
+  paren_level = 0;
+  first_paren = 0;
+  for (i = 0; i < n_tokens; i++)
+    {
+      PosToken *t = &tokens[i];
+      MetaSpecNode node = { 0 };
+      PosExpr value;
+
+      if (n_items >= MAX_EXPRS)
+        return -1;
+
+      if (paren_level > 0)
+        {
+          if (t->type == POS_TOKEN_OPEN_PAREN)
+            ++paren_level;
+          else if (t->type == POS_TOKEN_CLOSE_PAREN && --paren_level == 0)
+            {
+              items[n_items] = compile_spec_tokens (theme, &tokens[first_paren + 1],
+                                                    i - first_paren - 1);
+              if (items[n_items] < 0)
+                return -1;
+              ++n_items;
+            }
+          continue;
+        }
+
+      switch (t->type)
+        {
+        case POS_TOKEN_INT:
+          value.type = POS_EXPR_INT;
+          value.d.int_val = t->d.i.val;
+          items[n_items++] = intern_spec_constant (theme, &value);
+          break;
+
+        case POS_TOKEN_DOUBLE:
+          value.type = POS_EXPR_DOUBLE;
+          value.d.double_val = t->d.d.val;
+          items[n_items++] = intern_spec_constant (theme, &value);
+          break;
+
+        case POS_TOKEN_VARIABLE:
+          node.type = POS_EXPR_INT;
+          node.is_variable = TRUE;
+          node.d.variable = t->d.v.name_quark;
+          node.per_object = node.d.variable == theme->quark_object_width ||
+                            node.d.variable == theme->quark_object_height;
+          items[n_items++] = intern_spec_node (theme, &node);
+          break;
+
+        case POS_TOKEN_OPERATOR:
+          items[n_items++] = -1 - (int) t->d.o.op;
+          break;
+
+        case POS_TOKEN_OPEN_PAREN:
+          paren_level = 1;
+          first_paren = i;
+          break;
+
+        case POS_TOKEN_CLOSE_PAREN:
+          return -1;
+        }
+    }
+
+  if (paren_level > 0 || n_items == 0 || n_items % 2 == 0)
+    return -1;
+
+  /* operands and operators must alternate */
+  for (i = 0; i < n_items; i++)
+    if ((items[i] < 0) != (i % 2 == 1))
+      return -1;
+
+  /* the same passes as do_operations () */
+  for (precedence = 2; precedence >= 0; precedence--)
+    {
+      i = 1;
+      while (i < n_items)
+        {
+          PosOperatorType op = -1 - items[i];
+          gboolean compress;
+
+          switch (op)
+            {
+            case POS_OP_DIVIDE:
+            case POS_OP_MOD:
+            case POS_OP_MULTIPLY:
+              compress = precedence == 2;
+              break;
+            case POS_OP_ADD:
+            case POS_OP_SUBTRACT:
+              compress = precedence == 1;
+              break;
+            case POS_OP_MAX:
+            case POS_OP_MIN:
+              compress = precedence == 0;
+              break;
+            default:
+              return -1;
+            }
+
+          if (compress)
+            {
+              items[i - 1] = intern_spec_operation (theme, items[i - 1], op,
+                                                    items[i + 1]);
+              memmove (&items[i], &items[i + 2],
+                       sizeof (int) * (n_items - i - 2));
+              n_items -= 2;
+            }
+          else
+            i += 2;
+        }
+    }
+
+  g_assert (n_items == 1);
+
+  return items[0];
+}
+
+static gboolean
+spec_node_eval (MetaTheme                 *theme,
+                int                        index,
+                const MetaPositionExprEnv *env,
+                PosExpr                   *result,
+                GError                   **err)
+{
+  const MetaSpecNode *node = SPEC_NODE (theme, index);
+  MetaSpecScratch *scratch = theme->spec_scratch;
+  PosExpr b;
+
+  if (node->type != POS_EXPR_OPERATOR)
+    {
+      result->type = node->type;
+      if (node->is_variable)
+        {
+          PosToken t;
+
+          t.type = POS_TOKEN_VARIABLE;
+          t.d.v.name = (char *) g_quark_to_string (node->d.variable);
+          t.d.v.name_quark = node->d.variable;
+          return pos_eval_get_variable (&t, &result->d.int_val, env, err);
+        }
+      else if (node->type == POS_EXPR_DOUBLE)
+        result->d.double_val = node->d.double_val;
+      else
+        result->d.int_val = node->d.int_val;
+      return TRUE;
+    }
+
+  if (!node->per_object && scratch->stamps[index] == env->spec_stamp)
+    {
+      *result = scratch->values[index];
+      return TRUE;
+    }
+
+  if (!spec_node_eval (theme, node->d.operator.a, env, result, err) ||
+      !spec_node_eval (theme, node->d.operator.b, env, &b, err) ||
+      !do_operation (result, &b, node->d.operator.op, err))
+    return FALSE;
+
+  if (!node->per_object)
+    {
+      scratch->values[index] = *result;
+      scratch->stamps[index] = env->spec_stamp;
+    }
+
+  return TRUE;
+}
+
+/*
+ *   expr = int | double | expr * expr | expr / expr |
+ *          expr + expr | expr - expr | (expr)
+ *
+ *   so very not worth fooling with bison, yet so very painful by hand.
+ */
+/**
+ * Evaluates an expression.
+ *
+ * \param spec  The expression to evaluate.
+ * \param env   The environment context to evaluate the expression in.
+ * \param[out] val_p  The integer value of the expression; if the expression
+ *                    is of type float, this will be rounded. If we return
+ *                    FALSE because the expression is invalid, this will be
+ *                    zero.
+ * \param[out] err    The error, if anything went wrong.
+ *
+ * \return  True if we evaluated the expression successfully; false otherwise.
+ *
+ * \bug Shouldn't spec be const?
+ * \ingroup parser
+ */
+static gboolean
+pos_eval (MetaDrawSpec              *spec,
+          const MetaPositionExprEnv *env,
+          int                       *val_p,
+          GError                   **err)
+{
+  PosExpr expr;
+
+  gboolean ok;
+
+  *val_p = 0;
+
+  if (spec->node >= 0 && env != NULL && env->theme == spec->theme &&
+      env->theme->spec_scratch != NULL &&
+      spec_node_eval (env->theme, spec->node, env, &expr, NULL))
+    ok = TRUE;
+  else
+    /* the tokens also tell what is wrong with a compiled spec, the
+     * nodes may find another error first
+     */
+    ok = pos_eval_helper (spec->tokens, spec->n_tokens, env, &expr, err);
+
+  if (ok)
+    {
+      switch (expr.type)
         {
         case POS_EXPR_INT:
           *val_p = expr.d.int_val;
@@ -3183,6 +3795,14 @@ meta_draw_spec_new (MetaTheme  *theme,
 
   spec->constant = meta_theme_replace_constants (theme, spec->tokens,
                                                  spec->n_tokens, NULL);
+  spec->node = -1;
+  /* specs made once the theme is drawn have no scratch values */
+  if (!spec->constant && theme != NULL && theme->spec_scratch == NULL)
+    {
+      spec->node = compile_spec_tokens (theme, spec->tokens, spec->n_tokens);
+      spec->theme = theme;
+    }
+
   if (spec->constant)
     {
       gboolean result;
@@ -3274,6 +3894,8 @@ meta_draw_op_new (MetaDrawType type)
 void
 meta_draw_op_free (MetaDrawOp *op)
 {
+  int i;
+
   g_return_if_fail (op != NULL);
 
   switch (op->type)
@@ -3345,14 +3967,17 @@ meta_draw_op_free (MetaDrawOp *op)
       if (op->data.image.alpha_spec)
         meta_alpha_gradient_spec_free (op->data.image.alpha_spec);
 
-      if (op->data.image.pixbuf)
-        g_object_unref (G_OBJECT (op->data.image.pixbuf));
+      if (op->data.image.image)
+        meta_theme_image_unref (op->data.image.image);
 
       if (op->data.image.colorize_spec)
 	meta_color_spec_free (op->data.image.colorize_spec);
 
-      if (op->data.image.colorize_cache_pixbuf)
-        g_object_unref (G_OBJECT (op->data.image.colorize_cache_pixbuf));
+      for (i = 0; i < META_COLORIZE_CACHE_SIZE; i++)
+        {
+          if (op->data.image.colorize_cache[i].pixbuf)
+            g_object_unref (G_OBJECT (op->data.image.colorize_cache[i].pixbuf));
+        }
 
       meta_draw_spec_free (op->data.image.x);
       meta_draw_spec_free (op->data.image.y);
@@ -3428,434 +4053,273 @@ meta_draw_op_free (MetaDrawOp *op)
   g_free (op);
 }
 
-static GdkPixbuf*
-apply_alpha (GdkPixbuf             *pixbuf,
-             MetaAlphaGradientSpec *spec,
-             gboolean               force_copy)
+/**
+ * \return A new ARGB32 image surface with the same pixels
+ */
+static cairo_surface_t *
+copy_surface (cairo_surface_t *surface)
 {
-  GdkPixbuf *new_pixbuf;
-  gboolean needs_alpha;
+  cairo_surface_t *copy;
+  cairo_t *cr;
 
-  g_return_val_if_fail (GDK_IS_PIXBUF (pixbuf), NULL);
+  copy = cairo_image_surface_create (CAIRO_FORMAT_ARGB32,
+                                     cairo_image_surface_get_width (surface),
+                                     cairo_image_surface_get_height (surface));
+  cr = cairo_create (copy);
+  cairo_set_operator (cr, CAIRO_OPERATOR_SOURCE);
+  cairo_set_source_surface (cr, surface, 0, 0);
+  cairo_paint (cr);
+  cairo_destroy (cr);
 
-  needs_alpha = spec && (spec->n_alphas > 1 ||
-                         spec->alphas[0] != 0xff);
+  return copy;
+}
 
-  if (!needs_alpha)
-    return pixbuf;
+/* Applies a horizontal alpha gradient to an ARGB32 image surface */
+static void
+multiply_surface_alpha (cairo_surface_t             *surface,
+                        const MetaAlphaGradientSpec *spec)
+{
+  guchar *pixels;
+  guchar *alphas;
+  int width, height, stride;
+  int y;
 
-  if (!gdk_pixbuf_get_has_alpha (pixbuf))
-    {
-      new_pixbuf = gdk_pixbuf_add_alpha (pixbuf, FALSE, 0, 0, 0);
-      g_object_unref (G_OBJECT (pixbuf));
-      pixbuf = new_pixbuf;
-    }
-  else if (force_copy)
-    {
-      new_pixbuf = gdk_pixbuf_copy (pixbuf);
-      g_object_unref (G_OBJECT (pixbuf));
-      pixbuf = new_pixbuf;
-    }
+  /* Hardcoded in theme-parser.c */
+  g_assert (spec->type == META_GRADIENT_HORIZONTAL);
 
-  g_assert (gdk_pixbuf_get_has_alpha (pixbuf));
+  cairo_surface_flush (surface);
+  pixels = cairo_image_surface_get_data (surface);
+  width = cairo_image_surface_get_width (surface);
+  height = cairo_image_surface_get_height (surface);
+  stride = cairo_image_surface_get_stride (surface);
 
-  meta_gradient_add_alpha (pixbuf, spec->alphas, spec->n_alphas, spec->type);
+  if (pixels == NULL || width == 0)
+    return;
 
-  return pixbuf;
+  alphas = g_new (guchar, width);
+  meta_gradient_render_alpha_row (alphas, width, spec->alphas, spec->n_alphas);
+
+  for (y = 0; y < height; y++)
+    meta_pixel_scale_row ((guint32 *) (pixels + y * stride), width, alphas, 0);
+
+  g_free (alphas);
+  cairo_surface_mark_dirty (surface);
 }
 
-static GdkPixbuf*
-pixbuf_tile (GdkPixbuf *tile,
-             int        width,
-             int        height)
+/**
+ * Renders one row of a tint, the colour with the alpha gradient already
+ * applied, ready to be repeated down the area it covers.
+ *
+ * \return A new ARGB32 image surface, width pixels wide and one high
+ */
+static cairo_surface_t *
+create_tint_row (const GdkRGBA               *color,
+                 const MetaAlphaGradientSpec *spec,
+                 int                          width)
 {
-  GdkPixbuf *pixbuf;
-  int tile_width;
-  int tile_height;
-  int i, j;
-
-  tile_width = gdk_pixbuf_get_width (tile);
-  tile_height = gdk_pixbuf_get_height (tile);
+  cairo_surface_t *surface;
+  guint32 pixel;
 
-  pixbuf = gdk_pixbuf_new (GDK_COLORSPACE_RGB,
-                           gdk_pixbuf_get_has_alpha (tile),
-                           8, width, height);
+  surface = cairo_image_surface_create (CAIRO_FORMAT_ARGB32, width, 1);
+  cairo_surface_flush (surface);
 
-  i = 0;
-  while (i < width)
-    {
-      j = 0;
-      while (j < height)
-        {
-          int w, h;
+  pixel = 0xff000000 | (GDK_COLOR_RGB (*color) & 0xffffff);
+  meta_pixel_fill_row ((guint32 *) cairo_image_surface_get_data (surface),
+                       width, pixel);
+  cairo_surface_mark_dirty (surface);
 
-          w = MIN (tile_width, width - i);
-          h = MIN (tile_height, height - j);
+  multiply_surface_alpha (surface, spec);
 
-          gdk_pixbuf_copy_area (tile,
-                                0, 0,
-                                w, h,
-                                pixbuf,
-                                i, j);
+  return surface;
+}
 
-          j += tile_height;
-        }
+/* Upper bound on the pixels kept around for scaled and colorized images */
+#define IMAGE_VARIANTS_MAX_BYTES (16 * 1024 * 1024)
 
-      i += tile_width;
-    }
+/* Everything an image draw op's output depends on, besides the image.
+ * Keys are compared bytewise, so they must be zeroed before use.
+ */
+typedef struct
+{
+  MetaThemeImage *image;
+  const MetaAlphaGradientSpec *alpha_spec;
+  gdouble width;
+  gdouble height;
+  guint32 colorize_pixel;
+  gboolean colorize;
+  MetaImageFillType fill_type;
+} ImageVariantKey;
 
-  return pixbuf;
-}
+/**
+ * Renders an image op at the given size, colorized and with its alpha
+ * gradient applied, reusing an earlier rendering when the theme has one.
+ * With cached_only nothing is rendered, only an earlier rendering returned.
+ *
+ * \return A new reference to the surface, or NULL if there is no image
+ */
+static cairo_surface_t *
+get_image_variant (MetaTheme          *theme,
+                   const MetaDrawOp   *op,
+                   GtkStyleContext    *style,
+                   gdouble             width,
+                   gdouble             height,
+                   gboolean            cached_only)
+{
+  MetaThemeImage *image = op->data.image.image;
+  ImageVariantKey key;
+  MetaAlphaGradientSpec *alpha_spec;
+  GdkPixbuf *source;
+  cairo_surface_t *base;
+  cairo_surface_t *surface;
+  GdkRGBA color;
 
-static GdkPixbuf *
-replicate_rows (GdkPixbuf  *src,
-                int         src_x,
-                int         src_y,
-                int         width,
-                int         height)
-{
-  unsigned int n_channels = gdk_pixbuf_get_n_channels (src);
-  unsigned int src_rowstride = gdk_pixbuf_get_rowstride (src);
-  unsigned char *pixels = (gdk_pixbuf_get_pixels (src) + src_y * src_rowstride + src_x
-                           * n_channels);
-  unsigned char *dest_pixels;
-  GdkPixbuf *result;
-  unsigned int dest_rowstride;
-  int i;
+  source = meta_theme_image_get_pixbuf (image);
+  if (source == NULL)
+    return NULL;
 
-  result = gdk_pixbuf_new (GDK_COLORSPACE_RGB, n_channels == 4, 8,
-                           width, height);
-  dest_rowstride = gdk_pixbuf_get_rowstride (result);
-  dest_pixels = gdk_pixbuf_get_pixels (result);
+  /* A single opaque alpha changes nothing, the op shares the variant of
+   * the same image without one
+   */
+  alpha_spec = op->data.image.alpha_spec;
+  if (alpha_spec && alpha_spec->n_alphas == 1 && alpha_spec->alphas[0] == 0xff)
+    alpha_spec = NULL;
 
-  for (i = 0; i < height; i++)
-    memcpy (dest_pixels + dest_rowstride * i, pixels, n_channels * width);
+  memset (&key, 0, sizeof (key));
+  key.image = image;
+  key.alpha_spec = alpha_spec;
+  key.width = width;
+  key.height = height;
+  key.fill_type = op->data.image.fill_type;
 
-  return result;
-}
+  if (op->data.image.colorize_spec)
+    {
+      meta_color_spec_render (op->data.image.colorize_spec, style, &color);
+      key.colorize = TRUE;
+      key.colorize_pixel = GDK_COLOR_RGB (color);
+    }
 
-static GdkPixbuf *
-replicate_cols (GdkPixbuf  *src,
-                int         src_x,
-                int         src_y,
-                int         width,
-                int         height)
-{
-  unsigned int n_channels = gdk_pixbuf_get_n_channels (src);
-  unsigned int src_rowstride = gdk_pixbuf_get_rowstride (src);
-  unsigned char *pixels = (gdk_pixbuf_get_pixels (src) + src_y * src_rowstride + src_x
-                           * n_channels);
-  unsigned char *dest_pixels;
-  GdkPixbuf *result;
-  unsigned int dest_rowstride;
-  int i, j;
+  if (theme && theme->image_variants)
+    {
+      surface = meta_surface_cache_lookup (theme->image_variants, &key);
+      if (surface)
+        return surface;
+    }
 
-  result = gdk_pixbuf_new (GDK_COLORSPACE_RGB, n_channels == 4, 8,
-                           width, height);
-  dest_rowstride = gdk_pixbuf_get_rowstride (result);
-  dest_pixels = gdk_pixbuf_get_pixels (result);
+  if (cached_only)
+    return NULL;
 
-  for (i = 0; i < height; i++)
+  if (key.colorize)
     {
-      unsigned char *p = dest_pixels + dest_rowstride * i;
-      unsigned char *q = pixels + src_rowstride * i;
+      GdkPixbuf *colorized;
 
-      unsigned char r = *(q++);
-      unsigned char g = *(q++);
-      unsigned char b = *(q++);
+      colorized = get_colorized_pixbuf (op, source, &color);
+      if (colorized == NULL)
+        return NULL;
 
-      if (n_channels == 4)
-        {
-          unsigned char a;
-
-          a = *(q++);
-
-          for (j = 0; j < width; j++)
-            {
-              *(p++) = r;
-              *(p++) = g;
-              *(p++) = b;
-              *(p++) = a;
-            }
-        }
-      else
-        {
-          for (j = 0; j < width; j++)
-            {
-              *(p++) = r;
-              *(p++) = g;
-              *(p++) = b;
-            }
-        }
-    }
-
-  return result;
-}
-
-static GdkPixbuf*
-scale_and_alpha_pixbuf (GdkPixbuf             *src,
-                        MetaAlphaGradientSpec *alpha_spec,
-                        MetaImageFillType      fill_type,
-                        int                    width,
-                        int                    height,
-                        gboolean               vertical_stripes,
-                        gboolean               horizontal_stripes)
-{
-  GdkPixbuf *pixbuf;
-  GdkPixbuf *temp_pixbuf;
-
-  pixbuf = NULL;
-
-  pixbuf = src;
-
-  if (gdk_pixbuf_get_width (pixbuf) == width &&
-      gdk_pixbuf_get_height (pixbuf) == height)
-    {
-      g_object_ref (G_OBJECT (pixbuf));
+      base = surface_from_pixbuf (colorized);
     }
   else
     {
-      if (fill_type == META_IMAGE_FILL_TILE)
-        {
-          pixbuf = pixbuf_tile (pixbuf, width, height);
-        }
-      else
-        {
-    	  int src_h, src_w, dest_h, dest_w;
-          src_h = gdk_pixbuf_get_height (src);
-          src_w = gdk_pixbuf_get_width (src);
+      base = cairo_surface_reference (meta_theme_image_get_surface (image));
+    }
 
-          /* prefer to replicate_cols if possible, as that
-           * is faster (no memory reads)
-           */
-          if (horizontal_stripes)
-            {
-              dest_w = gdk_pixbuf_get_width (src);
-              dest_h = height;
-            }
-          else if (vertical_stripes)
-            {
-              dest_w = width;
-              dest_h = gdk_pixbuf_get_height (src);
-            }
+  surface = scale_image_surface (base,
+                                 gdk_pixbuf_get_width (source),
+                                 gdk_pixbuf_get_height (source),
+                                 op->data.image.fill_type,
+                                 width, height,
+                                 image->vertical_stripes,
+                                 image->horizontal_stripes);
+  cairo_surface_destroy (base);
 
-          else
-            {
-              dest_w = width;
-              dest_h = height;
-            }
+  if (alpha_spec)
+    {
+      cairo_surface_t *masked;
 
-          if (dest_w == src_w && dest_h == src_h)
-            {
-              temp_pixbuf = src;
-              g_object_ref (G_OBJECT (temp_pixbuf));
-            }
-          else
-            {
-              temp_pixbuf = gdk_pixbuf_scale_simple (src,
-                                                     dest_w, dest_h,
-                                                     GDK_INTERP_BILINEAR);
-            }
+      masked = copy_surface (surface);
+      cairo_surface_destroy (surface);
+      surface = masked;
 
-          /* prefer to replicate_cols if possible, as that
-           * is faster (no memory reads)
-           */
-          if (horizontal_stripes)
-            {
-              pixbuf = replicate_cols (temp_pixbuf, 0, 0, width, height);
-              g_object_unref (G_OBJECT (temp_pixbuf));
-            }
-          else if (vertical_stripes)
-            {
-              pixbuf = replicate_rows (temp_pixbuf, 0, 0, width, height);
-              g_object_unref (G_OBJECT (temp_pixbuf));
-            }
-          else
-            {
-              pixbuf = temp_pixbuf;
-            }
-        }
+      multiply_surface_alpha (surface, alpha_spec);
     }
 
-  if (pixbuf)
-    pixbuf = apply_alpha (pixbuf, alpha_spec, pixbuf == src);
+  if (theme && theme->image_variants)
+    meta_surface_cache_insert (theme->image_variants, &key, surface);
 
-  return pixbuf;
+  return surface;
 }
 
-static GdkPixbuf*
-draw_op_as_pixbuf (const MetaDrawOp    *op,
-                   GtkStyleContext     *style,
-                   const MetaDrawInfo  *info,
-                   int                  width,
-                   int                  height)
-{
-  /* Try to get the op as a pixbuf, assuming w/h in the op
-   * matches the width/height passed in. return NULL
-   * if the op can't be converted to an equivalent pixbuf.
-   */
-  GdkPixbuf *pixbuf;
+/**
+ * The draft of an image op, for frames drawn during an interactive resize:
+ * the image, colorized if the op asks, is stretched by cairo with the fast
+ * filter and nothing is kept. The alpha gradient is left out, a new size
+ * every frame would only flush the variants worth caching.
+ */
+static void
+draw_image_draft (const MetaDrawOp *op,
+                  GtkStyleContext  *style,
+                  cairo_t          *cr,
+                  gdouble           x,
+                  gdouble           y,
+                  gdouble           width,
+                  gdouble           height)
+{
+  MetaThemeImage *image = op->data.image.image;
+  GdkPixbuf *source;
+  cairo_surface_t *surface;
+  cairo_pattern_t *pattern;
+  cairo_matrix_t matrix;
+  GdkRGBA color;
 
-  pixbuf = NULL;
+  source = meta_theme_image_get_pixbuf (image);
+  if (source == NULL || width <= 0 || height <= 0)
+    return;
 
-  switch (op->type)
+  if (op->data.image.colorize_spec)
     {
-    case META_DRAW_LINE:
-      break;
-
-    case META_DRAW_RECTANGLE:
-      if (op->data.rectangle.filled)
-        {
-          GdkRGBA color;
-
-          meta_color_spec_render (op->data.rectangle.color_spec,
-                                  style,
-                                  &color);
-
-          pixbuf = gdk_pixbuf_new (GDK_COLORSPACE_RGB,
-                                   FALSE,
-                                   8, width, height);
-
-          gdk_pixbuf_fill (pixbuf, GDK_COLOR_RGBA (color));
-        }
-      break;
-
-    case META_DRAW_ARC:
-      break;
-
-    case META_DRAW_CLIP:
-      break;
-
-    case META_DRAW_TINT:
-      {
-        GdkRGBA color;
-        guint32 rgba;
-        gboolean has_alpha;
-
-        meta_color_spec_render (op->data.rectangle.color_spec,
-                                style,
-                                &color);
-
-        has_alpha =
-          op->data.tint.alpha_spec &&
-          (op->data.tint.alpha_spec->n_alphas > 1 ||
-           op->data.tint.alpha_spec->alphas[0] != 0xff);
-
-        pixbuf = gdk_pixbuf_new (GDK_COLORSPACE_RGB,
-                                 has_alpha,
-                                 8, width, height);
-
-        if (!has_alpha)
-          {
-            rgba = GDK_COLOR_RGBA (color);
-
-            gdk_pixbuf_fill (pixbuf, rgba);
-          }
-        else if (op->data.tint.alpha_spec->n_alphas == 1)
-          {
-            rgba = GDK_COLOR_RGBA (color);
-            rgba &= ~0xff;
-            rgba |= op->data.tint.alpha_spec->alphas[0];
+      GdkPixbuf *colorized;
 
-            gdk_pixbuf_fill (pixbuf, rgba);
-          }
-        else
-          {
-            rgba = GDK_COLOR_RGBA (color);
-
-            gdk_pixbuf_fill (pixbuf, rgba);
-
-            meta_gradient_add_alpha (pixbuf,
-                                     op->data.tint.alpha_spec->alphas,
-                                     op->data.tint.alpha_spec->n_alphas,
-                                     op->data.tint.alpha_spec->type);
-          }
-      }
-      break;
-
-    case META_DRAW_IMAGE:
-      {
-	if (op->data.image.colorize_spec)
-	  {
-	    GdkRGBA color;
-
-            meta_color_spec_render (op->data.image.colorize_spec,
-                                    style, &color);
-
-            if (op->data.image.colorize_cache_pixbuf == NULL ||
-                op->data.image.colorize_cache_pixel != GDK_COLOR_RGB (color))
-              {
-                if (op->data.image.colorize_cache_pixbuf)
-                  g_object_unref (G_OBJECT (op->data.image.colorize_cache_pixbuf));
-
-                /* const cast here */
-                ((MetaDrawOp*)op)->data.image.colorize_cache_pixbuf =
-                  colorize_pixbuf (op->data.image.pixbuf,
-                                   &color);
-                ((MetaDrawOp*)op)->data.image.colorize_cache_pixel =
-                  GDK_COLOR_RGB (color);
-              }
-
-            if (op->data.image.colorize_cache_pixbuf)
-              {
-                pixbuf = scale_and_alpha_pixbuf (op->data.image.colorize_cache_pixbuf,
-                                                 op->data.image.alpha_spec,
-                                                 op->data.image.fill_type,
-                                                 width, height,
-                                                 op->data.image.vertical_stripes,
-                                                 op->data.image.horizontal_stripes);
-              }
-	  }
-	else
-	  {
-	    pixbuf = scale_and_alpha_pixbuf (op->data.image.pixbuf,
-                                             op->data.image.alpha_spec,
-                                             op->data.image.fill_type,
-                                             width, height,
-                                             op->data.image.vertical_stripes,
-                                             op->data.image.horizontal_stripes);
-	  }
-        break;
-      }
-
-    case META_DRAW_GRADIENT:
-    case META_DRAW_GTK_ARROW:
-    case META_DRAW_GTK_BOX:
-    case META_DRAW_GTK_VLINE:
-      break;
-
-    case META_DRAW_ICON:
-      if (info->mini_icon &&
-          width <= gdk_pixbuf_get_width (info->mini_icon) &&
-          height <= gdk_pixbuf_get_height (info->mini_icon))
-        pixbuf = scale_and_alpha_pixbuf (info->mini_icon,
-                                         op->data.icon.alpha_spec,
-                                         op->data.icon.fill_type,
-                                         width, height,
-                                         FALSE, FALSE);
-      else if (info->icon)
-        pixbuf = scale_and_alpha_pixbuf (info->icon,
-                                         op->data.icon.alpha_spec,
-                                         op->data.icon.fill_type,
-                                         width, height,
-                                         FALSE, FALSE);
-      break;
+      meta_color_spec_render (op->data.image.colorize_spec, style, &color);
+      colorized = get_colorized_pixbuf (op, source, &color);
+      if (colorized == NULL)
+        return;
 
-    case META_DRAW_TITLE:
-      break;
+      surface = surface_from_pixbuf (colorized);
+    }
+  else
+    {
+      surface = cairo_surface_reference (meta_theme_image_get_surface (image));
+    }
 
-    case META_DRAW_OP_LIST:
-      break;
+  pattern = cairo_pattern_create_for_surface (surface);
+  cairo_pattern_set_filter (pattern, CAIRO_FILTER_FAST);
 
-    case META_DRAW_TILE:
-      break;
+  if (op->data.image.fill_type == META_IMAGE_FILL_TILE)
+    {
+      cairo_pattern_set_extend (pattern, CAIRO_EXTEND_REPEAT);
+      cairo_matrix_init_translate (&matrix, -x, -y);
     }
+  else
+    {
+      cairo_pattern_set_extend (pattern, CAIRO_EXTEND_PAD);
+      cairo_matrix_init_scale (&matrix,
+                               gdk_pixbuf_get_width (source) / width,
+                               gdk_pixbuf_get_height (source) / height);
+      cairo_matrix_translate (&matrix, -x, -y);
+    }
+  cairo_pattern_set_matrix (pattern, &matrix);
 
-  return pixbuf;
+  cairo_rectangle (cr, x, y, width, height);
+  cairo_set_source (cr, pattern);
+  cairo_fill (cr);
+
+  cairo_pattern_destroy (pattern);
+  cairo_surface_destroy (surface);
 }
 
 static cairo_surface_t *
 draw_op_as_surface (const MetaDrawOp   *op,
+                    MetaTheme          *theme,
                     GtkStyleContext    *style,
                     const MetaDrawInfo *info,
                     gdouble             width,
@@ -3868,47 +4332,8 @@ draw_op_as_surface (const MetaDrawOp   *op,
   switch (op->type)
     {
     case META_DRAW_IMAGE:
-      {
-        if (op->data.image.colorize_spec)
-          {
-            GdkRGBA color;
-
-            meta_color_spec_render (op->data.image.colorize_spec,
-                                    style, &color);
-
-            if (op->data.image.colorize_cache_pixbuf == NULL ||
-                op->data.image.colorize_cache_pixel != GDK_COLOR_RGB (color))
-              {
-                if (op->data.image.colorize_cache_pixbuf)
-                  g_object_unref (G_OBJECT (op->data.image.colorize_cache_pixbuf));
-
-                /* const cast here */
-                ((MetaDrawOp*)op)->data.image.colorize_cache_pixbuf =
-                  colorize_pixbuf (op->data.image.pixbuf,
-                                   &color);
-                ((MetaDrawOp*)op)->data.image.colorize_cache_pixel =
-                  GDK_COLOR_RGB (color);
-              }
-
-            if (op->data.image.colorize_cache_pixbuf)
-              {
-                surface = get_surface_from_pixbuf (op->data.image.colorize_cache_pixbuf,
-                                                   op->data.image.fill_type,
-                                                   width, height,
-                                                   op->data.image.vertical_stripes,
-                                                   op->data.image.horizontal_stripes);
-              }
-          }
-        else
-          {
-            surface = get_surface_from_pixbuf (op->data.image.pixbuf,
-                                               op->data.image.fill_type,
-                                               width, height,
-                                               op->data.image.vertical_stripes,
-                                               op->data.image.horizontal_stripes);
-          }
-        break;
-      }
+      surface = get_image_variant (theme, op, style, width, height, FALSE);
+      break;
 
     case META_DRAW_ICON:
       if (info->mini_icon &&
@@ -3978,7 +4403,119 @@ fill_env (MetaPositionExprEnv *env,
 
   env->title_width = info->title_layout_width;
   env->title_height = info->title_layout_height;
-  env->theme = meta_current_theme;
+  env->theme = info->theme ? info->theme : meta_current_theme;
+
+  /* a new stamp makes the values of earlier envs stale */
+  env->spec_stamp = 0;
+  if (env->theme && env->theme->spec_scratch)
+    {
+      MetaSpecScratch *scratch = env->theme->spec_scratch;
+
+      if (++scratch->stamp == 0)
+        {
+          memset (scratch->stamps, 0, scratch->n_nodes * sizeof (guint));
+          scratch->stamp = 1;
+        }
+      env->spec_stamp = scratch->stamp;
+    }
+}
+
+/* The extents of a title laid out on one line, not ellipsized, kept on the
+ * layout with the layout serial they were measured at. The title op leaves
+ * its ellipsizing width on the layout and moves the serial along, so the
+ * title is shaped again only when its text, its font or the room for it
+ * changes, not at every frame.
+ */
+typedef struct
+{
+  guint          serial;
+  PangoRectangle ink;
+  PangoRectangle logical;
+} MetaTitleExtents;
+
+static GQuark
+title_extents_quark (void)
+{
+  static GQuark quark = 0;
+
+  if (quark == 0)
+    quark = g_quark_from_static_string ("meta-title-extents");
+
+  return quark;
+}
+
+static void
+get_title_extents (PangoLayout    *layout,
+                   PangoRectangle *ink,
+                   PangoRectangle *logical)
+{
+  MetaTitleExtents *extents;
+
+  extents = g_object_get_qdata (G_OBJECT (layout), title_extents_quark ());
+  if (extents == NULL)
+    {
+      extents = g_new0 (MetaTitleExtents, 1);
+      g_object_set_qdata_full (G_OBJECT (layout), title_extents_quark (),
+                               extents, g_free);
+    }
+
+  /* serials start at 1, a new entry is never taken as up to date */
+  if (extents->serial != pango_layout_get_serial (layout))
+    {
+      pango_layout_set_width (layout, -1);
+      pango_layout_get_pixel_extents (layout, &extents->ink, &extents->logical);
+      extents->serial = pango_layout_get_serial (layout);
+    }
+
+  if (ink)
+    *ink = extents->ink;
+  if (logical)
+    *logical = extents->logical;
+}
+
+/* Sets the ellipsizing width, -1 for none; short-circuits if unchanged */
+static void
+set_title_width (PangoLayout *layout,
+                 int          width)
+{
+  MetaTitleExtents *extents;
+  gboolean up_to_date;
+
+  extents = g_object_get_qdata (G_OBJECT (layout), title_extents_quark ());
+  up_to_date = extents && extents->serial == pango_layout_get_serial (layout);
+
+  pango_layout_set_width (layout, width);
+
+  /* the width doesn't change the extents measured without one */
+  if (up_to_date)
+    extents->serial = pango_layout_get_serial (layout);
+}
+
+/* Sets object_width and object_height to the size of the image of an
+ * image op, in the unscaled pixels its expressions use; returns the scale
+ * of the output.
+ */
+static gint
+set_image_object_size (const MetaDrawOp    *op,
+                       MetaPositionExprEnv *env)
+{
+  GdkPixbuf *pixbuf;
+  gint scale;
+
+#ifdef WITH_GTK
+  scale = gdk_window_get_scale_factor (gdk_get_default_root_window ());
+#else
+  scale = 1;
+#endif
+
+  pixbuf = meta_theme_image_get_pixbuf (op->data.image.image);
+  if (pixbuf)
+    {
+      env->object_width = gdk_pixbuf_get_width (pixbuf) / scale;
+      env->object_height = gdk_pixbuf_get_height (pixbuf) / scale;
+    }
+
+  return scale;
 }
 
 /* This code was originally rendering anti-aliased using X primitives, and
@@ -4003,9 +4540,6 @@ meta_draw_op_draw_with_env (const MetaDrawOp    *op,
   GdkRGBA color;
 
   cairo_save (cr);
-#ifdef WITH_GTK
-  gtk_style_context_save (style_gtk);
-#endif
   cairo_set_line_width (cr, 1.0);
 
   switch (op->type)
@@ -4180,20 +4714,21 @@ meta_draw_op_draw_with_env (const MetaDrawOp    *op,
             cairo_rectangle (cr, rx, ry, rwidth, rheight);
             cairo_fill (cr);
           }
-        else
+        else if (rwidth > 0 && rheight > 0)
           {
-            GdkPixbuf *pixbuf;
+            cairo_surface_t *surface;
 
-            pixbuf = draw_op_as_pixbuf (op, style_gtk, info,
-                                        rwidth, rheight);
+            meta_color_spec_render (op->data.tint.color_spec, style_gtk, &color);
+            surface = create_tint_row (&color, op->data.tint.alpha_spec, rwidth);
 
-            if (pixbuf)
-              {
-                gdk_cairo_set_source_pixbuf (cr, pixbuf, rx, ry);
-                cairo_paint (cr);
+            cairo_save (cr);
+            cairo_set_source_surface (cr, surface, rx, ry);
+            cairo_pattern_set_extend (cairo_get_source (cr), CAIRO_EXTEND_REPEAT);
+            cairo_rectangle (cr, rx, ry, rwidth, rheight);
+            cairo_fill (cr);
+            cairo_restore (cr);
 
-                g_object_unref (G_OBJECT (pixbuf));
-              }
+            cairo_surface_destroy (surface);
           }
       }
       break;
@@ -4209,7 +4744,9 @@ meta_draw_op_draw_with_env (const MetaDrawOp    *op,
 
         meta_gradient_spec_render (op->data.gradient.gradient_spec,
                                    op->data.gradient.alpha_spec,
-                                   cr, style_gtk, rx, ry, rwidth, rheight);
+                                   cr, style_gtk,
+                                   env->theme ? env->theme->gradient_surfaces : NULL,
+                                   rx, ry, rwidth, rheight);
       }
       break;
 
@@ -4218,50 +4755,35 @@ meta_draw_op_draw_with_env (const MetaDrawOp    *op,
         gint scale;
         gdouble rx, ry, rwidth, rheight;
         cairo_surface_t *surface;
-#ifdef WITH_GTK
-        scale = gdk_window_get_scale_factor (gdk_get_default_root_window ());
-#else
-        scale = 1;
-#endif                
-        cairo_scale (cr, 1.0 / scale, 1.0 / scale);
 
-        if (op->data.image.pixbuf)
-          {
-            env->object_width = gdk_pixbuf_get_width (op->data.image.pixbuf) / scale;
-            env->object_height = gdk_pixbuf_get_height (op->data.image.pixbuf) / scale;
-          }
+        scale = set_image_object_size (op, env);
+        cairo_scale (cr, 1.0 / scale, 1.0 / scale);
 
         rwidth = parse_size_unchecked (op->data.image.width, env) * scale;
         rheight = parse_size_unchecked (op->data.image.height, env) * scale;
 
-        surface = draw_op_as_surface (op, style_gtk, info, rwidth, rheight);
+        if (info->draft)
+          surface = get_image_variant (env->theme, op, style_gtk,
+                                       rwidth, rheight, TRUE);
+        else
+          surface = draw_op_as_surface (op, env->theme, style_gtk, info,
+                                        rwidth, rheight);
+
+        rx = parse_x_position_unchecked (op->data.image.x, env) * scale;
+        ry = parse_y_position_unchecked (op->data.image.y, env) * scale;
 
         if (surface)
           {
-            rx = parse_x_position_unchecked (op->data.image.x, env) * scale;
-            ry = parse_y_position_unchecked (op->data.image.y, env) * scale;
-
+            /* the alpha gradient is already applied */
             cairo_set_source_surface (cr, surface, rx, ry);
-
-            if (op->data.image.alpha_spec)
-              {
-                cairo_pattern_t *pattern;
-
-                cairo_translate (cr, rx, ry);
-                cairo_scale (cr, rwidth, rheight);
-
-                pattern = meta_alpha_gradient_spec_get_mask (op->data.image.alpha_spec);
-                cairo_mask (cr, pattern);
-
-                cairo_pattern_destroy (pattern);
-              }
-            else
-              {
-                cairo_paint (cr);
-              }
+            cairo_paint (cr);
 
             cairo_surface_destroy (surface);
           }
+        else if (info->draft)
+          {
+            draw_image_draft (op, style_gtk, cr, rx, ry, rwidth, rheight);
+          }
       }
       break;
 
@@ -4294,8 +4816,10 @@ meta_draw_op_draw_with_env (const MetaDrawOp    *op,
             return;
           }
 
+        gtk_style_context_save (style_gtk);
         gtk_style_context_set_state (style_gtk, op->data.gtk_arrow.state);
         gtk_render_arrow (style_gtk, cr, angle, rx, ry, size);
+        gtk_style_context_restore (style_gtk);
       }
       break;
 
@@ -4308,9 +4832,11 @@ meta_draw_op_draw_with_env (const MetaDrawOp    *op,
         rwidth = parse_size_unchecked (op->data.gtk_box.width, env);
         rheight = parse_size_unchecked (op->data.gtk_box.height, env);
 
+        gtk_style_context_save (style_gtk);
         gtk_style_context_set_state (style_gtk, op->data.gtk_box.state);
         gtk_render_background (style_gtk, cr, rx, ry, rwidth, rheight);
         gtk_render_frame (style_gtk, cr, rx, ry, rwidth, rheight);
+        gtk_style_context_restore (style_gtk);
       }
       break;
 
@@ -4322,8 +4848,10 @@ meta_draw_op_draw_with_env (const MetaDrawOp    *op,
         ry1 = parse_y_position_unchecked (op->data.gtk_vline.y1, env);
         ry2 = parse_y_position_unchecked (op->data.gtk_vline.y2, env);
 
+        gtk_style_context_save (style_gtk);
         gtk_style_context_set_state (style_gtk, op->data.gtk_vline.state);
         gtk_render_line (style_gtk, cr, rx, ry1, rx, ry2);
+        gtk_style_context_restore (style_gtk);
       }
       break;
 
@@ -4339,7 +4867,8 @@ meta_draw_op_draw_with_env (const MetaDrawOp    *op,
         rwidth = parse_size_unchecked (op->data.icon.width, env) * scale;
         rheight = parse_size_unchecked (op->data.icon.height, env) * scale;
 
-        surface = draw_op_as_surface (op, style_gtk, info, rwidth, rheight);
+        surface = draw_op_as_surface (op, env->theme, style_gtk, info,
+                                      rwidth, rheight);
 
         if (surface)
           {
@@ -4374,6 +4903,8 @@ meta_draw_op_draw_with_env (const MetaDrawOp    *op,
       if (info->title_layout)
         {
           int rx, ry;
+          int ellipsize_width;
+          int right_bearing;
           PangoRectangle ink_rect, logical_rect;
 #ifdef WITH_GTK
           meta_color_spec_render (op->data.title.color_spec, style_gtk, &color);
@@ -4390,69 +4921,44 @@ meta_draw_op_draw_with_env (const MetaDrawOp    *op,
 
           if (op->data.title.ellipsize_width)
             {
-              int ellipsize_width;
-              int right_bearing;
-
               ellipsize_width = parse_x_position_unchecked (op->data.title.ellipsize_width, env);
               /* HACK: parse_x_position_unchecked adds in env->rect.x, subtract out again */
               ellipsize_width -= env->rect.x;
+            }
+          else if (info->fgeom)
+            /* the theme gives no width, the title ends with the title rect */
+            ellipsize_width = info->fgeom->title_rect.x +
+                              info->fgeom->title_rect.width - rx;
+          else
+            ellipsize_width = env->rect.x + env->rect.width - rx;
 
-              pango_layout_set_width (info->title_layout, -1);
-              pango_layout_get_pixel_extents (info->title_layout,
-                                              &ink_rect, &logical_rect);
+          get_title_extents (info->title_layout, &ink_rect, &logical_rect);
 
-              /* Pango's idea of ellipsization is with respect to the logical rect.
-               * correct for this, by reducing the ellipsization width by the overflow
-               * of the un-ellipsized text on the right... it's always the visual
-               * right we want regardless of bidi, since since the X we pass in to
-               * cairo_move_to() is always the left edge of the line.
-               */
-              right_bearing = (ink_rect.x + ink_rect.width) - (logical_rect.x + logical_rect.width);
-              right_bearing = MAX (right_bearing, 0);
+          /* Pango's idea of ellipsization is with respect to the logical rect.
+           * correct for this, by reducing the ellipsization width by the overflow
+           * of the un-ellipsized text on the right... it's always the visual
+           * right we want regardless of bidi, since since the X we pass in to
+           * cairo_move_to() is always the left edge of the line.
+           */
+          right_bearing = (ink_rect.x + ink_rect.width) - (logical_rect.x + logical_rect.width);
+          right_bearing = MAX (right_bearing, 0);
 
-              ellipsize_width -= right_bearing;
-              ellipsize_width = MAX (ellipsize_width, 0);
+          ellipsize_width -= right_bearing;
+          ellipsize_width = MAX (ellipsize_width, 0);
 
-              /* Only ellipsizing when necessary is a performance optimization -
-               * pango_layout_set_width() will force a relayout if it isn't the
-               * same as the current width of -1.
-               */
-              if (ellipsize_width < logical_rect.width)
-                pango_layout_set_width (info->title_layout, PANGO_SCALE * ellipsize_width);
-            }
-          else if (rx - env->rect.x + env->title_width >= env->rect.width)
-          {
-            const double alpha_margin = 30.0;
-            int text_space = env->rect.x + env->rect.width -
-                             (rx - env->rect.x) - env->right_width;
-
-            double startalpha = 1.0 - (alpha_margin/((double)text_space));
-
-            cairo_pattern_t *linpat;
-            linpat = cairo_pattern_create_linear (rx, ry, text_space,
-                                                  env->title_height);
-            cairo_pattern_add_color_stop_rgba (linpat, 0, color.red,
-                                                          color.green,
-                                                          color.blue,
-                                                          color.alpha);
-            cairo_pattern_add_color_stop_rgba (linpat, startalpha,
-                                                       color.red,
-                                                       color.green,
-                                                       color.blue,
-                                                       color.alpha);
-            cairo_pattern_add_color_stop_rgba (linpat, 1, color.red,
-                                                          color.green,
-                                                          color.blue, 0);
-            cairo_set_source(cr, linpat);
-            cairo_pattern_destroy(linpat);
-          }
+          /* Only ellipsizing when necessary is a performance optimization -
+           * pango_layout_set_width() will force a relayout if it isn't the
+           * same as the current width.
+           */
+          set_title_width (info->title_layout,
+                           ellipsize_width < logical_rect.width ?
+                           PANGO_SCALE * ellipsize_width : -1);
 
           cairo_move_to (cr, rx, ry);
           pango_cairo_show_layout (cr, info->title_layout);
 
-          /* Remove any ellipsization we might have set; will short-circuit
-           * if the width is already -1 */
-          pango_layout_set_width (info->title_layout, -1);
+          /* Any ellipsization is left in place, the next frame of the same
+           * width draws the line already shaped */
         }
       break;
 
@@ -4519,9 +5025,6 @@ meta_draw_op_draw_with_env (const MetaDrawOp    *op,
     }
 
   cairo_restore (cr);
-#ifdef WITH_GTK
-  gtk_style_context_restore (style_gtk);
-#endif  
 }
 
 void
@@ -4569,6 +5072,9 @@ meta_draw_op_list_new (int n_preallocs)
   op_list->n_allocated = n_preallocs;
   op_list->ops = g_new (MetaDrawOp*, op_list->n_allocated);
   op_list->n_ops = 0;
+  op_list->compiled = NULL;
+  op_list->n_compiled = 0;
+  op_list->has_clip = TRUE;
 
   return op_list;
 }
@@ -4597,12 +5103,282 @@ meta_draw_op_list_unref (MetaDrawOpList *op_list)
         meta_draw_op_free (op_list->ops[i]);
 
       g_free (op_list->ops);
+      g_free (op_list->compiled);
 
       DEBUG_FILL_STRUCT (op_list);
       g_free (op_list);
     }
 }
 
+/**
+ * Works out a rectangle outside of which an op leaves the pixels alone,
+ * erring on the large side. Includes cannot be bounded, as their ops
+ * may draw outside the area they are given.
+ */
+static gboolean
+op_get_bounds (const MetaDrawOp    *op,
+               MetaPositionExprEnv *env,
+               GdkRectangle        *bounds)
+{
+  MetaDrawSpec *x, *y, *width, *height;
+  int pad;
+
+  x = y = width = height = NULL;
+  pad = 1;
+
+  switch (op->type)
+    {
+    case META_DRAW_LINE:
+      {
+        int x1, y1, x2, y2;
+
+        x1 = parse_x_position_unchecked (op->data.line.x1, env);
+        y1 = parse_y_position_unchecked (op->data.line.y1, env);
+        x2 = op->data.line.x2 ? parse_x_position_unchecked (op->data.line.x2, env) : x1;
+        y2 = op->data.line.y2 ? parse_y_position_unchecked (op->data.line.y2, env) : y1;
+
+        bounds->x = MIN (x1, x2);
+        bounds->y = MIN (y1, y2);
+        bounds->width = ABS (x2 - x1);
+        bounds->height = ABS (y2 - y1);
+        pad = MAX (op->data.line.width, 1);
+      }
+      break;
+
+    case META_DRAW_RECTANGLE:
+      x = op->data.rectangle.x;
+      y = op->data.rectangle.y;
+      width = op->data.rectangle.width;
+      height = op->data.rectangle.height;
+      break;
+
+    case META_DRAW_ARC:
+      x = op->data.arc.x;
+      y = op->data.arc.y;
+      width = op->data.arc.width;
+      height = op->data.arc.height;
+      break;
+
+    case META_DRAW_TINT:
+      x = op->data.tint.x;
+      y = op->data.tint.y;
+      width = op->data.tint.width;
+      height = op->data.tint.height;
+      break;
+
+    case META_DRAW_GRADIENT:
+      x = op->data.gradient.x;
+      y = op->data.gradient.y;
+      width = op->data.gradient.width;
+      height = op->data.gradient.height;
+      break;
+
+    case META_DRAW_IMAGE:
+      /* the usual button image is centred with object_width and
+       * object_height, which are only known from the image
+       */
+      set_image_object_size (op, env);
+      x = op->data.image.x;
+      y = op->data.image.y;
+      width = op->data.image.width;
+      height = op->data.image.height;
+      break;
+
+    case META_DRAW_GTK_ARROW:
+      {
+        int size;
+
+        bounds->x = parse_x_position_unchecked (op->data.gtk_arrow.x, env);
+        bounds->y = parse_y_position_unchecked (op->data.gtk_arrow.y, env);
+        /* the arrow is drawn in a square of the larger side */
+        size = MAX (parse_size_unchecked (op->data.gtk_arrow.width, env),
+                    parse_size_unchecked (op->data.gtk_arrow.height, env));
+        bounds->width = size;
+        bounds->height = size;
+      }
+      break;
+
+    case META_DRAW_GTK_BOX:
+      x = op->data.gtk_box.x;
+      y = op->data.gtk_box.y;
+      width = op->data.gtk_box.width;
+      height = op->data.gtk_box.height;
+      break;
+
+    case META_DRAW_GTK_VLINE:
+      {
+        int y1, y2;
+
+        y1 = parse_y_position_unchecked (op->data.gtk_vline.y1, env);
+        y2 = parse_y_position_unchecked (op->data.gtk_vline.y2, env);
+
+        bounds->x = parse_x_position_unchecked (op->data.gtk_vline.x, env);
+        bounds->y = MIN (y1, y2);
+        bounds->width = 0;
+        bounds->height = ABS (y2 - y1);
+      }
+      break;
+
+    case META_DRAW_ICON:
+      x = op->data.icon.x;
+      y = op->data.icon.y;
+      width = op->data.icon.width;
+      height = op->data.icon.height;
+      break;
+
+    case META_DRAW_TITLE:
+      bounds->x = parse_x_position_unchecked (op->data.title.x, env);
+      bounds->y = parse_y_position_unchecked (op->data.title.y, env);
+      bounds->width = env->title_width;
+      bounds->height = env->title_height;
+      /* glyphs may stick out of the logical extents */
+      pad = MAX (env->title_height, 1);
+      break;
+
+    case META_DRAW_TILE:
+      x = op->data.tile.x;
+      y = op->data.tile.y;
+      width = op->data.tile.width;
+      height = op->data.tile.height;
+      break;
+
+    case META_DRAW_CLIP:
+    case META_DRAW_OP_LIST:
+      return FALSE;
+    }
+
+  if (x)
+    {
+      bounds->x = parse_x_position_unchecked (x, env);
+      bounds->y = parse_y_position_unchecked (y, env);
+      bounds->width = parse_size_unchecked (width, env);
+      bounds->height = parse_size_unchecked (height, env);
+    }
+
+  if (bounds->width < 0)
+    {
+      bounds->x += bounds->width;
+      bounds->width = -bounds->width;
+    }
+  if (bounds->height < 0)
+    {
+      bounds->y += bounds->height;
+      bounds->height = -bounds->height;
+    }
+
+  bounds->x -= pad;
+  bounds->y -= pad;
+  bounds->width += 2 * pad;
+  bounds->height += 2 * pad;
+
+  return TRUE;
+}
+
+/**
+ * Checks whether an op just fills a rectangle with one colour, which a
+ * filled rectangle always does and a tint does without an alpha
+ * gradient, and gets its colour and geometry if so.
+ */
+static gboolean
+op_get_solid_fill (const MetaDrawOp  *op,
+                   MetaColorSpec    **color_spec,
+                   MetaDrawSpec     **x,
+                   MetaDrawSpec     **y,
+                   MetaDrawSpec     **width,
+                   MetaDrawSpec     **height)
+{
+  MetaColorSpec *spec;
+
+  if (op->type == META_DRAW_RECTANGLE && op->data.rectangle.filled)
+    {
+      spec = op->data.rectangle.color_spec;
+      *x = op->data.rectangle.x;
+      *y = op->data.rectangle.y;
+      *width = op->data.rectangle.width;
+      *height = op->data.rectangle.height;
+    }
+  else if (op->type == META_DRAW_TINT &&
+           (op->data.tint.alpha_spec == NULL ||
+            (op->data.tint.alpha_spec->n_alphas == 1 &&
+             op->data.tint.alpha_spec->alphas[0] == 0xff)))
+    {
+      spec = op->data.tint.color_spec;
+      *x = op->data.tint.x;
+      *y = op->data.tint.y;
+      *width = op->data.tint.width;
+      *height = op->data.tint.height;
+    }
+  else
+    return FALSE;
+
+  if (color_spec)
+    *color_spec = spec;
+
+  return TRUE;
+}
+
+/**
+ * Fills a run of solid fills of one colour, as marked by the optimizer,
+ * as a single path. Overlaps would then only be painted once, so
+ * translucent runs are drawn op by op.
+ */
+static void
+draw_solid_fill_run (const MetaCompiledOp  *run,
+                     GtkStyleContext       *style_gtk,
+                     cairo_t               *cr,
+                     const MetaDrawInfo    *info,
+                     MetaRectangle          rect,
+                     MetaPositionExprEnv   *env)
+{
+  MetaDrawSpec *x, *y, *width, *height;
+  MetaColorSpec *color_spec;
+  GdkRGBA color;
+  int i;
+
+  op_get_solid_fill (run->op, &color_spec, &x, &y, &width, &height);
+  meta_color_spec_render (color_spec, style_gtk, &color);
+
+  if (color.alpha < 1.0)
+    {
+      for (i = 0; i <= run->n_merged; i++)
+        meta_draw_op_draw_with_env (run[i].op, style_gtk, cr, info, rect, env);
+      return;
+    }
+
+  cairo_save (cr);
+  gdk_cairo_set_source_rgba (cr, &color);
+
+  for (i = 0; i <= run->n_merged; i++)
+    {
+      int rx, ry, rwidth, rheight;
+
+      op_get_solid_fill (run[i].op, NULL, &x, &y, &width, &height);
+      rx = parse_x_position_unchecked (x, env);
+      ry = parse_y_position_unchecked (y, env);
+      rwidth = parse_size_unchecked (width, env);
+      rheight = parse_size_unchecked (height, env);
+
+      /* a rectangle of negative size winds the other way and would cut
+       * a hole in the nonzero fill of the others
+       */
+      if (rwidth < 0)
+        {
+          rx += rwidth;
+          rwidth = -rwidth;
+        }
+      if (rheight < 0)
+        {
+          ry += rheight;
+          rheight = -rheight;
+        }
+
+      cairo_rectangle (cr, rx, ry, rwidth, rheight);
+    }
+
+  cairo_fill (cr);
+  cairo_restore (cr);
+}
+
 void
 meta_draw_op_list_draw_with_style  (const MetaDrawOpList *op_list,
                                     GtkStyleContext      *style_gtk,
@@ -4612,30 +5388,42 @@ meta_draw_op_list_draw_with_style  (const MetaDrawOpList *op_list,
 {
   /* BOOKMARK */
 
-  int i;
+  int i, n_ops;
   MetaPositionExprEnv env;
+  GdkRectangle clip_rect;
+  gboolean has_clip_rect;
 
-  if (op_list->n_ops == 0)
+  n_ops = op_list->compiled ? op_list->n_compiled : op_list->n_ops;
+  if (n_ops == 0)
     return;
 
   fill_env (&env, info, rect);
 
-  /* FIXME this can be optimized, potentially a lot, by
-   * compressing multiple ops when possible. For example,
-   * anything convertible to a pixbuf can be composited
-   * client-side, and putting a color tint over a pixbuf
-   * can be done without creating the solid-color pixbuf.
-   *
-   * To implement this my plan is to have the idea of a
-   * compiled draw op (with the string expressions already
-   * evaluated), we make an array of those, and then fold
-   * adjacent items when possible.
+  /* Once the theme is optimized this draws the list prepared by
+   * meta_theme_optimize(); expressions are still evaluated here, since
+   * most of them depend on the frame size.
    */
 
-  cairo_save (cr);
-  for (i = 0; i < op_list->n_ops; i++)
+  /* Ops are only evaluated if they reach into the clip; a redraw of
+   * one button should not draw the rest of the titlebar.
+   */
+  has_clip_rect = gdk_cairo_get_clip_rectangle (cr, &clip_rect);
+
+  if (op_list->has_clip)
+    cairo_save (cr);
+  for (i = 0; i < n_ops; i++)
     {
-      MetaDrawOp *op = op_list->ops[i];
+      MetaDrawOp *op;
+      GdkRectangle bounds;
+      int n_merged = 0;
+
+      if (op_list->compiled)
+        {
+          op = op_list->compiled[i].op;
+          n_merged = op_list->compiled[i].n_merged;
+        }
+      else
+        op = op_list->ops[i];
 
       if (op->type == META_DRAW_CLIP)
         {
@@ -4649,13 +5437,25 @@ meta_draw_op_list_draw_with_style  (const MetaDrawOpList *op_list,
           cairo_clip (cr);
 
           cairo_save (cr);
+
+          has_clip_rect = gdk_cairo_get_clip_rectangle (cr, &clip_rect);
         }
-      else if (gdk_cairo_get_clip_rectangle (cr, NULL))
+      else if (has_clip_rect &&
+               (n_merged > 0 ||
+                !op_get_bounds (op, &env, &bounds) ||
+                gdk_rectangle_intersect (&bounds, &clip_rect, NULL)))
         {
-          meta_draw_op_draw_with_env (op, style_gtk, cr, info, rect, &env);
+          if (n_merged > 0)
+            draw_solid_fill_run (&op_list->compiled[i], style_gtk, cr,
+                                 info, rect, &env);
+          else
+            meta_draw_op_draw_with_env (op, style_gtk, cr, info, rect, &env);
         }
+
+      i += n_merged;
     }
 
+  if (op_list->has_clip)
     cairo_restore (cr);
 }
 
@@ -5056,18 +5856,23 @@ get_button_rect (MetaButtonType           type,
     }
 }
 
-void
-meta_frame_style_draw_with_style (MetaFrameStyle          *style,
-                                  GtkStyleContext         *style_gtk,
-                                  cairo_t                 *cr,
-                                  const MetaFrameGeometry *fgeom,
-                                  int                      client_width,
-                                  int                      client_height,
-                                  PangoLayout             *title_layout,
-                                  int                      text_height,
-                                  MetaButtonState          button_states[META_BUTTON_TYPE_LAST],
-                                  GdkPixbuf               *mini_icon,
-                                  GdkPixbuf               *icon)
+/* A draft frame is drawn quickly while the size keeps changing, with
+ * stretched images and without antialiasing, see MetaDrawInfo
+ */
+static void
+frame_style_draw (MetaFrameStyle          *style,
+                  GtkStyleContext         *style_gtk,
+                  cairo_t                 *cr,
+                  const MetaFrameGeometry *fgeom,
+                  int                      client_width,
+                  int                      client_height,
+                  PangoLayout             *title_layout,
+                  int                      text_height,
+                  MetaButtonState          button_states[META_BUTTON_TYPE_LAST],
+                  GdkPixbuf               *mini_icon,
+                  GdkPixbuf               *icon,
+                  MetaTheme               *theme,
+                  gboolean                 draft)
 {
     /* BOOKMARK */
   int i, j;
@@ -5081,9 +5886,16 @@ meta_frame_style_draw_with_style (MetaFrameStyle          *style,
   PangoRectangle extents;
   MetaDrawInfo draw_info;
   const MetaFrameBorders *borders;
+  GdkRectangle clip_rect;
+  cairo_antialias_t antialias;
 
   borders = &fgeom->borders;
 
+  if (!gdk_cairo_get_clip_rectangle (cr, &clip_rect))
+    return;
+
+  meta_color_palette_update (style_gtk);
+
   visible_rect.x = borders->invisible.left;
   visible_rect.y = borders->invisible.top;
   visible_rect.width = fgeom->width - borders->invisible.left - borders->invisible.right;
@@ -5130,8 +5942,7 @@ meta_frame_style_draw_with_style (MetaFrameStyle          *style,
   bottom_edge.height = borders->visible.bottom;
 
   if (title_layout)
-    pango_layout_get_pixel_extents (title_layout,
-                                    NULL, &extents);
+    get_title_extents (title_layout, NULL, &extents);
 
   draw_info.mini_icon = mini_icon;
   draw_info.icon = icon;
@@ -5139,6 +5950,12 @@ meta_frame_style_draw_with_style (MetaFrameStyle          *style,
   draw_info.title_layout_width = title_layout ? extents.width : 0;
   draw_info.title_layout_height = title_layout ? extents.height : 0;
   draw_info.fgeom = fgeom;
+  draw_info.theme = theme;
+  draw_info.draft = draft;
+
+  antialias = cairo_get_antialias (cr);
+  if (draft)
+    cairo_set_antialias (cr, CAIRO_ANTIALIAS_NONE);
 
   /* The enum is in the order the pieces should be rendered. */
   i = 0;
@@ -5205,12 +6022,10 @@ meta_frame_style_draw_with_style (MetaFrameStyle          *style,
           break;
         }
 
-      cairo_save (cr);
-
-      gdk_cairo_rectangle (cr, &rect);
-      cairo_clip (cr);
-
-      if (gdk_cairo_get_clip_rectangle (cr, NULL))
+      /* Only pieces reaching into the area being redrawn are clipped
+       * to and drawn
+       */
+      if (gdk_rectangle_intersect (&rect, &clip_rect, NULL))
         {
           MetaDrawOpList *op_list;
           MetaFrameStyle *parent;
@@ -5226,17 +6041,25 @@ meta_frame_style_draw_with_style (MetaFrameStyle          *style,
           if (op_list)
             {
               MetaRectangle m_rect;
+              DECO_TRACE_BEGIN (piece_start);
+
+              cairo_save (cr);
+
+              gdk_cairo_rectangle (cr, &rect);
+              cairo_clip (cr);
+
               m_rect = meta_rect (rect.x, rect.y, rect.width, rect.height);
               meta_draw_op_list_draw_with_style (op_list,
                                                  style_gtk,
                                                  cr,
                                                  &draw_info,
                                                  m_rect);
+
+              cairo_restore (cr);
+              DECO_TRACE_END (piece_start, "piece", meta_frame_piece_to_string (i));
             }
         }
 
-      cairo_restore (cr);
-
       /* Draw buttons just before overlay */
       if ((i + 1) == META_FRAME_PIECE_OVERLAY)
         {
@@ -5253,27 +6076,26 @@ meta_frame_style_draw_with_style (MetaFrameStyle          *style,
               button_state = map_button_state (j, fgeom, middle_bg_offset, button_states);
               op_list = get_button (style, j, button_state);
 
-              if (op_list)
+              if (op_list && gdk_rectangle_intersect (&rect, &clip_rect, NULL))
                 {
+                  MetaRectangle m_rect;
+                  DECO_TRACE_BEGIN (button_start);
+
                   cairo_save (cr);
                   gdk_cairo_rectangle (cr, &rect);
                   cairo_clip (cr);
 
-                  if (gdk_cairo_get_clip_rectangle (cr, NULL))
-                    {
-                      MetaRectangle m_rect;
+                  m_rect = meta_rect (rect.x, rect.y,
+                                      rect.width, rect.height);
 
-                      m_rect = meta_rect (rect.x, rect.y,
-                                          rect.width, rect.height);
-
-                      meta_draw_op_list_draw_with_style (op_list,
-                                                         style_gtk,
-                                                         cr,
-                                                         &draw_info,
-                                                         m_rect);
-                    }
+                  meta_draw_op_list_draw_with_style (op_list,
+                                                     style_gtk,
+                                                     cr,
+                                                     &draw_info,
+                                                     m_rect);
 
                   cairo_restore (cr);
+                  DECO_TRACE_END (button_start, "button", meta_button_type_to_string (j));
                 }
 
               /* MIDDLE_BACKGROUND type may get drawn more than once */
@@ -5293,6 +6115,26 @@ meta_frame_style_draw_with_style (MetaFrameStyle          *style,
 
       ++i;
     }
+
+  cairo_set_antialias (cr, antialias);
+}
+
+void
+meta_frame_style_draw_with_style (MetaFrameStyle          *style,
+                                  GtkStyleContext         *style_gtk,
+                                  cairo_t                 *cr,
+                                  const MetaFrameGeometry *fgeom,
+                                  int                      client_width,
+                                  int                      client_height,
+                                  PangoLayout             *title_layout,
+                                  int                      text_height,
+                                  MetaButtonState          button_states[META_BUTTON_TYPE_LAST],
+                                  GdkPixbuf               *mini_icon,
+                                  GdkPixbuf               *icon)
+{
+  frame_style_draw (style, style_gtk, cr, fgeom, client_width, client_height,
+                    title_layout, text_height, button_states, mini_icon, icon,
+                    NULL, FALSE);
 }
 
 void
@@ -5572,6 +6414,24 @@ meta_theme_set_current (const char *name,
     }
 }
 
+/**
+ * Makes a theme loaded beforehand, possibly on another thread, the
+ * current one and frees the old one. Only call this from the main
+ * thread, in between draws.
+ */
+void
+meta_theme_replace_current (MetaTheme *theme)
+{
+  g_return_if_fail (theme != NULL);
+
+  if (meta_current_theme && meta_current_theme != theme)
+    meta_theme_free (meta_current_theme);
+
+  meta_current_theme = theme;
+
+  meta_topic (META_DEBUG_THEMES, "New theme is \"%s\"\n", meta_current_theme->name);
+}
+
 MetaTheme*
 meta_theme_new (void)
 {
@@ -5583,7 +6443,12 @@ meta_theme_new (void)
     g_hash_table_new_full (g_str_hash,
                            g_str_equal,
                            g_free,
-                           g_object_unref);
+                           (GDestroyNotify) meta_theme_image_unref);
+
+  theme->image_variants =
+    meta_surface_cache_new (sizeof (ImageVariantKey), IMAGE_VARIANTS_MAX_BYTES);
+  theme->gradient_surfaces =
+    meta_surface_cache_new (sizeof (GradientKey), GRADIENT_SURFACES_MAX_BYTES);
 
   theme->layouts_by_name =
     g_hash_table_new_full (g_str_hash,
@@ -5630,179 +6495,971 @@ meta_theme_new (void)
   return theme;
 }
 
-void
-meta_theme_free (MetaTheme *theme)
+static void
+log_surface_cache_stats (const char       *name,
+                         MetaSurfaceCache *cache)
+{
+  guint hits, misses;
+  gsize bytes;
+
+  meta_surface_cache_get_stats (cache, &hits, &misses, &bytes);
+  meta_topic (META_DEBUG_THEMES, "%s: %u hits, %u misses, %" G_GSIZE_FORMAT " bytes\n",
+              name, hits, misses, bytes);
+}
+
+static void
+log_cache_stats (MetaTheme *theme)
+{
+  if (theme->image_variants)
+    log_surface_cache_stats ("Image variant cache", theme->image_variants);
+  if (theme->gradient_surfaces)
+    log_surface_cache_stats ("Gradient cache", theme->gradient_surfaces);
+}
+
+void
+meta_theme_free (MetaTheme *theme)
+{
+  int i;
+
+  g_return_if_fail (theme != NULL);
+
+  g_free (theme->name);
+  g_free (theme->dirname);
+  g_free (theme->filename);
+  g_free (theme->readable_name);
+  g_free (theme->date);
+  g_free (theme->description);
+  g_free (theme->author);
+  g_free (theme->copyright);
+
+  /* be more careful when destroying the theme hash tables,
+     since they are only constructed as needed, and may be NULL. */
+  if (theme->integer_constants)
+    g_hash_table_destroy (theme->integer_constants);
+  if (theme->images_by_filename)
+    g_hash_table_destroy (theme->images_by_filename);
+  meta_theme_cache_free (theme->image_cache);
+  log_cache_stats (theme);
+  meta_surface_cache_free (theme->image_variants);
+  meta_surface_cache_free (theme->gradient_surfaces);
+  if (theme->layouts_by_name)
+    g_hash_table_destroy (theme->layouts_by_name);
+  if (theme->draw_op_lists_by_name)
+    g_hash_table_destroy (theme->draw_op_lists_by_name);
+  if (theme->styles_by_name)
+    g_hash_table_destroy (theme->styles_by_name);
+  if (theme->style_sets_by_name)
+    g_hash_table_destroy (theme->style_sets_by_name);
+
+  for (i = 0; i < META_FRAME_TYPE_LAST; i++)
+    if (theme->style_sets_by_type[i])
+      meta_frame_style_set_unref (theme->style_sets_by_type[i]);
+
+  if (theme->spec_nodes)
+    g_array_free (theme->spec_nodes, TRUE);
+  if (theme->spec_node_ids)
+    g_hash_table_destroy (theme->spec_node_ids);
+  if (theme->spec_scratch)
+    {
+      g_free (theme->spec_scratch->values);
+      g_free (theme->spec_scratch->stamps);
+      g_free (theme->spec_scratch);
+    }
+
+  DEBUG_FILL_STRUCT (theme);
+  g_free (theme);
+}
+
+gboolean
+meta_theme_validate (MetaTheme *theme,
+                     GError   **error)
+{
+  int i;
+
+  g_return_val_if_fail (theme != NULL, FALSE);
+
+  /* FIXME what else should be checked? */
+
+  g_assert (theme->name);
+
+  if (theme->readable_name == NULL)
+    {
+      /* Translators: This error means that a necessary XML tag (whose name
+       * is given in angle brackets) was not found in a given theme (whose
+       * name is given second, in quotation marks).
+       */
+      g_set_error (error, META_THEME_ERROR, META_THEME_ERROR_FAILED,
+                   _("No <%s> set for theme \"%s\""), "name", theme->name);
+      return FALSE;
+    }
+
+  if (theme->author == NULL)
+    {
+      g_set_error (error, META_THEME_ERROR, META_THEME_ERROR_FAILED,
+                   _("No <%s> set for theme \"%s\""), "author", theme->name);
+      return FALSE;
+    }
+
+  if (theme->date == NULL)
+    {
+      g_set_error (error, META_THEME_ERROR, META_THEME_ERROR_FAILED,
+                   _("No <%s> set for theme \"%s\""), "date", theme->name);
+      return FALSE;
+    }
+
+  if (theme->description == NULL)
+    {
+      g_set_error (error, META_THEME_ERROR, META_THEME_ERROR_FAILED,
+                   _("No <%s> set for theme \"%s\""), "description", theme->name);
+      return FALSE;
+    }
+
+  if (theme->copyright == NULL)
+    {
+      g_set_error (error, META_THEME_ERROR, META_THEME_ERROR_FAILED,
+                   _("No <%s> set for theme \"%s\""), "copyright", theme->name);
+      return FALSE;
+    }
+
+  for (i = 0; i < (int)META_FRAME_TYPE_LAST; i++)
+    if (i != (int)META_FRAME_TYPE_ATTACHED && theme->style_sets_by_type[i] == NULL)
+      {
+        g_set_error (error, META_THEME_ERROR, META_THEME_ERROR_FAILED,
+                     _("No frame style set for window type \"%s\" in theme \"%s\", add a <window type=\"%s\" style_set=\"whatever\"/> element"),
+                     meta_frame_type_to_string (i),
+                     theme->name,
+                     meta_frame_type_to_string (i));
+
+        return FALSE;
+      }
+
+  return TRUE;
+}
+
+/* Decoder threads shared by all themes, created on first use */
+static GThreadPool *image_decode_pool = NULL;
+
+static void
+detect_stripes (MetaThemeImage *image,
+                GdkPixbuf      *pixbuf)
+{
+  int h, w, c;
+  int pixbuf_width, pixbuf_height, pixbuf_n_channels, pixbuf_rowstride;
+  const guchar *pixbuf_pixels;
+
+  pixbuf_n_channels = gdk_pixbuf_get_n_channels(pixbuf);
+  pixbuf_width = gdk_pixbuf_get_width(pixbuf);
+  pixbuf_height = gdk_pixbuf_get_height(pixbuf);
+  pixbuf_rowstride = gdk_pixbuf_get_rowstride(pixbuf);
+  pixbuf_pixels = gdk_pixbuf_read_pixels(pixbuf);
+
+  /* Check for horizontal stripes */
+  for (h = 0; h < pixbuf_height; h++)
+    {
+      for (w = 1; w < pixbuf_width; w++)
+        {
+          for (c = 0; c < pixbuf_n_channels; c++)
+            {
+              if (pixbuf_pixels[(h * pixbuf_rowstride) + c] !=
+                  pixbuf_pixels[(h * pixbuf_rowstride) + w + c])
+                break;
+            }
+          if (c < pixbuf_n_channels)
+            break;
+        }
+      if (w < pixbuf_width)
+        break;
+    }
+
+  image->horizontal_stripes = h >= pixbuf_height;
+
+  /* Check for vertical stripes */
+  for (w = 0; w < pixbuf_width; w++)
+    {
+      for (h = 1; h < pixbuf_height; h++)
+        {
+          for (c = 0; c < pixbuf_n_channels; c++)
+            {
+              if (pixbuf_pixels[w + c] !=
+                  pixbuf_pixels[(h * pixbuf_rowstride) + w + c])
+                break;
+            }
+          if (c < pixbuf_n_channels)
+            break;
+        }
+      if (h < pixbuf_height)
+        break;
+    }
+
+  image->vertical_stripes = w >= pixbuf_width;
+}
+
+/* Publishes the result of a decode, takes ownership of pixbuf */
+static void
+theme_image_finish (MetaThemeImage *image,
+                    GdkPixbuf      *pixbuf)
+{
+  if (pixbuf)
+    detect_stripes (image, pixbuf);
+
+  g_mutex_lock (&image->lock);
+  image->pixbuf = pixbuf;
+  image->state = pixbuf ? META_THEME_IMAGE_READY : META_THEME_IMAGE_FAILED;
+  g_cond_broadcast (&image->cond);
+  g_mutex_unlock (&image->lock);
+}
+
+/* Runs on any thread, only touches gdk-pixbuf; except for images from
+ * the icon theme, which are never queued and so only get here on the
+ * main thread
+ */
+static void
+theme_image_decode (MetaThemeImage *image)
+{
+  GdkPixbuf *pixbuf;
+  GError *error = NULL;
+  gint width, height;
+
+  pixbuf = NULL;
+  if (image->full_path == NULL)
+    {
+      pixbuf = gtk_icon_theme_load_icon_for_scale (gtk_icon_theme_get_default (),
+                                                   image->filename + 6,
+                                                   image->icon_size,
+                                                   image->scale,
+                                                   0,
+                                                   &error);
+      if (pixbuf == NULL)
+        {
+          meta_warning (_("Failed to load image \"%s\": %s\n"),
+                        image->filename, error->message);
+          g_error_free (error);
+        }
+    }
+  else if (gdk_pixbuf_get_file_info (image->full_path, &width, &height) != NULL)
+    {
+      pixbuf = gdk_pixbuf_new_from_file_at_size (image->full_path,
+                                                 width * image->scale,
+                                                 height * image->scale,
+                                                 &error);
+      if (pixbuf == NULL)
+        {
+          meta_warning (_("Failed to load image \"%s\": %s\n"),
+                        image->full_path, error->message);
+          g_error_free (error);
+        }
+    }
+
+  theme_image_finish (image, pixbuf);
+}
+
+static void
+theme_image_decode_func (gpointer data,
+                         gpointer user_data)
+{
+  MetaThemeImage *image = data;
+  gboolean claimed;
+
+  /* The main thread may have needed it first and decoded it itself */
+  g_mutex_lock (&image->lock);
+  claimed = image->state == META_THEME_IMAGE_QUEUED;
+  if (claimed)
+    image->state = META_THEME_IMAGE_DECODING;
+  g_mutex_unlock (&image->lock);
+
+  if (claimed)
+    theme_image_decode (image);
+
+  meta_theme_image_unref (image);
+}
+
+static void
+theme_image_queue (MetaThemeImage *image)
+{
+  gboolean queue;
+
+  g_mutex_lock (&image->lock);
+  queue = image->state == META_THEME_IMAGE_PENDING && image->full_path;
+  if (queue)
+    image->state = META_THEME_IMAGE_QUEUED;
+  g_mutex_unlock (&image->lock);
+
+  if (!queue)
+    return;
+
+  if (image_decode_pool == NULL)
+    image_decode_pool = g_thread_pool_new (theme_image_decode_func, NULL,
+                                           g_get_num_processors (),
+                                           FALSE, NULL);
+
+  g_thread_pool_push (image_decode_pool, meta_theme_image_ref (image), NULL);
+}
+
+/* Gets a decode out of the way: steals it from the queue, or waits for
+ * the thread already at it. With decode_pending the images nobody has
+ * asked for yet are decoded too.
+ */
+static void
+theme_image_wait (MetaThemeImage *image,
+                  gboolean        decode_pending)
+{
+  gboolean claimed;
+
+  g_mutex_lock (&image->lock);
+  claimed = image->state == META_THEME_IMAGE_QUEUED ||
+            (decode_pending && image->state == META_THEME_IMAGE_PENDING);
+  if (claimed)
+    image->state = META_THEME_IMAGE_DECODING;
+  else
+    while (image->state == META_THEME_IMAGE_DECODING)
+      g_cond_wait (&image->cond, &image->lock);
+  g_mutex_unlock (&image->lock);
+
+  if (claimed)
+    theme_image_decode (image);
+}
+
+MetaThemeImage*
+meta_theme_image_ref (MetaThemeImage *image)
+{
+  g_atomic_int_inc (&image->refcount);
+
+  return image;
+}
+
+void
+meta_theme_image_unref (MetaThemeImage *image)
+{
+  if (!g_atomic_int_dec_and_test (&image->refcount))
+    return;
+
+  if (image->surface)
+    cairo_surface_destroy (image->surface);
+  if (image->pixbuf)
+    g_object_unref (G_OBJECT (image->pixbuf));
+  g_free (image->filename);
+  g_free (image->full_path);
+  g_mutex_clear (&image->lock);
+  g_cond_clear (&image->cond);
+
+  DEBUG_FILL_STRUCT (image);
+  g_free (image);
+}
+
+/**
+ * Returns the pixels of an image, decoding them now if that has not
+ * happened yet. The pixbuf belongs to the image.
+ *
+ * \return The pixbuf, or NULL if the image could not be decoded
+ */
+GdkPixbuf*
+meta_theme_image_get_pixbuf (MetaThemeImage *image)
+{
+  theme_image_wait (image, TRUE);
+
+  return image->pixbuf;
+}
+
+/**
+ * Returns the pixels of an image as a premultiplied surface, converting
+ * them on first use. Only call this from the main thread; the surface
+ * belongs to the image.
+ *
+ * \return The surface, or NULL if the image could not be decoded
+ */
+cairo_surface_t*
+meta_theme_image_get_surface (MetaThemeImage *image)
+{
+  GdkPixbuf *pixbuf;
+
+  if (image->surface == NULL)
+    {
+      pixbuf = meta_theme_image_get_pixbuf (image);
+      if (pixbuf)
+        image->surface = surface_from_pixbuf (pixbuf);
+    }
+
+  return image->surface;
+}
+
+static MetaThemeImage*
+theme_image_new (const char *filename,
+                 char       *full_path,
+                 int         scale)
+{
+  MetaThemeImage *image;
+
+  image = g_new0 (MetaThemeImage, 1);
+  image->refcount = 1;
+  image->filename = g_strdup (filename);
+  image->full_path = full_path;
+  image->scale = scale;
+  image->state = META_THEME_IMAGE_PENDING;
+  g_mutex_init (&image->lock);
+  g_cond_init (&image->cond);
+
+  return image;
+}
+
+static int
+get_image_scale (void)
+{
+  static int scale = 1;
+
+#ifdef WITH_GTK
+  /* GDK is only used on the main thread, themes loaded elsewhere get
+   * the scale it saw last
+   */
+  if (g_main_context_is_owner (g_main_context_default ()))
+    g_atomic_int_set (&scale,
+                      gdk_window_get_scale_factor (gdk_get_default_root_window ()));
+#endif
+
+  return g_atomic_int_get (&scale);
+}
+
+/**
+ * Looks up an image for the theme being parsed. Images from the icon
+ * theme and images in the on-disk cache are ready straight away, files
+ * are only checked for existence; meta_theme_load_images() decodes them.
+ *
+ * \return A new reference to the image, or NULL if it does not exist
+ */
+MetaThemeImage*
+meta_theme_load_image (MetaTheme  *theme,
+                       const char *filename,
+                       guint size_of_theme_icons,
+                       GError    **error)
+{
+  MetaThemeImage *image;
+  GdkPixbuf *pixbuf;
+  int scale;
+
+  image = g_hash_table_lookup (theme->images_by_filename,
+                               filename);
+
+  scale = get_image_scale ();
+  if (image == NULL)
+    {
+
+      if (g_str_has_prefix (filename, "theme:") &&
+          META_THEME_ALLOWS (theme, META_THEME_IMAGES_FROM_ICON_THEMES))
+        {
+          image = theme_image_new (filename, NULL, scale);
+          image->icon_size = size_of_theme_icons;
+
+          /* The icon theme is not thread safe, so themes loaded elsewhere
+           * leave these to meta_theme_image_get_pixbuf()
+           */
+          if (g_main_context_is_owner (g_main_context_default ()))
+            {
+              pixbuf = gtk_icon_theme_load_icon_for_scale (
+                  gtk_icon_theme_get_default (),
+                  filename+6,
+                  size_of_theme_icons,
+                  scale,
+                  0,
+                  error);
+              if (pixbuf == NULL)
+                {
+                  meta_theme_image_unref (image);
+                  return NULL;
+                }
+
+              theme_image_finish (image, pixbuf);
+            }
+         }
+      else
+        {
+          char *full_path;
+          full_path = g_build_filename (theme->dirname, filename, NULL);
+
+          if (!g_file_test (full_path, G_FILE_TEST_IS_REGULAR))
+            {
+              g_free (full_path);
+              return NULL;
+            }
+
+          image = theme_image_new (filename, full_path, scale);
+
+          if (theme->image_cache == NULL && theme->filename != NULL)
+            theme->image_cache = meta_theme_cache_open (theme->filename, scale);
+
+          pixbuf = NULL;
+          if (theme->image_cache)
+            pixbuf = meta_theme_cache_lookup (theme->image_cache,
+                                              filename, full_path);
+
+          if (pixbuf)
+            {
+              image->cached = TRUE;
+              theme_image_finish (image, pixbuf);
+            }
+        }
+      g_hash_table_replace (theme->images_by_filename,
+                            g_strdup (filename),
+                            image);
+    }
+
+  g_assert (image);
+
+  return meta_theme_image_ref (image);
+}
+
+static void
+queue_op_list_images (MetaDrawOpList *op_list,
+                      GHashTable     *seen)
+{
+  int i;
+
+  if (op_list == NULL || g_hash_table_lookup (seen, op_list))
+    return;
+
+  g_hash_table_insert (seen, op_list, op_list);
+
+  for (i = 0; i < op_list->n_ops; i++)
+    {
+      MetaDrawOp *op = op_list->ops[i];
+
+      switch (op->type)
+        {
+        case META_DRAW_IMAGE:
+          theme_image_queue (op->data.image.image);
+          break;
+        case META_DRAW_OP_LIST:
+          queue_op_list_images (op->data.op_list.op_list, seen);
+          break;
+        case META_DRAW_TILE:
+          queue_op_list_images (op->data.tile.op_list, seen);
+          break;
+        default:
+          break;
+        }
+    }
+}
+
+static void
+queue_style_images (MetaFrameStyle *style,
+                    GHashTable     *seen)
+{
+  int i, j;
+
+  /* Pieces and buttons not set in a style come from its parents */
+  for (; style != NULL; style = style->parent)
+    {
+      for (i = 0; i < META_FRAME_PIECE_LAST; i++)
+        queue_op_list_images (style->pieces[i], seen);
+
+      for (i = 0; i < META_BUTTON_TYPE_LAST; i++)
+        for (j = 0; j < META_BUTTON_STATE_LAST; j++)
+          queue_op_list_images (style->buttons[i][j], seen);
+    }
+}
+
+/**
+ * Decodes the images of a freshly parsed theme. The images used by the
+ * normal and maximized frames of every style set are decoded in parallel
+ * and waited for; those only shaded, tiled or attached frames use are
+ * left for their first draw. Newly decoded images are then written to
+ * the on-disk cache; meta_theme_save_image_cache() adds the later ones.
+ */
+void
+meta_theme_load_images (MetaTheme *theme)
+{
+  GHashTableIter iter;
+  gpointer value;
+  GHashTable *seen;
+  int i, j;
+
+  seen = g_hash_table_new (NULL, NULL);
+
+  g_hash_table_iter_init (&iter, theme->style_sets_by_name);
+  while (g_hash_table_iter_next (&iter, NULL, &value))
+    {
+      MetaFrameStyleSet *style_set = value;
+
+      for (i = 0; i < META_FRAME_RESIZE_LAST; i++)
+        for (j = 0; j < META_FRAME_FOCUS_LAST; j++)
+          queue_style_images (style_set->normal_styles[i][j], seen);
+
+      for (j = 0; j < META_FRAME_FOCUS_LAST; j++)
+        queue_style_images (style_set->maximized_styles[j], seen);
+    }
+
+  g_hash_table_destroy (seen);
+
+  /* Lend the pool a hand rather than just sitting there */
+  g_hash_table_iter_init (&iter, theme->images_by_filename);
+  while (g_hash_table_iter_next (&iter, NULL, &value))
+    theme_image_wait (value, FALSE);
+
+  meta_theme_save_image_cache (theme);
+}
+
+/**
+ * Writes the images decoded since the last save to the on-disk cache,
+ * such as those decoded on their first draw. Does nothing, and costs
+ * next to nothing, when there are none.
+ */
+void
+meta_theme_save_image_cache (MetaTheme *theme)
+{
+  GHashTableIter iter;
+  gpointer value;
+
+  if (theme->image_cache == NULL)
+    return;
+
+  g_hash_table_iter_init (&iter, theme->images_by_filename);
+  while (g_hash_table_iter_next (&iter, NULL, &value))
+    {
+      MetaThemeImage *image = value;
+      gboolean ready;
+
+      if (image->full_path == NULL || image->cached)
+        continue;
+
+      g_mutex_lock (&image->lock);
+      ready = image->state == META_THEME_IMAGE_READY;
+      g_mutex_unlock (&image->lock);
+
+      if (ready)
+        {
+          meta_theme_cache_insert (theme->image_cache, image->filename,
+                                   image->full_path, image->pixbuf);
+          image->cached = TRUE;
+        }
+    }
+
+  meta_theme_cache_save (theme->image_cache);
+}
+
+static gboolean
+draw_spec_is_variable (const MetaDrawSpec *spec,
+                       GQuark              quark)
+{
+  return spec->n_tokens == 1 &&
+         spec->tokens[0].type == POS_TOKEN_VARIABLE &&
+         spec->tokens[0].d.v.name_quark == quark;
+}
+
+/**
+ * Checks for the geometry "0", "0", "width", "height", which covers the
+ * whole area a list is drawn in.
+ */
+static gboolean
+is_whole_area (MetaTheme          *theme,
+               const MetaDrawSpec *x,
+               const MetaDrawSpec *y,
+               const MetaDrawSpec *width,
+               const MetaDrawSpec *height)
 {
-  int i;
+  return x->constant && x->value == 0 &&
+         y->constant && y->value == 0 &&
+         draw_spec_is_variable (width, theme->quark_width) &&
+         draw_spec_is_variable (height, theme->quark_height);
+}
 
-  g_return_if_fail (theme != NULL);
+static gboolean
+same_solid_color (const MetaColorSpec *a,
+                  const MetaColorSpec *b)
+{
+  if (a == b)
+    return TRUE;
 
-  g_free (theme->name);
-  g_free (theme->dirname);
-  g_free (theme->filename);
-  g_free (theme->readable_name);
-  g_free (theme->date);
-  g_free (theme->description);
-  g_free (theme->author);
-  g_free (theme->copyright);
+  return a->type == META_COLOR_SPEC_BASIC &&
+         b->type == META_COLOR_SPEC_BASIC &&
+         gdk_rgba_equal (&a->data.basic.color, &b->data.basic.color);
+}
 
-  /* be more careful when destroying the theme hash tables,
-     since they are only constructed as needed, and may be NULL. */
-  if (theme->integer_constants)
-    g_hash_table_destroy (theme->integer_constants);
-  if (theme->images_by_filename)
-    g_hash_table_destroy (theme->images_by_filename);
-  if (theme->layouts_by_name)
-    g_hash_table_destroy (theme->layouts_by_name);
-  if (theme->draw_op_lists_by_name)
-    g_hash_table_destroy (theme->draw_op_lists_by_name);
-  if (theme->styles_by_name)
-    g_hash_table_destroy (theme->styles_by_name);
-  if (theme->style_sets_by_name)
-    g_hash_table_destroy (theme->style_sets_by_name);
+static gboolean
+op_is_opaque_cover (MetaTheme        *theme,
+                    const MetaDrawOp *op)
+{
+  MetaColorSpec *color_spec;
+  MetaDrawSpec *x, *y, *width, *height;
 
-  for (i = 0; i < META_FRAME_TYPE_LAST; i++)
-    if (theme->style_sets_by_type[i])
-      meta_frame_style_set_unref (theme->style_sets_by_type[i]);
+  if (!op_get_solid_fill (op, &color_spec, &x, &y, &width, &height))
+    return FALSE;
 
-  DEBUG_FILL_STRUCT (theme);
-  g_free (theme);
+  /* GTK colours may turn translucent with the GTK theme */
+  return color_spec->type == META_COLOR_SPEC_BASIC &&
+         color_spec->data.basic.color.alpha >= 1.0 &&
+         is_whole_area (theme, x, y, width, height);
 }
 
-gboolean
-meta_theme_validate (MetaTheme *theme,
-                     GError   **error)
+static void
+collect_included_lists (MetaDrawOpList *op_list,
+                        GHashTable     *included)
 {
   int i;
 
-  g_return_val_if_fail (theme != NULL, FALSE);
+  if (op_list == NULL)
+    return;
 
-  /* FIXME what else should be checked? */
+  for (i = 0; i < op_list->n_ops; i++)
+    {
+      MetaDrawOp *op = op_list->ops[i];
+      MetaDrawOpList *child;
 
-  g_assert (theme->name);
+      if (op->type == META_DRAW_OP_LIST)
+        child = op->data.op_list.op_list;
+      else if (op->type == META_DRAW_TILE)
+        child = op->data.tile.op_list;
+      else
+        continue;
 
-  if (theme->readable_name == NULL)
-    {
-      /* Translators: This error means that a necessary XML tag (whose name
-       * is given in angle brackets) was not found in a given theme (whose
-       * name is given second, in quotation marks).
-       */
-      g_set_error (error, META_THEME_ERROR, META_THEME_ERROR_FAILED,
-                   _("No <%s> set for theme \"%s\""), "name", theme->name);
-      return FALSE;
-    }
+      if (g_hash_table_lookup (included, child))
+        continue;
 
-  if (theme->author == NULL)
-    {
-      g_set_error (error, META_THEME_ERROR, META_THEME_ERROR_FAILED,
-                   _("No <%s> set for theme \"%s\""), "author", theme->name);
-      return FALSE;
+      g_hash_table_insert (included, child, child);
+      collect_included_lists (child, included);
     }
+}
 
-  if (theme->date == NULL)
+static void
+optimize_op_list (MetaTheme      *theme,
+                  MetaDrawOpList *op_list,
+                  GHashTable     *included)
+{
+  GArray *compiled;
+  MetaCompiledOp *ops;
+  gboolean has_clip;
+  int i, j, first;
+
+  if (op_list == NULL || op_list->compiled)
+    return;
+
+  compiled = g_array_new (FALSE, FALSE, sizeof (MetaCompiledOp));
+
+  for (i = 0; i < op_list->n_ops; i++)
     {
-      g_set_error (error, META_THEME_ERROR, META_THEME_ERROR_FAILED,
-                   _("No <%s> set for theme \"%s\""), "date", theme->name);
-      return FALSE;
+      MetaCompiledOp item;
+
+      item.op = op_list->ops[i];
+      item.n_merged = 0;
+
+      if (item.op->type == META_DRAW_TILE)
+        optimize_op_list (theme, item.op->data.tile.op_list, included);
+      else if (item.op->type == META_DRAW_OP_LIST)
+        {
+          MetaDrawOpList *child = item.op->data.op_list.op_list;
+
+          optimize_op_list (theme, child, included);
+
+          /* Drawn over the whole area, the included ops see the same
+           * variables as ours, so they can be drawn as ours unless
+           * they clip.
+           */
+          if (!child->has_clip &&
+              is_whole_area (theme,
+                             item.op->data.op_list.x,
+                             item.op->data.op_list.y,
+                             item.op->data.op_list.width,
+                             item.op->data.op_list.height))
+            {
+              g_array_append_vals (compiled, child->compiled,
+                                   child->n_compiled);
+              continue;
+            }
+        }
+
+      g_array_append_val (compiled, item);
     }
 
-  if (theme->description == NULL)
+  /* Pieces and buttons are clipped to the area they are drawn in, so
+   * an opaque fill of all of it hides whatever came before, back to
+   * the last clip. Included lists may draw outside their area.
+   */
+  if (g_hash_table_lookup (included, op_list) == NULL)
     {
-      g_set_error (error, META_THEME_ERROR, META_THEME_ERROR_FAILED,
-                   _("No <%s> set for theme \"%s\""), "description", theme->name);
-      return FALSE;
+      first = 0;
+      for (i = 0; i < (int) compiled->len; i++)
+        {
+          MetaDrawOp *op = g_array_index (compiled, MetaCompiledOp, i).op;
+
+          if (op->type == META_DRAW_CLIP)
+            first = i + 1;
+          else if (i > first && op_is_opaque_cover (theme, op))
+            {
+              g_array_remove_range (compiled, first, i - first);
+              i = first;
+            }
+        }
     }
 
-  if (theme->copyright == NULL)
+  ops = (MetaCompiledOp *) compiled->data;
+  has_clip = FALSE;
+
+  for (i = 0; i < (int) compiled->len; i = j)
     {
-      g_set_error (error, META_THEME_ERROR, META_THEME_ERROR_FAILED,
-                   _("No <%s> set for theme \"%s\""), "copyright", theme->name);
-      return FALSE;
-    }
+      MetaColorSpec *color_spec, *next_spec;
+      MetaDrawSpec *x, *y, *width, *height;
 
-  for (i = 0; i < (int)META_FRAME_TYPE_LAST; i++)
-    if (i != (int)META_FRAME_TYPE_ATTACHED && theme->style_sets_by_type[i] == NULL)
-      {
-        g_set_error (error, META_THEME_ERROR, META_THEME_ERROR_FAILED,
-                     _("No frame style set for window type \"%s\" in theme \"%s\", add a <window type=\"%s\" style_set=\"whatever\"/> element"),
-                     meta_frame_type_to_string (i),
-                     theme->name,
-                     meta_frame_type_to_string (i));
+      ops[i].n_merged = 0;
+      j = i + 1;
 
-        return FALSE;
-      }
+      if (ops[i].op->type == META_DRAW_CLIP)
+        has_clip = TRUE;
 
-  return TRUE;
+      if (!op_get_solid_fill (ops[i].op, &color_spec,
+                              &x, &y, &width, &height))
+        continue;
+
+      while (j < (int) compiled->len &&
+             op_get_solid_fill (ops[j].op, &next_spec,
+                                &x, &y, &width, &height) &&
+             same_solid_color (color_spec, next_spec))
+        {
+          ops[j].n_merged = 0;
+          j++;
+        }
+
+      ops[i].n_merged = j - i - 1;
+    }
+
+  /* never NULL, even when empty, so the list counts as optimized */
+  op_list->compiled = g_new (MetaCompiledOp, MAX (compiled->len, 1));
+  memcpy (op_list->compiled, compiled->data,
+          compiled->len * sizeof (MetaCompiledOp));
+  op_list->n_compiled = compiled->len;
+  op_list->has_clip = has_clip;
+
+  g_array_free (compiled, TRUE);
 }
 
-GdkPixbuf*
-meta_theme_load_image (MetaTheme  *theme,
-                       const char *filename,
-                       guint size_of_theme_icons,
-                       GError    **error)
+static int
+count_draw_ops (const MetaDrawOpList *op_list,
+                gboolean              compiled)
 {
-  GdkPixbuf *pixbuf;
-  int scale;
+  int i, n_ops, count;
 
-  pixbuf = g_hash_table_lookup (theme->images_by_filename,
-                                filename);
+  n_ops = compiled ? op_list->n_compiled : op_list->n_ops;
+  count = 0;
 
-#ifdef WITH_GTK
-  scale = gdk_window_get_scale_factor (gdk_get_default_root_window ());
-#else
-  scale = 1;
-#endif  
-  if (pixbuf == NULL)
+  for (i = 0; i < n_ops; i++)
     {
+      const MetaDrawOp *op;
 
-      if (g_str_has_prefix (filename, "theme:") &&
-          META_THEME_ALLOWS (theme, META_THEME_IMAGES_FROM_ICON_THEMES))
+      if (compiled)
         {
-          pixbuf = gtk_icon_theme_load_icon_for_scale (
-              gtk_icon_theme_get_default (),
-              filename+6,
-              size_of_theme_icons,
-              scale,
-              0,
-              error);
-          if (pixbuf == NULL) return NULL;
-         }
+          op = op_list->compiled[i].op;
+          /* a merged run is filled at once */
+          count -= op_list->compiled[i].n_merged;
+        }
       else
-        {
-          char *full_path;
-          full_path = g_build_filename (theme->dirname, filename, NULL);
+        op = op_list->ops[i];
 
-          gint width, height;
+      if (op->type == META_DRAW_OP_LIST)
+        count += count_draw_ops (op->data.op_list.op_list, compiled);
+      else
+        count++;
+    }
 
-          if (gdk_pixbuf_get_file_info (full_path, &width, &height) == NULL)
-            {
-              g_free (full_path);
-              return NULL;
-            }
+  return count;
+}
+
+static void
+dump_optimized_list (const char           *style_name,
+                     const char           *what,
+                     const MetaDrawOpList *op_list)
+{
+  g_printerr ("marco: style \"%s\" %s: %d draw ops, %d after optimizing\n",
+              style_name, what,
+              count_draw_ops (op_list, FALSE),
+              count_draw_ops (op_list, TRUE));
+}
 
-          width *= scale;
-          height *= scale;
+/**
+ * Prepares the draw op lists of a freshly validated theme for drawing:
+ * includes covering the whole area are inlined, ops that an opaque fill
+ * of the whole piece or button hides are dropped, and adjacent fills of
+ * one colour are marked to be filled at once. The nodes the specs were
+ * compiled to get their scratch values. Set MARCO_DEBUG_DRAW_OPS to see
+ * how many ops each piece and button is left with.
+ */
+void
+meta_theme_optimize (MetaTheme *theme)
+{
+  GHashTableIter iter;
+  gpointer key, value;
+  GHashTable *included;
+  gboolean debug;
+  int i, j;
 
-          pixbuf = gdk_pixbuf_new_from_file_at_size (full_path, width, height, error);
+  debug = g_getenv ("MARCO_DEBUG_DRAW_OPS") != NULL;
+  included = g_hash_table_new (NULL, NULL);
 
-          if (pixbuf == NULL)
-            {
-              g_free (full_path);
-              return NULL;
-            }
+  g_hash_table_iter_init (&iter, theme->styles_by_name);
+  while (g_hash_table_iter_next (&iter, NULL, &value))
+    {
+      MetaFrameStyle *style = value;
+
+      for (i = 0; i < META_FRAME_PIECE_LAST; i++)
+        collect_included_lists (style->pieces[i], included);
+
+      for (i = 0; i < META_BUTTON_TYPE_LAST; i++)
+        for (j = 0; j < META_BUTTON_STATE_LAST; j++)
+          collect_included_lists (style->buttons[i][j], included);
+    }
+
+  g_hash_table_iter_init (&iter, theme->styles_by_name);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    {
+      MetaFrameStyle *style = value;
 
-          g_free (full_path);
+      for (i = 0; i < META_FRAME_PIECE_LAST; i++)
+        {
+          if (style->pieces[i] == NULL)
+            continue;
+
+          optimize_op_list (theme, style->pieces[i], included);
+
+          if (debug)
+            dump_optimized_list (key, meta_frame_piece_to_string (i),
+                                 style->pieces[i]);
         }
-      g_hash_table_replace (theme->images_by_filename,
-                            g_strdup (filename),
-                            pixbuf);
+
+      for (i = 0; i < META_BUTTON_TYPE_LAST; i++)
+        for (j = 0; j < META_BUTTON_STATE_LAST; j++)
+          {
+            char *what;
+
+            if (style->buttons[i][j] == NULL)
+              continue;
+
+            optimize_op_list (theme, style->buttons[i][j], included);
+
+            if (debug)
+              {
+                what = g_strdup_printf ("%s %s",
+                                        meta_button_type_to_string (i),
+                                        meta_button_state_to_string (j));
+                dump_optimized_list (key, what, style->buttons[i][j]);
+                g_free (what);
+              }
+          }
     }
 
-  g_assert (pixbuf);
+  g_hash_table_destroy (included);
 
-  g_object_ref (G_OBJECT (pixbuf));
+  /* every spec is compiled by now */
+  if (theme->spec_nodes)
+    {
+      MetaSpecScratch *scratch = g_new0 (MetaSpecScratch, 1);
 
-  return pixbuf;
+      scratch->n_nodes = theme->spec_nodes->len;
+      scratch->values = g_new (PosExpr, scratch->n_nodes);
+      scratch->stamps = g_new0 (guint, scratch->n_nodes);
+      theme->spec_scratch = scratch;
+
+      g_hash_table_destroy (theme->spec_node_ids);
+      theme->spec_node_ids = NULL;
+
+      if (debug)
+        g_printerr ("marco: theme \"%s\": %d distinct subexpressions\n",
+                    theme->name, scratch->n_nodes);
+    }
 }
 
 static MetaFrameStyle*
@@ -6353,15 +8010,17 @@ meta_theme_draw_frame (MetaTheme              *theme,
                                    fgeom,
                                    theme);
 
-  meta_frame_style_draw_with_style (style,
-                                    style_gtk,
-                                    cr,
-                                    fgeom,
-                                    client_width, client_height,
-                                    title_layout,
-                                    text_height,
-                                    button_states,
-                                    mini_icon, icon);
+  frame_style_draw (style,
+                    style_gtk,
+                    cr,
+                    fgeom,
+                    client_width, client_height,
+                    title_layout,
+                    text_height,
+                    button_states,
+                    mini_icon, icon,
+                    theme,
+                    (state & STATE_RESIZING) != 0);
 }
 
 void
@@ -7562,216 +9221,6 @@ hls_to_rgb (gdouble *h,
     }
 }
 
-#if 0
-/* These are some functions I'm saving to use in optimizing
- * MetaDrawOpList, namely to pre-composite pixbufs on client side
- * prior to rendering to the server
- */
-static void
-draw_bg_solid_composite (const MetaTextureSpec *bg,
-                         const MetaTextureSpec *fg,
-                         double                 alpha,
-                         GtkWidget             *widget,
-                         GdkDrawable           *drawable,
-                         const GdkRectangle    *clip,
-                         MetaTextureDrawMode    mode,
-                         double                 xalign,
-                         double                 yalign,
-                         int                    x,
-                         int                    y,
-                         int                    width,
-                         int                    height)
-{
-  GdkColor bg_color;
-
-  g_assert (bg->type == META_TEXTURE_SOLID);
-  g_assert (fg->type != META_TEXTURE_COMPOSITE);
-  g_assert (fg->type != META_TEXTURE_SHAPE_LIST);
-
-  meta_color_spec_render (bg->data.solid.color_spec,
-                          widget,
-                          &bg_color);
-
-  switch (fg->type)
-    {
-    case META_TEXTURE_SOLID:
-      {
-        GdkColor fg_color;
-
-        meta_color_spec_render (fg->data.solid.color_spec,
-                                widget,
-                                &fg_color);
-
-        color_composite (&bg_color, &fg_color,
-                         alpha, &fg_color);
-
-        draw_color_rectangle (widget, drawable, &fg_color, clip,
-                              x, y, width, height);
-      }
-      break;
-
-    case META_TEXTURE_GRADIENT:
-      /* FIXME I think we could just composite all the colors in
-       * the gradient prior to generating the gradient?
-       */
-      /* FALL THRU */
-    case META_TEXTURE_IMAGE:
-      {
-        GdkPixbuf *pixbuf;
-        GdkPixbuf *composited;
-
-        pixbuf = meta_texture_spec_render (fg, widget, mode, 255,
-                                           width, height);
-
-        if (pixbuf == NULL)
-          return;
-
-        composited = gdk_pixbuf_new (GDK_COLORSPACE_RGB,
-                                     gdk_pixbuf_get_has_alpha (pixbuf), 8,
-                                     gdk_pixbuf_get_width (pixbuf),
-                                     gdk_pixbuf_get_height (pixbuf));
-
-        if (composited == NULL)
-          {
-            g_object_unref (G_OBJECT (pixbuf));
-            return;
-          }
-
-        gdk_pixbuf_composite_color (pixbuf,
-                                    composited,
-                                    0, 0,
-                                    gdk_pixbuf_get_width (pixbuf),
-                                    gdk_pixbuf_get_height (pixbuf),
-                                    0.0, 0.0, /* offsets */
-                                    1.0, 1.0, /* scale */
-                                    GDK_INTERP_BILINEAR,
-                                    255 * alpha,
-                                    0, 0,     /* check offsets */
-                                    0,        /* check size */
-                                    GDK_COLOR_RGB (bg_color),
-                                    GDK_COLOR_RGB (bg_color));
-
-        /* Need to draw background since pixbuf is not
-         * necessarily covering the whole thing
-         */
-        draw_color_rectangle (widget, drawable, &bg_color, clip,
-                              x, y, width, height);
-
-        render_pixbuf_aligned (drawable, clip, composited,
-                               xalign, yalign,
-                               x, y, width, height);
-
-        g_object_unref (G_OBJECT (pixbuf));
-        g_object_unref (G_OBJECT (composited));
-      }
-      break;
-
-    case META_TEXTURE_BLANK:
-    case META_TEXTURE_COMPOSITE:
-    case META_TEXTURE_SHAPE_LIST:
-      g_assert_not_reached ();
-      break;
-    }
-}
-
-static void
-draw_bg_gradient_composite (const MetaTextureSpec *bg,
-                            const MetaTextureSpec *fg,
-                            double                 alpha,
-                            GtkWidget             *widget,
-                            GdkDrawable           *drawable,
-                            const GdkRectangle    *clip,
-                            MetaTextureDrawMode    mode,
-                            double                 xalign,
-                            double                 yalign,
-                            int                    x,
-                            int                    y,
-                            int                    width,
-                            int                    height)
-{
-  g_assert (bg->type == META_TEXTURE_GRADIENT);
-  g_assert (fg->type != META_TEXTURE_COMPOSITE);
-  g_assert (fg->type != META_TEXTURE_SHAPE_LIST);
-
-  switch (fg->type)
-    {
-    case META_TEXTURE_SOLID:
-    case META_TEXTURE_GRADIENT:
-    case META_TEXTURE_IMAGE:
-      {
-        GdkPixbuf *bg_pixbuf;
-        GdkPixbuf *fg_pixbuf;
-        GdkPixbuf *composited;
-        int fg_width, fg_height;
-
-        bg_pixbuf = meta_texture_spec_render (bg, widget, mode, 255,
-                                              width, height);
-
-        if (bg_pixbuf == NULL)
-          return;
-
-        fg_pixbuf = meta_texture_spec_render (fg, widget, mode, 255,
-                                              width, height);
-
-        if (fg_pixbuf == NULL)
-          {
-            g_object_unref (G_OBJECT (bg_pixbuf));
-            return;
-          }
-
-        /* gradients always fill the entire target area */
-        g_assert (gdk_pixbuf_get_width (bg_pixbuf) == width);
-        g_assert (gdk_pixbuf_get_height (bg_pixbuf) == height);
-
-        composited = gdk_pixbuf_new (GDK_COLORSPACE_RGB,
-                                     gdk_pixbuf_get_has_alpha (bg_pixbuf), 8,
-                                     gdk_pixbuf_get_width (bg_pixbuf),
-                                     gdk_pixbuf_get_height (bg_pixbuf));
-
-        if (composited == NULL)
-          {
-            g_object_unref (G_OBJECT (bg_pixbuf));
-            g_object_unref (G_OBJECT (fg_pixbuf));
-            return;
-          }
-
-        fg_width = gdk_pixbuf_get_width (fg_pixbuf);
-        fg_height = gdk_pixbuf_get_height (fg_pixbuf);
-
-        /* If we wanted to be all cool we could deal with the
-         * offsets and try to composite only in the clip rectangle,
-         * but I just don't care enough to figure it out.
-         */
-
-        gdk_pixbuf_composite (fg_pixbuf,
-                              composited,
-                              x + (width - fg_width) * xalign,
-                              y + (height - fg_height) * yalign,
-                              gdk_pixbuf_get_width (fg_pixbuf),
-                              gdk_pixbuf_get_height (fg_pixbuf),
-                              0.0, 0.0, /* offsets */
-                              1.0, 1.0, /* scale */
-                              GDK_INTERP_BILINEAR,
-                              255 * alpha);
-
-        gdk_cairo_set_source_pixbuf (cr, composited, x, y);
-        cairo_paint (cr);
-
-        g_object_unref (G_OBJECT (bg_pixbuf));
-        g_object_unref (G_OBJECT (fg_pixbuf));
-        g_object_unref (G_OBJECT (composited));
-      }
-      break;
-
-    case META_TEXTURE_BLANK:
-    case META_TEXTURE_SHAPE_LIST:
-    case META_TEXTURE_COMPOSITE:
-      g_assert_not_reached ();
-      break;
-    }
-}
-#endif
-
 /**
  * Returns the earliest version of the theme format which required support
  * for a particular button.  (For example, "shade" first appeared in v2, and
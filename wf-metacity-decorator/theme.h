@@ -27,6 +27,8 @@
 
 #include "boxes.h"
 #include "gradient.h"
+#include "theme-cache.h"
+#include "surface-cache.h"
 #include "common.h"
 #include <gtk/gtk.h>
 
@@ -43,6 +45,8 @@ typedef struct _MetaFrameGeometry MetaFrameGeometry;
 typedef struct _MetaTheme MetaTheme;
 typedef struct _MetaPositionExprEnv MetaPositionExprEnv;
 typedef struct _MetaDrawInfo MetaDrawInfo;
+typedef struct _MetaThemeImage MetaThemeImage;
+typedef struct _MetaSpecScratch MetaSpecScratch;
 
 
 #define BORDERS_DELTA 5
@@ -50,6 +54,8 @@ static uint32_t STATE_FOCUSED   = 1;
 static uint32_t STATE_MAXIMIZED = 2;
 static uint32_t STATE_STICKY    = 4;
 static uint32_t STATE_SHADED    = 8;
+/* the plugin sees the view being resized, frames are drafts */
+static uint32_t STATE_RESIZING  = 16;
 
 #define META_THEME_ERROR (g_quark_from_static_string ("meta-theme-error"))
 
@@ -237,6 +243,64 @@ typedef enum
   META_IMAGE_FILL_TILE
 } MetaImageFillType;
 
+typedef enum
+{
+  META_THEME_IMAGE_PENDING,  /* not decoded, nobody asked for it yet */
+  META_THEME_IMAGE_QUEUED,   /* waiting for a decoder thread */
+  META_THEME_IMAGE_DECODING,
+  META_THEME_IMAGE_READY,
+  META_THEME_IMAGE_FAILED
+} MetaThemeImageState;
+
+/**
+ * How many colorized copies of an image a draw op keeps. Frames usually
+ * colorize with one colour when focused and another when not, and all
+ * windows share the op, so a couple of entries cover the common case.
+ */
+#define META_COLORIZE_CACHE_SIZE 4
+
+typedef struct
+{
+  guint32 pixel;
+  GdkPixbuf *pixbuf;
+} MetaColorizeCacheEntry;
+
+/**
+ * An image used by a theme.
+ *
+ * The parser only resolves the file name. The pixels are decoded after
+ * parsing, on a pool of threads for the images the common frame states
+ * use, and on first use for the rest. Always go through
+ * meta_theme_image_get_pixbuf(), which waits for or runs the decode.
+ */
+struct _MetaThemeImage
+{
+  /** Reference count, changed atomically as decoder threads hold one. */
+  int refcount;
+  /** Name as it appears in the theme. */
+  char *filename;
+  /** Path of the file to decode, NULL for images from the icon theme. */
+  char *full_path;
+  /** Factor the natural size of the image is multiplied by. */
+  int scale;
+  /** Size requested from the icon theme, for images from there. */
+  int icon_size;
+
+  /** Protects state and pixbuf while the image is being decoded. */
+  GMutex lock;
+  GCond cond;
+  MetaThemeImageState state;
+  GdkPixbuf *pixbuf;
+  /** The pixbuf converted for cairo, made on the main thread when first drawn. */
+  cairo_surface_t *surface;
+
+  /** Every row, respectively column, has the same colour throughout. */
+  unsigned int vertical_stripes : 1;
+  unsigned int horizontal_stripes : 1;
+  /** Pixels came from, or already went to, the on-disk cache. */
+  unsigned int cached : 1;
+};
+
 typedef enum
 {
   META_COLOR_SPEC_BASIC,
@@ -262,6 +326,11 @@ typedef enum
 struct _MetaColorSpec
 {
   MetaColorSpecType type;
+  /* slot of the resolved colour in the palette, see
+   * meta_color_palette_update(); must stay ahead of the union since
+   * specs are allocated only as large as the member they use
+   */
+  int index;
   union
   {
     struct {
@@ -310,6 +379,14 @@ struct _MetaDrawInfo
   int title_layout_width;
   int title_layout_height;
   const MetaFrameGeometry *fgeom;
+  /* the theme drawn, whose spec nodes and images the ops use; NULL for
+   * the current theme
+   */
+  MetaTheme *theme;
+  /* the size is changing: images are stretched instead of rescaled and
+   * nothing is antialiased, a full frame follows once the size settles
+   */
+  gboolean draft;
 };
 
 /**
@@ -426,6 +503,16 @@ typedef struct _MetaDrawSpec
   /** How many tokens are in the tokens list. */
   int n_tokens;
 
+  /**
+   * Root of the expression among the theme's spec nodes, where the
+   * subexpressions it shares with other specs are evaluated once per
+   * env; -1 if the tokens are evaluated instead.
+   */
+  int node;
+
+  /** The theme whose spec nodes node is an index into */
+  MetaTheme *theme;
+
   /** Does the expression contain any variables? */
   gboolean constant : 1;
 } MetaDrawSpec;
@@ -499,17 +586,15 @@ struct _MetaDrawOp
     struct {
       MetaColorSpec *colorize_spec;
       MetaAlphaGradientSpec *alpha_spec;
-      GdkPixbuf *pixbuf;
+      MetaThemeImage *image;
       MetaDrawSpec *x;
       MetaDrawSpec *y;
       MetaDrawSpec *width;
       MetaDrawSpec *height;
 
-      guint32 colorize_cache_pixel;
-      GdkPixbuf *colorize_cache_pixbuf;
+      /* most recently used first, empty slots have a NULL pixbuf */
+      MetaColorizeCacheEntry colorize_cache[META_COLORIZE_CACHE_SIZE];
       MetaImageFillType fill_type;
-      unsigned int vertical_stripes : 1;
-      unsigned int horizontal_stripes : 1;
     } image;
 
     struct {
@@ -579,6 +664,19 @@ struct _MetaDrawOp
   } data;
 };
 
+/**
+ * An op as drawn after meta_theme_optimize(). The op may come from an
+ * included list.
+ */
+typedef struct
+{
+  MetaDrawOp *op;
+  /* how many of the following solid fills are filled along with this
+   * one, they all share its colour
+   */
+  int n_merged;
+} MetaCompiledOp;
+
 /**
  * A list of MetaDrawOp objects. Maintains a reference count.
  * Grows as necessary and allows the allocation of unused spaces
@@ -593,6 +691,14 @@ struct _MetaDrawOpList
   MetaDrawOp **ops;
   int n_ops;
   int n_allocated;
+
+  /* what is actually drawn once the theme has been optimized; NULL
+   * until then, in which case ops is drawn as it is
+   */
+  MetaCompiledOp *compiled;
+  int n_compiled;
+  /* whether a clip op is drawn, which needs the state saved */
+  gboolean has_clip;
 };
 
 typedef enum
@@ -828,12 +934,25 @@ struct _MetaTheme
    * */
   GHashTable *color_constants;
   GHashTable *images_by_filename;
+  /** Decoded images from the previous run, NULL until the first image is loaded */
+  MetaThemeCache *image_cache;
+  /** Images as last drawn at a given size, colour and alpha */
+  MetaSurfaceCache *image_variants;
+  /** Gradients as last drawn at a given size and in given colours */
+  MetaSurfaceCache *gradient_surfaces;
   GHashTable *layouts_by_name;
   GHashTable *draw_op_lists_by_name;
   GHashTable *styles_by_name;
   GHashTable *style_sets_by_name;
   MetaFrameStyleSet *style_sets_by_type[META_FRAME_TYPE_LAST];
 
+  /** The expressions of all draw specs, common subexpressions shared */
+  GArray *spec_nodes;
+  /** Finds a node by its contents while the theme loads */
+  GHashTable *spec_node_ids;
+  /** The node values of the env being drawn, once the theme is optimized */
+  MetaSpecScratch *spec_scratch;
+
   GQuark quark_width;
   GQuark quark_height;
   GQuark quark_object_width;
@@ -873,6 +992,8 @@ struct _MetaPositionExprEnv
   int icon_height;
   /* Theme so we can look up constants */
   MetaTheme *theme;
+  /* which of the theme's spec node values were computed for this env */
+  guint spec_stamp;
 };
 
 MetaFrameLayout* meta_frame_layout_new           (void);
@@ -919,6 +1040,7 @@ void           meta_color_spec_free            (MetaColorSpec     *spec);
 void           meta_color_spec_render          (MetaColorSpec     *spec,
                                                 GtkStyleContext   *style_gtk,
                                                 GdkRGBA           *color);
+void           meta_color_palette_update       (GtkStyleContext   *style_gtk);
 
 MetaDrawOp*    meta_draw_op_new  (MetaDrawType        type);
 void           meta_draw_op_free (MetaDrawOp          *op);
@@ -962,6 +1084,7 @@ void              meta_gradient_spec_render (const MetaGradientSpec      *spec,
                                              const MetaAlphaGradientSpec *alpha_spec,
                                              cairo_t                     *cr,
                                              GtkStyleContext             *context,
+                                             MetaSurfaceCache            *cache,
                                              gint                         x,
                                              gint                         y,
                                              gint                         width,
@@ -1016,15 +1139,24 @@ gboolean       meta_frame_style_set_validate  (MetaFrameStyleSet *style_set,
 MetaTheme* meta_theme_get_current (void);
 void       meta_theme_set_current (const char *name,
                                    gboolean    force_reload);
+void       meta_theme_replace_current (MetaTheme *theme);
 
 MetaTheme* meta_theme_new      (void);
 void       meta_theme_free     (MetaTheme *theme);
 gboolean   meta_theme_validate (MetaTheme *theme,
                                 GError   **error);
-GdkPixbuf* meta_theme_load_image (MetaTheme  *theme,
-                                  const char *filename,
-                                  guint       size_of_theme_icons,
-                                  GError    **error);
+MetaThemeImage* meta_theme_load_image (MetaTheme  *theme,
+                                       const char *filename,
+                                       guint       size_of_theme_icons,
+                                       GError    **error);
+void       meta_theme_load_images (MetaTheme *theme);
+void       meta_theme_save_image_cache (MetaTheme *theme);
+void       meta_theme_optimize    (MetaTheme *theme);
+
+MetaThemeImage*  meta_theme_image_ref         (MetaThemeImage *image);
+void             meta_theme_image_unref       (MetaThemeImage *image);
+GdkPixbuf*       meta_theme_image_get_pixbuf  (MetaThemeImage *image);
+cairo_surface_t* meta_theme_image_get_surface (MetaThemeImage *image);
 
 MetaFrameStyle* meta_theme_get_frame_style (MetaTheme     *theme,
                                             MetaFrameType  type,
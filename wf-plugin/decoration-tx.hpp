@@ -0,0 +1,172 @@
+#pragma once
+
+/*
+ * The transaction state machine of a decoration.
+ *
+ * A transaction resizing a decorated view resizes its decoration too: the
+ * decoration surface is configured to the size the decorated toplevel is
+ * asked for, and then to the size the toplevel really takes, and the
+ * transaction can apply only once the decoration client has committed a
+ * frame of that final size.
+ *
+ * Nothing here knows about wlroots or wayfire: extern_decoration_object_t
+ * feeds in what happens to the two surfaces and gets the requests back
+ * through decoration_tx_host_t, so the machine can be driven by anything
+ * else as well.
+ */
+
+struct deco_size_t
+{
+    int width = 0;
+    int height = 0;
+
+    bool operator==(const deco_size_t& other) const
+    {
+        return width == other.width && height == other.height;
+    }
+
+    bool operator!=(const deco_size_t& other) const
+    {
+        return !(*this == other);
+    }
+};
+
+enum class deco_tx_state_t
+{
+    // No transactions in flight
+    STABLE,
+    // Transaction has just started
+    START,
+    // The decoration client has ACKed our initial size request. However, the decorated toplevel's client
+    // has not ACKed the request yet, so we do not know the actual 'final' size of the client.
+    TENTATIVE,
+    // Decorated toplevel has set its final size, waiting for the decoration to respond.
+    WAITING_FINAL,
+};
+
+class decoration_tx_host_t
+{
+  public:
+    virtual ~decoration_tx_host_t() = default;
+
+    // configure the decoration surface to this size
+    virtual void request_size(deco_size_t size) = 0;
+    // the decoration is done with the transaction
+    virtual void ready() = 0;
+    virtual void state_changed(deco_tx_state_t) {}
+};
+
+class decoration_tx_t
+{
+    decoration_tx_host_t& host;
+    deco_tx_state_t state = deco_tx_state_t::STABLE;
+    // the size the decoration surface was last configured to
+    deco_size_t committed;
+
+    void set_state(deco_tx_state_t new_state)
+    {
+        state = new_state;
+        host.state_changed(new_state);
+    }
+
+  public:
+
+    explicit decoration_tx_t(decoration_tx_host_t& host) : host(host)
+    {}
+
+    deco_tx_state_t get_state() const
+    {
+        return state;
+    }
+
+    // the transaction commits, pending is the size asked to the decorated
+    // toplevel and current the one of the decoration surface
+    void commit(deco_size_t pending, deco_size_t current)
+    {
+        set_state(deco_tx_state_t::START);
+        committed = pending;
+        if (current == pending)
+        {
+            // nothing to wait for, the decoration keeps its size
+            set_state(deco_tx_state_t::STABLE);
+            host.ready();
+            return;
+        }
+
+        host.request_size(pending);
+    }
+
+    // the decorated toplevel has committed the size it took
+    void set_final_size(deco_size_t final)
+    {
+        if (committed == final)
+        {
+            switch (state)
+            {
+            case deco_tx_state_t::STABLE:
+                return;
+
+            case deco_tx_state_t::START:
+                set_state(deco_tx_state_t::WAITING_FINAL);
+                break;
+
+            case deco_tx_state_t::WAITING_FINAL:
+                break;
+
+            case deco_tx_state_t::TENTATIVE:
+                set_state(deco_tx_state_t::STABLE);
+                host.ready();
+                break;
+            }
+
+            return;
+        }
+
+        committed = final;
+        host.request_size(final);
+        set_state(deco_tx_state_t::WAITING_FINAL);
+    }
+
+    // the decoration surface has committed a frame of this size; a stale
+    // frame, drawn before the client knew what it was for, doesn't count.
+    // Returns whether it is a frame of the configured size
+    bool surface_committed(deco_size_t size, bool current_frame = true)
+    {
+        if (size != committed || !current_frame)
+        {
+            return false;
+        }
+
+        switch (state)
+        {
+        case deco_tx_state_t::STABLE:
+            // Client simply committed, nothing has changed
+            break;
+
+        case deco_tx_state_t::TENTATIVE:
+            // Client commits twice?
+            break;
+
+        case deco_tx_state_t::START:
+            set_state(deco_tx_state_t::TENTATIVE);
+            break;
+
+        case deco_tx_state_t::WAITING_FINAL:
+            set_state(deco_tx_state_t::STABLE);
+            host.ready();
+            break;
+        }
+
+        return true;
+    }
+
+    // the decoration surface is gone, the transaction must not wait for it
+    void destroyed()
+    {
+        if (state != deco_tx_state_t::STABLE)
+        {
+            set_state(deco_tx_state_t::STABLE);
+            host.ready();
+        }
+    }
+};
@@ -14,10 +14,16 @@
 //   main view does not obey the compositor-requested size: in those cases, the decoration needs to be resized
 //   again to the final size of the main view.
 
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <functional>
 #include <map>
 #include <iostream>
+#include <iterator>
 #include <linux/input-event-codes.h>
 #include <memory>
+#include <signal.h>
 #include <wayfire/core.hpp>
 #include <wayfire/geometry.hpp>
 #include <wayfire/nonstd/wlroots-full.hpp>
@@ -49,6 +55,15 @@
 #include <wayfire/unstable/wlr-view-events.hpp>
 #include <wayfire/unstable/translation-node.hpp>
 #include "nonstd.hpp"
+#include "decoration-tx.hpp"
+
+#define DECO_LOG_STREAM(level, ...) \
+    LOG((level) == DECO_LOG_ERROR ? wf::log::LOG_LEVEL_ERROR : \
+        (level) == DECO_LOG_WARN ? wf::log::LOG_LEVEL_WARN : \
+        (level) == DECO_LOG_INFO ? wf::log::LOG_LEVEL_INFO : wf::log::LOG_LEVEL_DEBUG, __VA_ARGS__)
+#include "log.hpp"
+#include "trace.h"
+#include "hit-map.h"
 
 #define PRIV_COMMIT "_gtk3-deco-priv-commit"
 
@@ -61,6 +76,18 @@ static constexpr uint32_t STATE_FOCUSED   = 1;
 static constexpr uint32_t STATE_MAXIMIZED = 2;
 static constexpr uint32_t STATE_STICKY    = 4;
 static constexpr uint32_t STATE_SHADED    = 8;
+// the view is being resized interactively, the decorator draws drafts meanwhile
+static constexpr uint32_t STATE_RESIZING  = 16;
+
+// sizes committed closer than this are an interactive resize
+static constexpr uint32_t resize_interval = 100;
+// and it is over once the size hasn't changed for this long
+static constexpr int resize_settle = 200;
+// how long the views present wait for all the decorators to bind, before being spread
+// over those there
+static constexpr auto decorator_bind_timeout = std::chrono::seconds(2);
+// seconds the decorators have to quit on SIGTERM before they are killed
+static constexpr int decorator_stop_timeout = 1;
 
 static int got_borders = 0;
 
@@ -73,7 +100,11 @@ static wf::decoration_margins_t deco_margins =
 };
 static int borders_delta;
 
-wl_resource *decorator_resource = NULL;
+// one slot per decorator process spawned, views are spread over them, see decorator_for_view;
+// a slot is NULL until its process binds and once it is gone
+static std::vector<wl_resource*> decorator_resources;
+// set by the plugin, gives the views of a decorator process gone a decoration from another
+static std::function<void()> decorator_gone;
 static void handle_activated_state();
 
 std::ostream &operator<<(std::ostream &out, const wf::dimensions_t &dims)
@@ -89,6 +120,8 @@ class extern_decoration_node_t : public wf::scene::wlr_surface_node_t
     uint32_t state = 0;
 
     wf::wl_timer<false> refresh_timer;
+    wf::wl_timer<false> resize_timer;
+    uint32_t last_resize = 0;
     bool shaded;
     std::shared_ptr<wf::scene::node_t> main_node;
     wf::geometry_t size;
@@ -97,19 +130,40 @@ class extern_decoration_node_t : public wf::scene::wlr_surface_node_t
     int is_grabbed = 0;
     int view_id;
     std::weak_ptr<wf::toplevel_view_interface_t> _view;
+    // the decorator process drawing this decoration, NULL once it is gone
+    wl_resource *resource;
+
+    // clears resource as the decorator goes away, a pointer to a resource freed may be
+    // reused by the next one
+    struct decorator_watch_t
+    {
+        wl_listener listener;
+        extern_decoration_node_t *node;
+    } decorator_watch;
+
+    static void decorator_destroyed(wl_listener *listener, void *)
+    {
+        decorator_watch_t *watch = wl_container_of(listener, watch, listener);
+        wl_list_remove(&listener->link);
+        watch->node->resource = NULL;
+    }
     
-    extern_decoration_node_t (wlr_surface *v, bool b, wayfire_toplevel_view view) : wlr_surface_node_t(v,b)  //, node_t(false)
+    extern_decoration_node_t (wlr_surface *v, bool b, wayfire_toplevel_view view, wl_resource *resource) :
+        wlr_surface_node_t(v,b), resource(resource)  //, node_t(false)
     {
+        decorator_watch.node = this;
+        decorator_watch.listener.notify = decorator_destroyed;
+        if (resource)
+            wl_resource_add_destroy_listener(resource, &decorator_watch.listener);
         this->_view = view->weak_from_this();
         view_id = view->get_id();
         state = STATE_FOCUSED;
         if(view->pending_tiled_edges())
         {
             state |= STATE_MAXIMIZED;
-            LOGI("extern_decoration_node_t " , state);
+            DSLOGT("extern_decoration_node_t " , state);
         }
-        if (decorator_resource)
-            wf_decorator_manager_send_view_state_changed(decorator_resource, view_id, state);
+        send_state();
         view->connect(&on_activated);
         view->connect(&on_tiled);
         view->connect(&sticky_changed);
@@ -117,54 +171,271 @@ class extern_decoration_node_t : public wf::scene::wlr_surface_node_t
 
     ~extern_decoration_node_t ()
     {
-        LOGI("extern_decoration_node_t deleted");
+        DSLOGD("extern_decoration_node_t deleted");
+        if (resource)
+            wl_list_remove(&decorator_watch.listener.link);
     }
     
     wf::signal::connection_t<wf::view_activated_state_signal> on_activated = [=] (auto)
     {
-        if (decorator_resource)
+        DECO_TRACE_SCOPE("focus", "view activated");
+        if (resource)
         {
             handle_activated_state();
             state |= STATE_FOCUSED;
-            wf_decorator_manager_send_view_state_changed(decorator_resource, view_id, state);
+            send_state();
         }
     };
     
     wf::signal::connection_t<wf::view_tiled_signal> on_tiled = 
         [=] (wf::view_tiled_signal *ev)
     {
-        LOGI("Maximized changed ", ev->old_edges," ", ev->new_edges);
-        if (decorator_resource)
+        DSLOGD("Maximized changed ", ev->old_edges," ", ev->new_edges);
+        if (resource)
         {
             if (ev->new_edges == 0)
                 state &= ~STATE_MAXIMIZED;
             else
                 state |= STATE_MAXIMIZED;
-            wf_decorator_manager_send_view_state_changed(decorator_resource, view_id, state);
+            // the transaction resizing the view brings it along with the new size
+            if (!supports_hints())
+                send_state();
         }          
     };
     
     wf::signal::connection_t<wf::view_set_sticky_signal> sticky_changed =
         [=](wf::view_set_sticky_signal *ev)
     {
-        if (decorator_resource)
+        if (resource)
         {
             if (ev->view->sticky)
                 state |= STATE_STICKY;
             else
                 state &= ~STATE_STICKY;
-            wf_decorator_manager_send_view_state_changed(decorator_resource, view_id, state);
+            send_state();
         }          
     };
+
+    // the state the decorator knows about, sent alone or with a configure_hint
+    uint32_t sent_state = 0;
+    uint32_t hint_serial = 0;
+    uint32_t acked_serial = 0;
+
+    void send_state()
+    {
+        if (!resource)
+            return;
+        wf_decorator_manager_send_view_state_changed(resource, view_id, state);
+        sent_state = state;
+    }
+
+    bool supports_hints()
+    {
+        return resource &&
+            wl_resource_get_version(resource) >= WF_DECORATOR_MANAGER_CONFIGURE_HINT_SINCE_VERSION;
+    }
+
+    // tell the decorator the size and state of its next frame, returns
+    // false if it is too old to ack it
+    bool send_configure_hint(wf::dimensions_t size)
+    {
+        if (!supports_hints())
+            return false;
+        hint_serial++;
+        wf_decorator_manager_send_configure_hint(resource, view_id, hint_serial, size.width, size.height, state);
+        sent_state = state;
+        return true;
+    }
+
+    // the commits of the decoration surface before the ack of the last hint
+    // are stale frames, drawn with the old state or not drawn at all; a
+    // decorator without ack_configure_hint is never waited for
+    bool hint_acked()
+    {
+        if (!supports_hints())
+            return true;
+        // an ack of the newest hint or of a later one, serials may wrap
+        return (int32_t)(acked_serial - hint_serial) >= 0;
+    }
+
+    // called for every size change: the second one in a short while, or an
+    // interactive resize, sets STATE_RESIZING until the size settles
+    void size_changing(bool interactive = false)
+    {
+        uint32_t now = wf::get_current_time();
+        bool fast = now - last_resize < resize_interval;
+        last_resize = now;
+        if (!resource || !(interactive || fast || (state & STATE_RESIZING)))
+            return;
+
+        if (!(state & STATE_RESIZING))
+        {
+            state |= STATE_RESIZING;
+            // a size change is followed by a configure_hint carrying it
+            if (interactive || !supports_hints())
+                send_state();
+        }
+        resize_timer.set_timeout(resize_settle, [=] ()
+        {
+            state &= ~STATE_RESIZING;
+            send_state();
+        });
+    }
   
     wf::point_t get_offset() 
     {
         return { 0, 0 };
     }
     
+    // published by the client, until then all the pointer events go to it
+    std::vector<DecoHitRegion> hit_map;
+
+    const DecoHitRegion *hit_test(wf::pointf_t at) const
+    {
+        for (const auto& r : hit_map)
+        {
+            if (at.x >= r.x && at.x < r.x + r.width && at.y >= r.y && at.y < r.y + r.height)
+                return &r;
+        }
+        return nullptr;
+    }
+
+    /*
+     * Pointer handling driven by the hit map: the cursor is set here and
+     * moves and resizes start here, the client gets the pointer focus only
+     * over its buttons, and one motion event for each button entered.
+     * While a button pressed there is held everything goes to the client.
+     * Presses other than the left one elsewhere, e.g. a right click on the
+     * title bar for the window menu, go to the client too.
+     */
+    class hit_map_interaction_t : public wf::pointer_interaction_t
+    {
+        extern_decoration_node_t *self;
+        bool client_focus = false;
+        bool grabbed = false;
+        bool has_current = false;
+        DecoHitRegion current;
+        wf::pointf_t last_at;
+
+        wf::pointer_interaction_t& client()
+        {
+            return self->wlr_surface_node_t::pointer_interaction();
+        }
+
+        void update_region(wf::pointf_t at, uint32_t time_ms)
+        {
+            const DecoHitRegion *hit = self->hit_test(at);
+            if (hit && has_current && memcmp(hit, &current, sizeof(current)) == 0)
+                return;
+            has_current = hit != nullptr;
+            if (hit)
+                current = *hit;
+
+            if (hit && hit->type == DECO_HIT_BUTTON)
+            {
+                if (!client_focus)
+                {
+                    client_focus = true;
+                    client().handle_pointer_enter(at);
+                }
+                client().handle_pointer_motion(at, time_ms);
+                return;
+            }
+
+            if (client_focus)
+            {
+                client_focus = false;
+                client().handle_pointer_leave();
+            }
+            wf::get_core().set_cursor(hit && hit->type == DECO_HIT_RESIZE ?
+                wlr_xcursor_get_resize_name((wlr_edges)hit->detail) : "default");
+        }
+
+    public:
+
+        hit_map_interaction_t(extern_decoration_node_t *self) : self(self)
+        {}
+
+        void handle_pointer_enter(wf::pointf_t at) override
+        {
+            last_at = at;
+            if (self->hit_map.empty())
+            {
+                client_focus = true;
+                client().handle_pointer_enter(at);
+                return;
+            }
+            update_region(at, wf::get_current_time());
+        }
+
+        void handle_pointer_motion(wf::pointf_t at, uint32_t time_ms) override
+        {
+            last_at = at;
+            if (self->hit_map.empty() || grabbed)
+            {
+                if (client_focus)
+                    client().handle_pointer_motion(at, time_ms);
+                return;
+            }
+            update_region(at, time_ms);
+        }
+
+        void handle_pointer_button(const wlr_pointer_button_event& ev) override
+        {
+            bool pressed = ev.state == WLR_BUTTON_PRESSED;
+            // the client gets the press and, grabbed, the release
+            if (!client_focus && pressed && ev.button != BTN_LEFT && has_current)
+            {
+                client_focus = true;
+                client().handle_pointer_enter(last_at);
+            }
+            if (client_focus)
+            {
+                grabbed = pressed;
+                // look again at the next motion, the pointer may have left the button
+                has_current = false;
+                client().handle_pointer_button(ev);
+                // without a motion to come, give the focus back where it isn't the client's
+                if (!pressed && !self->hit_map.empty())
+                    update_region(last_at, ev.time_msec);
+                return;
+            }
+            if (!pressed || ev.button != BTN_LEFT || !has_current)
+                return;
+
+            auto view = self->_view.lock();
+            if (!view)
+                return;
+            if (current.type == DECO_HIT_RESIZE)
+            {
+                self->size_changing(true);
+                wf::get_core().default_wm->resize_request(view, current.detail);
+            }
+            else if (current.type == DECO_HIT_MOVE)
+                wf::get_core().default_wm->move_request(view);
+        }
+
+        void handle_pointer_leave() override
+        {
+            if (client_focus)
+                client().handle_pointer_leave();
+            client_focus = grabbed = has_current = false;
+        }
+    };
+
+    std::unique_ptr<hit_map_interaction_t> hit_interaction = std::make_unique<hit_map_interaction_t>(this);
+
+    wf::pointer_interaction_t& pointer_interaction() override
+    {
+        return *hit_interaction;
+    }
+
     std::optional<wf::scene::input_node_t> find_node_at(const wf::pointf_t& at) override 
     {
         wf::pointf_t local = at - wf::pointf_t{get_offset()};
+        // outside every region of the hit map the pointer goes through
+        if (!hit_map.empty() && !hit_test(local))
+            return {};
         return wf::scene::input_node_t{
             .node = this,
             .local_coords = local,
@@ -175,8 +446,55 @@ class extern_decoration_node_t : public wf::scene::wlr_surface_node_t
 
 };  // extern_decoration_node_t
 
+// the decoration of each view, which also knows the decorator process drawing it
 static std::map<uint32_t, std::shared_ptr<extern_decoration_node_t>> view_to_decor;
 
+static bool decorators_bound()
+{
+    return std::find(decorator_resources.begin(), decorator_resources.end(), nullptr) ==
+        decorator_resources.end();
+}
+
+// the process drawing the decoration of a view: the one which created it or,
+// before that, the slot picked by hashing the view id; the slots don't move, so
+// neither do the views, and those of a slot without its process go to the others
+static wl_resource *decorator_for_view(uint32_t view_id)
+{
+    auto it = view_to_decor.find(view_id);
+    if (it != view_to_decor.end())
+        return it->second->resource;
+    if (decorator_resources.empty())
+        return NULL;
+    uint32_t hash = view_id * 2654435761u >> 16;
+    if (auto resource = decorator_resources[hash % decorator_resources.size()])
+        return resource;
+
+    std::vector<wl_resource*> bound;
+    std::copy_if(decorator_resources.begin(), decorator_resources.end(), std::back_inserter(bound),
+        [] (wl_resource *resource) { return resource != nullptr; });
+    if (bound.empty())
+        return NULL;
+    return bound[hash % bound.size()];
+}
+
+// trace counters of how many views are decorated and of the memory of the
+// decorator drawing them, if still there, to follow both as the number of views grows
+static void trace_decorations(wl_resource *resource)
+{
+    if (!deco_trace_enabled)
+        return;
+    DECO_TRACE_COUNTER("decorations", "decorated views", 0, (int64_t)view_to_decor.size());
+    if (!resource)
+        return;
+
+    pid_t pid;
+    wl_client_get_credentials(wl_resource_get_client(resource), &pid, NULL, NULL);
+    std::ifstream statm("/proc/" + std::to_string(pid) + "/statm");
+    long size, resident;
+    if (statm >> size >> resident)
+        DECO_TRACE_COUNTER("decorations", "decorator resident kB", pid, resident * (sysconf(_SC_PAGESIZE) / 1024));
+}
+
 // reset all decorations activated state
 static void handle_activated_state()
 {
@@ -195,6 +513,8 @@ public:
     // The 'allowed' portion of the children
     wf::region_t allowed;
     int view_id;
+    // the decoration masked, the view may have another one by now
+    std::weak_ptr<extern_decoration_node_t> deco;
     
     extern_mask_node_t() : floating_inner_node_t(false)
     {
@@ -202,10 +522,17 @@ public:
     
     ~extern_mask_node_t()
     {
-        LOGI("extern_mask_node_t deleted");
-        view_to_decor.erase(view_id);
-        wf_decorator_manager_send_view_unmapped(decorator_resource, view_id);
-        LOGI("view_to_decor ", view_to_decor.size());
+        DSLOGD("extern_mask_node_t deleted");
+        auto it = view_to_decor.find(view_id);
+        auto node = deco.lock();
+        if (it == view_to_decor.end() || !node || it->second != node)
+            return;
+        wl_resource *resource = node->resource;
+        view_to_decor.erase(it);
+        if (resource)
+            wf_decorator_manager_send_view_unmapped(resource, view_id);
+        trace_decorations(resource);
+        DSLOGD("view_to_decor ", view_to_decor.size());
     }
     
     std::optional<wf::scene::input_node_t> find_node_at(const wf::pointf_t &at) override
@@ -274,21 +601,13 @@ public:
     
 }; // extern_mask_node_t
 
-class extern_decoration_object_t : public wf::txn::transaction_object_t
+static deco_size_t to_deco_size(wf::dimensions_t dims)
+{
+    return {dims.width, dims.height};
+}
+
+class extern_decoration_object_t : public wf::txn::transaction_object_t, public decoration_tx_host_t
 {
-    enum class gtk3_decoration_tx_state
-    {
-        // No transactions in flight
-        STABLE,
-        // Transaction has just started
-        START,
-        // The decoration client has ACKed our initial size request. However, the decorated toplevel's client
-        // has not ACKed the request yet, so we do not know the actual 'final' size of the client.
-        TENTATIVE,
-        // Decorated toplevel has set its final size, waiting for the decoration to respond.
-        WAITING_FINAL,
-    };
-    
 public:
 
     std::string stringify() const
@@ -298,49 +617,13 @@ public:
         return out.str();
     }
 
-    void set_pending_size(wf::dimensions_t desired)
-    {
-        if (!toplevel)
-        {
-            return;
-        }
-        this->pending = desired;
-    }
-
     void set_final_size(wf::dimensions_t final)
     {
         if (!toplevel)
         {
             return;
         }
-
-        if (this->committed == final)
-        {
-            switch (this->deco_state)
-            {
-            case gtk3_decoration_tx_state::STABLE:
-                return;
-
-            case gtk3_decoration_tx_state::START:
-                this->deco_state = gtk3_decoration_tx_state::WAITING_FINAL;
-                break;
-
-            case gtk3_decoration_tx_state::WAITING_FINAL:
-                break;
-
-            case gtk3_decoration_tx_state::TENTATIVE:
-                // fallthrough
-                this->deco_state = gtk3_decoration_tx_state::STABLE;
-                wf::txn::emit_object_ready(this);
-                break;
-            }
-
-            return;
-        }
-
-        this->committed = final;
-        wlr_xdg_toplevel_set_size(toplevel, final.width, final.height);
-        this->deco_state = gtk3_decoration_tx_state::WAITING_FINAL;
+        tx.set_final_size(to_deco_size(final));
     }
 
     void size_updated()
@@ -348,68 +631,83 @@ public:
         wlr_box box;
         wlr_xdg_surface_get_geometry(toplevel->base, &box);
 
-        if (wf::dimensions(box) != committed) 
+        // a frame of the right size, but drawn before the decorator knew the state, is stale
+        auto node = deco_node.lock();
+        bool current_frame = !node || node->hint_acked();
+        if (tx.surface_committed(to_deco_size(wf::dimensions(box)), current_frame))
         {
-            return;
-        }
-
-        LOGI("Size is ", wf::dimensions(box), " state is ", (int)deco_state);
-
-        recompute_mask ();
-
-        switch (this->deco_state)
-        {
-        case gtk3_decoration_tx_state::STABLE:
-            // Client simply committed, nothing has changed
-            return;
-
-        case gtk3_decoration_tx_state::TENTATIVE:
-            // Client commits twice?
-            return;
-
-        case gtk3_decoration_tx_state::START:
-            deco_state = gtk3_decoration_tx_state::TENTATIVE;
-            break;
-
-        case gtk3_decoration_tx_state::WAITING_FINAL:
-            deco_state = gtk3_decoration_tx_state::STABLE;
-            wf::txn::emit_object_ready(this);
-            break;
+            DSLOGT("Size is ", wf::dimensions(box), " state is ", (int)tx.get_state());
+            recompute_mask ();
         }
     }
 
     void commit()
     {
+        DECO_TRACE_SCOPE("transaction", "decoration commit");
         if (!toplevel)
         {
             wf::txn::emit_object_ready(this);
             return;
         }
         auto dec_toplevel = decorated_toplevel.lock();
+        auto pending = wf::dimensions(dec_toplevel->pending().geometry);
+        committed_at = deco_trace_enabled ? deco_trace_now() : 0;
+        auto node = deco_node.lock();
 
-        set_pending_size(wf::dimensions(dec_toplevel->pending().geometry));
-        deco_state = gtk3_decoration_tx_state::START;
+        // view_tiled_signal comes only once this is applied, too late for the hint
+        if (node)
+        {
+            if (dec_toplevel->pending().tiled_edges)
+                node->state |= STATE_MAXIMIZED;
+            else
+                node->state &= ~STATE_MAXIMIZED;
+        }
         
-        LOGI("Committing with ", pending);
+        DSLOGT("Committing with ", pending);
 
         wlr_box box;
         wlr_xdg_surface_get_geometry(toplevel->base, &box);
-        if (wf::dimensions(box) != pending)
+        if (node && wf::dimensions(box) != pending)
         {
-            wlr_xdg_toplevel_set_size(toplevel, pending.width, pending.height);
+            node->size_changing();
         }
-        else
+        else if (node && node->state != node->sent_state && !node->send_configure_hint(pending))
         {
-            wf::txn::emit_object_ready(this);
-            return;
+            // same size, the decorator redraws as soon as it gets the new state
+            node->send_state();
         }
 
-        committed = pending;
-        size_updated();
+        tx.commit(to_deco_size(pending), to_deco_size(wf::dimensions(box)));
+    }
+
+    // the decorator gets the size and the state together, then the configure
+    void request_size(deco_size_t size) override
+    {
+        if (auto node = deco_node.lock())
+            node->send_configure_hint({size.width, size.height});
+        wlr_xdg_toplevel_set_size(toplevel, size.width, size.height);
+    }
+
+    void ready() override
+    {
+        // from the commit to the frame of the final size
+        if (committed_at)
+        {
+            DECO_TRACE_END(committed_at, "transaction", "decoration round trip");
+            committed_at = 0;
+        }
+        wf::txn::emit_object_ready(this);
+    }
+
+    void state_changed(deco_tx_state_t state) override
+    {
+        static const char *names[] = {"tx STABLE", "tx START", "tx TENTATIVE", "tx WAITING_FINAL"};
+        DECO_TRACE_INSTANT("transaction", names[(int)state], view_id);
     }
 
     void apply()
     {
+        DECO_TRACE_SCOPE("transaction", "decoration apply");
         if (toplevel)
         {
             pending_state.merge_state(toplevel->base->surface);
@@ -438,6 +736,8 @@ public:
         _view = node->_view;
         auto tmp = mask.lock();
         tmp->view_id = node->view_id;
+        tmp->deco = node;
+        view_id = node->view_id;
         this->decorated_toplevel = decorated_toplevel;
         
         on_request_move.connect(&toplevel->events.request_move);
@@ -454,6 +754,8 @@ public:
         {
             auto view = _view.lock();
             auto ev = static_cast<wlr_xdg_toplevel_resize_event*>(data);
+            if (auto node = deco_node.lock())
+                node->size_changing(true);
             wf::get_core().default_wm->resize_request(view, ev->edges);
         });
 
@@ -463,12 +765,12 @@ public:
                 (wlr_xdg_toplevel_show_window_menu_event*)data;
             auto view   = _view.lock();
             auto output = view->get_output();
-            LOGI("on_show_window_menu");
+            DSLOGD("on_show_window_menu");
             if (!output)
             {
                 return;
             }
-            LOGI("on_show_window_menu ", event->x, " ",event->y);
+            DSLOGD("on_show_window_menu ", event->x, " ",event->y);
             wf::view_show_window_menu_signal d;
             d.view = view;
             d.relative_position.x = event->x;
@@ -479,8 +781,9 @@ public:
 
         on_commit.set_callback([=](void *)
                                {
+            DECO_TRACE_SCOPE("surface", "decoration surface commit");
             pending_state.merge_state(toplevel->base->surface);
-            if (deco_state == gtk3_decoration_tx_state::STABLE)
+            if (tx.get_state() == deco_tx_state_t::STABLE)
             {
                 auto tmp = deco_node.lock();
                 tmp->apply_state(std::move(pending_state));
@@ -491,19 +794,7 @@ public:
         on_destroy.set_callback([=](void *)
                                 {
             this->toplevel = nullptr;
-            switch (deco_state)
-            {
-                case gtk3_decoration_tx_state::STABLE:
-                  break;
-                case gtk3_decoration_tx_state::START:
-                  // fallthrough
-                case gtk3_decoration_tx_state::TENTATIVE:
-                  // fallthrough
-                case gtk3_decoration_tx_state::WAITING_FINAL:
-                  deco_state = gtk3_decoration_tx_state::STABLE;
-                  wf::txn::emit_object_ready(this);
-                  break;
-            } });
+            tx.destroyed(); });
 
         on_commit.connect(&toplevel->base->surface->events.commit);
         on_destroy.connect(&toplevel->base->events.destroy);
@@ -511,12 +802,12 @@ public:
 
     ~extern_decoration_object_t ()
     {
-        LOGI("extern_decoration_object_t deleted");
+        DSLOGD("extern_decoration_object_t deleted");
     }
     
 private:
-    wf::dimensions_t pending = {0, 0};
-    wf::dimensions_t committed = {0, 0};
+    decoration_tx_t tx{*this};
+    uint64_t committed_at = 0;
 
     void recompute_mask()
     {
@@ -543,7 +834,7 @@ private:
     wf::scene::surface_state_t pending_state;
     std::weak_ptr<extern_mask_node_t> mask_node;
     wf::wl_listener_wrapper on_commit, on_destroy;
-    gtk3_decoration_tx_state deco_state = gtk3_decoration_tx_state::STABLE;
+    uint32_t view_id;
 
     wlr_xdg_toplevel *toplevel;
 
@@ -557,16 +848,54 @@ static bool begins_with(const std::string &a, const std::string &b)
 
 static const std::string external_decorator_prefix = "__wf_decorator:";
 
+// margins of a decorated toplevel, tiled edges have thinner borders
+static wf::decoration_margins_t get_margins(uint edges)
+{
+    wf::decoration_margins_t margins;
+    margins.top = deco_margins.top - (edges & WLR_EDGE_TOP ? borders_delta : 0);
+    margins.left = deco_margins.left - (edges & WLR_EDGE_LEFT ? borders_delta : 0);
+    margins.right = deco_margins.right - (edges & WLR_EDGE_RIGHT ? borders_delta : 0);
+    margins.bottom = deco_margins.bottom - (edges & WLR_EDGE_BOTTOM ? borders_delta : 0);
+    return margins;
+}
+
+// re-layout every decorated view in a single transaction, so that they all
+// get the new margins in the same frame; the margins and the offset of the
+// decoration are set when the transaction is created, see on_new_tx
+static void relayout_decorated_views()
+{
+    auto tx = wf::txn::transaction_t::create();
+    for (const auto& pair : view_to_decor)
+    {
+        if (auto view = pair.second->_view.lock())
+        {
+            tx->add_object(view->toplevel());
+        }
+    }
+
+    if (!tx->get_objects().empty())
+    {
+        wf::get_core().tx_manager->schedule_transaction(std::move(tx));
+    }
+}
+
 void do_update_borders(wl_client *, struct wl_resource *, uint32_t top, uint32_t bottom, uint32_t left, uint32_t right, uint32_t delta)
 {
+    bool changed = got_borders && (deco_margins.left != (int)left || deco_margins.right != (int)right ||
+        deco_margins.bottom != (int)bottom || deco_margins.top != (int)top || borders_delta != (int)delta);
     // give sane borders, with 0 px borders resize will be impossible.
     borders_delta = delta;
     deco_margins.left = left;
     deco_margins.right = right;
     deco_margins.bottom = bottom;
     deco_margins.top = top;
-    LOGI("do_update_borders ", top, " ", bottom, " ", left, " ", right, " ", delta);
+    DSLOGI("do_update_borders ", top, " ", bottom, " ", left, " ", right, " ", delta);
     got_borders = 1;
+    // the theme or the font changed while views are decorated
+    if (changed)
+    {
+        relayout_decorated_views();
+    }
 }
 
 /* Button action sent by the client
@@ -584,7 +913,7 @@ But I'm pretty new to wayfire, up to now my knowledge reaches so far...
  
 void do_window_action(wl_client *, struct wl_resource *, uint32_t id, const char *action)
 {
-    LOGI("action ", action);
+    DSLOGD("action ", action);
     wayfire_toplevel_view view;
     for (auto &v : wf::get_core().get_all_views())
     {
@@ -608,14 +937,9 @@ void do_window_action(wl_client *, struct wl_resource *, uint32_t id, const char
             {
                 do_window_action(NULL, NULL, id, "unshade");
             }
-            if (deco->state & STATE_MAXIMIZED)
-            {
-                // this is needed because the size of margins changes
-                auto view = deco->_view.lock();
-                view->toplevel()->pending().margins = deco_margins;
-                wf::get_core().tx_manager->schedule_object(view->toplevel());
-                deco->state &= ~STATE_MAXIMIZED;
-            }
+            // the margins for the new state are set by the tile request's own
+            // transaction, see on_new_tx
+            deco->state &= ~STATE_MAXIMIZED;
         }
         if (view->pending_tiled_edges()) {
             wf::get_core().default_wm->tile_request(view, 0);
@@ -647,7 +971,7 @@ void do_window_action(wl_client *, struct wl_resource *, uint32_t id, const char
             // maybe not needed, but...
             wf::scene::set_node_enabled(deco->main_node, false);
             wf::get_core().tx_manager->schedule_object(view->toplevel());
-            wf_decorator_manager_send_view_state_changed(decorator_resource, id, deco->state);
+            deco->send_state();
         }            
     }
     else if (strcmp (action, "unshade") == 0)
@@ -660,31 +984,62 @@ void do_window_action(wl_client *, struct wl_resource *, uint32_t id, const char
             wf::scene::add_front(view->get_surface_root_node(), deco->main_node);
             wf::scene::set_node_enabled(deco->main_node, true);
             wf::get_core().tx_manager->schedule_object(view->toplevel());
-            wf_decorator_manager_send_view_state_changed(decorator_resource, id, deco->state);
+            deco->send_state();
         }            
     }
 }
 
+// requests about a view are only taken from the decorator drawing it
+void do_ack_configure_hint(wl_client *, struct wl_resource *resource, uint32_t id, uint32_t serial)
+{
+    auto it = view_to_decor.find(id);
+    if (it == view_to_decor.end() || it->second->resource != resource)
+        return;
+    DECO_TRACE_INSTANT("transaction", "hint acked", id);
+    // the ack of an older hint never takes a newer one back
+    if ((int32_t)(serial - it->second->acked_serial) > 0)
+        it->second->acked_serial = serial;
+}
+
+void do_update_hit_map(wl_client *, struct wl_resource *resource, uint32_t id, wl_array *regions)
+{
+    auto it = view_to_decor.find(id);
+    if (it == view_to_decor.end() || it->second->resource != resource)
+        return;
+    auto data = (const DecoHitRegion*)regions->data;
+    it->second->hit_map.assign(data, data + regions->size / sizeof(DecoHitRegion));
+}
+
 // protocol interface
 const struct wf_decorator_manager_interface decorator_implementation =
     {
         .update_borders = do_update_borders,
-        .window_action = do_window_action
+        .window_action = do_window_action,
+        .update_hit_map = do_update_hit_map,
+        .ack_configure_hint = do_ack_configure_hint
     };
 
-// never called
-void unbind_decorator(wl_resource *decorator_resource)
+// a decorator process went away, its slot stays empty and its decorations, which have
+// lost their resource already, are made again by the others
+void unbind_decorator(wl_resource *resource)
 {
-    wl_resource_destroy (decorator_resource);
-    decorator_resource = NULL;
+    DSLOGW("decorator gone");
+    std::replace(decorator_resources.begin(), decorator_resources.end(), resource, (wl_resource*)nullptr);
+    if (decorator_gone)
+        decorator_gone();
 }
 
-void bind_decorator(wl_client *client, void *, uint32_t, uint32_t id)
+// each process takes the first free slot, those started by hand come after
+void bind_decorator(wl_client *client, void *, uint32_t version, uint32_t id)
 {
-    LOGI("Binding wf-external-decorator");
-    auto resource = wl_resource_create(client, &wf_decorator_manager_interface, 1, id);
-    wl_resource_set_implementation(resource, &decorator_implementation, NULL, NULL);
-    decorator_resource = resource;
+    DSLOGI("Binding wf-external-decorator");
+    auto resource = wl_resource_create(client, &wf_decorator_manager_interface, version, id);
+    wl_resource_set_implementation(resource, &decorator_implementation, NULL, unbind_decorator);
+    auto slot = std::find(decorator_resources.begin(), decorator_resources.end(), nullptr);
+    if (slot != decorator_resources.end())
+        *slot = resource;
+    else
+        decorator_resources.push_back(resource);
 }
 
 class extern_toplevel_custom_data : public wf::custom_data_t
@@ -694,7 +1049,7 @@ public:
     std::shared_ptr<wf::scene::translation_node_t> translation_node;
     ~extern_toplevel_custom_data()
     {
-        LOGI("extern_toplevel_custom_data deleted");
+        DSLOGD("extern_toplevel_custom_data deleted");
     }
 };
 
@@ -706,16 +1061,16 @@ class external_decoration_plugin : public wf::plugin_interface_t
     int running = 0;
     bool first_run = true;
     wf::wl_timer<true> timer;
+    wf::wl_idle_call idle_redecorate;
+    // when each pending decoration was asked for, to trace how long it takes
+    std::map<uint32_t, uint64_t> decoration_requested;
     
     wf::signal::connection_t<wf::new_xdg_surface_signal> on_new_xdg_surface =
         [=](wf::new_xdg_surface_signal *ev)
     {
-        if (!decorator_resource)
-            return;
-
         if (ev->surface->role != WLR_XDG_SURFACE_ROLE_TOPLEVEL)
         {
-            LOGI("role");
+            DSLOGT("role");
             return;
         }
 
@@ -726,7 +1081,7 @@ class external_decoration_plugin : public wf::plugin_interface_t
             return;
         }
 
-        LOGI("Got decorator view ", toplevel->title);
+        DSLOGD("Got decorator view ", toplevel->title);
         auto id_str = std::string(toplevel->title).substr(external_decorator_prefix.length());
         auto id = std::stoul(id_str.c_str());
 
@@ -742,22 +1097,39 @@ class external_decoration_plugin : public wf::plugin_interface_t
 
         if (!target)
         {
-            LOGI("View is gone already?");
+            DSLOGW("View is gone already?");
             wlr_xdg_toplevel_send_close(toplevel);
             return;
         }
 
         if (!target->toplevel())
         {
-            LOGI("View does not support toplevel interface?");
+            DSLOGW("View does not support toplevel interface?");
             wlr_xdg_toplevel_send_close(toplevel);
             return;
         }
     
+        // the process which mapped the decoration draws it from now on
+        wl_resource *owner = NULL;
+        for (auto resource : decorator_resources)
+        {
+            if (resource && wl_resource_get_client(resource) == wl_resource_get_client(ev->surface->resource))
+            {
+                owner = resource;
+                break;
+            }
+        }
+        if (!owner)
+        {
+            DSLOGW("Decoration from an unknown client?");
+            wlr_xdg_toplevel_send_close(toplevel);
+            return;
+        }
+
         int maximized = target->pending_tiled_edges();
 
         // update title
-        wf_decorator_manager_send_title_changed(decorator_resource, target->get_id(), target->get_title().c_str());
+        wf_decorator_manager_send_title_changed(owner, target->get_id(), target->get_title().c_str());
 
         ev->use_default_implementation = false;
         
@@ -769,9 +1141,16 @@ class external_decoration_plugin : public wf::plugin_interface_t
         auto mask_node = std::make_shared<extern_mask_node_t>();
         decoration_root_node->set_children_list({mask_node});
 
-        auto deco_surf = std::make_shared<extern_decoration_node_t>(toplevel->base->surface, true, target);
+        auto deco_surf = std::make_shared<extern_decoration_node_t>(toplevel->base->surface, true, target, owner);
         
         view_to_decor[target->get_id()] = deco_surf;
+        trace_decorations(owner);
+        auto requested = decoration_requested.find(id);
+        if (requested != decoration_requested.end())
+        {
+            DECO_TRACE_END(requested->second, "decorations", "create decoration");
+            decoration_requested.erase(requested);
+        }
         
         data->decoration = std::make_shared<extern_decoration_object_t>(
             toplevel, deco_surf, mask_node, target->toplevel());
@@ -786,10 +1165,10 @@ class external_decoration_plugin : public wf::plugin_interface_t
     wf::signal::connection_t<wf::view_title_changed_signal> title_set =
         [=](wf::view_title_changed_signal *ev)
     {
-        if (decorator_resource)
+        if (auto resource = decorator_for_view(ev->view->get_id()))
         {
-            LOGI("Title changed ", ev->view->get_title());
-            wf_decorator_manager_send_title_changed(decorator_resource, ev->view->get_id(), ev->view->get_title().c_str());
+            DSLOGD("Title changed ", ev->view->get_title());
+            wf_decorator_manager_send_title_changed(resource, ev->view->get_id(), ev->view->get_title().c_str());
         }
     };
 
@@ -824,18 +1203,12 @@ class external_decoration_plugin : public wf::plugin_interface_t
                 if (auto deco = toplevel->get_data<extern_toplevel_custom_data>())
                 {
                     auto& pending = toplevel->pending();
-                    uint edges = pending.tiled_edges;
-                    
-                    wf::decoration_margins_t margins;
-                    margins.top = deco_margins.top - (edges & WLR_EDGE_TOP ? borders_delta : 0);
-                    margins.left = deco_margins.left - (edges & WLR_EDGE_LEFT ? borders_delta : 0);
-                    margins.right = deco_margins.right - (edges & WLR_EDGE_RIGHT ? borders_delta : 0);
-                    margins.bottom = deco_margins.bottom - (edges & WLR_EDGE_BOTTOM ? borders_delta : 0);
+                    auto margins = get_margins(pending.tiled_edges);
 
                     // adjust offset
                     deco->translation_node->set_offset({-margins.left, -margins.top});
 
-                    pending.margins = toplevel->pending().fullscreen ? wf::decoration_margins_t{0, 0, 0, 0} : margins;
+                    pending.margins = pending.fullscreen ? wf::decoration_margins_t{0, 0, 0, 0} : margins;
                                         
                     if (deco->decoration->first == 0)
                     {
@@ -858,7 +1231,7 @@ class external_decoration_plugin : public wf::plugin_interface_t
         auto toplvl = dynamic_cast<wf::toplevel_t *>(ev->self);
         auto deco = toplvl->get_data<extern_toplevel_custom_data>();
         wf::dassert(deco != nullptr, "obj ready for non-decorated toplevel??");
-        LOGI("on_object_ready");
+        DSLOGT("on_object_ready");
         deco->decoration->set_final_size(wf::dimensions(toplvl->committed().geometry));
     };
 
@@ -876,35 +1249,58 @@ class external_decoration_plugin : public wf::plugin_interface_t
     void send_create_decoration(wayfire_view view, bool type)
     {
         const char *app_id = view->get_app_id().c_str();
-        if (decorator_resource && app_id && strcmp(app_id,"nil"))
+        wl_resource *resource = decorator_for_view(view->get_id());
+        if (resource && app_id && strcmp(app_id,"nil"))
         {
             if(!view->get_wlr_surface())
                 return;
-            LOGI("Need decoration for ", view);
+            DSLOGD("Need decoration for ", view);
             view->connect(&title_set);
-            wf_decorator_manager_send_create_new_decoration(decorator_resource, view->get_id(), type);
+            if (deco_trace_enabled)
+                decoration_requested[view->get_id()] = deco_trace_now();
+            wf_decorator_manager_send_create_new_decoration(resource, view->get_id(), type);
         }
     }
 
     void remove_decoration(wayfire_toplevel_view view)
     {
         auto target = toplevel_cast(view);
+        wl_resource *resource = NULL;
         if (view_to_decor.count(target->get_id()))
         {
-            auto deco_node = view_to_decor[target->get_id()];
+            resource = view_to_decor[target->get_id()]->resource;
             view_to_decor.erase(target->get_id());
         }
         auto data = target->toplevel()->release_data<extern_toplevel_custom_data>();
         if (data)
         {
-            LOGI("Decoration removed ", view->get_title());
+            DSLOGD("Decoration removed ", view->get_title());
             // this is needed to properly free all nodes
             auto cl = target->get_surface_root_node()->get_children();
             auto tl = cl[1];
             wf::scene::remove_child(tl, 0);
             // tell the client to free resources
-            wf_decorator_manager_send_view_unmapped(decorator_resource, target->get_id());
-            LOGI("view_to_decor ", view_to_decor.size());
+            if (resource)
+                wf_decorator_manager_send_view_unmapped(resource, target->get_id());
+            DSLOGD("view_to_decor ", view_to_decor.size());
+        }
+    }
+
+    // the views drawn by a decorator process gone lose their decoration, which stays
+    // in view_to_decor otherwise, and get one from a process still there
+    void redecorate_orphans()
+    {
+        if (!running)
+            return;
+        for (auto &view : wf::get_core().get_all_views())
+        {
+            auto toplevel = toplevel_cast(view);
+            auto it = toplevel ? view_to_decor.find(toplevel->get_id()) : view_to_decor.end();
+            if (it == view_to_decor.end() || it->second->resource)
+                continue;
+            remove_decoration(toplevel);
+            if (toplevel->should_be_decorated() && !ignore_decoration_of_view(toplevel))
+                send_create_decoration(view, toplevel->parent != nullptr);
         }
     }
 
@@ -915,16 +1311,13 @@ class external_decoration_plugin : public wf::plugin_interface_t
 
     void decorate_present_views ()
     {
-        if (decorator_resource)
+        for (auto &view : wf::get_core().get_all_views())
         {
-            for (auto &view : wf::get_core().get_all_views())
+            auto toplevel = toplevel_cast(view);
+            if (toplevel && toplevel->should_be_decorated() && !ignore_decoration_of_view(toplevel))
             {
-                auto toplevel = toplevel_cast(view);
-                if (toplevel && toplevel->should_be_decorated() && !ignore_decoration_of_view(toplevel))
-                {
-                    send_create_decoration(view, toplevel->parent != nullptr);
-                }                    
-            }
+                send_create_decoration(view, toplevel->parent != nullptr);
+            }                    
         }
     }
 
@@ -939,31 +1332,46 @@ class external_decoration_plugin : public wf::plugin_interface_t
 
 public:
     wf::option_wrapper_t<std::string> decorator{"wf-external-decorator/decorator"};          
-    pid_t decorator_pid;
+    wf::option_wrapper_t<int> decorator_processes{"wf-external-decorator/decorator_processes"};
+    std::vector<pid_t> decorator_pids;
     
     void init() override
     {
-        LOGI("start external_decoration_plugin");
+        DSLOGI("start external_decoration_plugin");
+        deco_trace_init("wf-external-decorator");
         
         running = 1;
-        // spawn the configured client executable
-        decorator_pid = wf::get_core().run((std::string)decorator);                                              
+        // spawn the configured client executable, as many times as configured; each process
+        // is single threaded, with more of them a slow redraw holds up only its own views
+        int processes = std::max(1, (int)decorator_processes);
+        decorator_resources.assign(processes, nullptr);
+        for (int i = 0; i < processes; i++)
+        {
+            decorator_pids.push_back(wf::get_core().run((std::string)decorator));
+        }
+        // the decorator is still in the middle of the client teardown, wait for it to be done
+        decorator_gone = [=] ()
+        {
+            idle_redecorate.run_once([=] () { redecorate_orphans(); });
+        };
 
         if(first_run)
         {
             // only bind the protocol the first time
             decorator_global = wl_global_create(wf::get_core().display,
                                                 &wf_decorator_manager_interface,
-                                                1, NULL, bind_decorator);
+                                                3, NULL, bind_decorator);
             first_run = false;
         }
             
+        auto bind_deadline = std::chrono::steady_clock::now() + decorator_bind_timeout;
         timer.set_timeout(20, [=] ()
         {
-            // wait for client borders request
-            if (got_borders)
+            // wait for client borders request, and for all the processes to bind so that
+            // the views present are spread over all of them
+            if (got_borders && (decorators_bound() || std::chrono::steady_clock::now() >= bind_deadline))
             {
-                LOGI("got_borders");
+                DSLOGD("got_borders");
                 setup ();
                 return false;
             }
@@ -974,9 +1382,12 @@ public:
     
     void fini() override
     {
-        LOGI("stop external_decoration_plugin");
+        DSLOGI("stop external_decoration_plugin");
+        deco_trace_close();
         running = 0;
         got_borders = 0;
+        decorator_gone = nullptr;
+        idle_redecorate.disconnect();
         for (auto view : wf::get_core().get_all_views())
         {
             if (auto toplevel = wf::toplevel_cast(view))
@@ -984,8 +1395,21 @@ public:
                 remove_decoration(toplevel);
             }
         }
-        // kill the decoration client
-        kill (decorator_pid, SIGKILL);
+        // ask the decoration clients to quit, so that they close their traces; those still
+        // there after a while are killed by a shell, a timer of ours would be unloaded with
+        // the plugin before it fires
+        std::string pids;
+        for (pid_t pid : decorator_pids)
+        {
+            kill (pid, SIGTERM);
+            pids += " " + std::to_string(pid);
+        }
+        if (!pids.empty())
+        {
+            wf::get_core().run("sleep " + std::to_string(decorator_stop_timeout) +
+                "; kill -KILL" + pids + " 2>/dev/null");
+        }
+        decorator_pids.clear();
     }
     
 };